@@ -27,7 +27,7 @@ unsigned int apisetsize;
 void* apisetva;
 
 EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER_PROTOCOL* pe, EFI_FILE_HANDLE dir,
-                        void** va, uint16_t version, LIST_ENTRY* mappings, command_line* cmdline) {
+                        uint16_t version, LIST_ENTRY* mappings, command_line* cmdline) {
     EFI_STATUS Status;
     IMAGE_SECTION_HEADER* sections;
     UINTN num_sections;
@@ -35,7 +35,7 @@ EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER
 
     if (version == _WIN32_WINNT_WIN8) {
         image* img;
-        uint32_t size;
+        void* va;
 
         Status = add_image(bs, images, L"ApiSetSchema.dll", LoaderSystemCode, L"system32", false, NULL, 0, false);
         if (EFI_ERROR(Status)) {
@@ -45,7 +45,9 @@ EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER
 
         img = _CR(images->Blink, image, list_entry); // get last item
 
-        Status = load_image(img, L"ApiSetSchema.dll", pe, *va, dir, cmdline, 0);
+        va = va_next(VA_REGION_LOADER);
+
+        Status = load_image(img, L"ApiSetSchema.dll", pe, va, dir, cmdline, 0);
         if (EFI_ERROR(Status)) {
             print_error("load_image", Status);
             return Status;
@@ -53,12 +55,11 @@ EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER
 
         dll = img->img;
 
-        size = dll->GetSize(dll);
-
-        if ((size % EFI_PAGE_SIZE) != 0)
-            size = ((size / EFI_PAGE_SIZE) + 1) * EFI_PAGE_SIZE;
-
-        *va = (uint8_t*)*va + size;
+        Status = commit_image_va(bs, img, VA_REGION_LOADER);
+        if (EFI_ERROR(Status)) {
+            print_error("commit_image_va", Status);
+            return Status;
+        }
     } else { // only passed to NT as an image on Windows 8
         EFI_FILE_HANDLE file;
 
@@ -122,16 +123,13 @@ EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER
 
         apiset = newapiset;
 
-        apisetva = *va;
-
-        Status = add_mapping(bs, mappings, *va, apiset, page_count(apisetsize), LoaderSystemBlock);
+        Status = va_map(bs, mappings, VA_REGION_LOADER, "API set schema", apiset, page_count(apisetsize),
+                        LoaderSystemBlock, &apisetva);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             return Status;
         }
 
-        *va = (uint8_t*)*va + (page_count(apisetsize) * EFI_PAGE_SIZE);
-
         dll->Free(dll);
     }
 
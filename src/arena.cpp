@@ -0,0 +1,90 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include <wchar.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "x86.h"
+
+/* Bump allocator for objects which live until we hand over to the kernel,
+ * such as mappings, images, and drivers. Nothing is ever freed individually,
+ * which means we make far fewer calls to AllocatePool, and we don't fragment
+ * the memory map that process_memory_map has to describe. */
+
+static const unsigned int ARENA_CHUNK_PAGES = 64; // 256 KB
+static const size_t ARENA_ALIGNMENT = 16;
+
+static uint8_t* arena_ptr = nullptr;
+static size_t arena_left = 0;
+
+EFI_STATUS arena_alloc(EFI_BOOT_SERVICES* bs, size_t size, void** ptr) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    if (size == 0)
+        size = 1;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (size > arena_left) {
+        size_t pages = page_count(size);
+
+        // give large allocations their own pages, rather than wasting the rest of the chunk
+        if (pages >= ARENA_CHUNK_PAGES / 4) {
+            Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+            if (EFI_ERROR(Status)) {
+                print_error("AllocatePages", Status);
+                return Status;
+            }
+
+            *ptr = (void*)(uintptr_t)addr;
+
+            return EFI_SUCCESS;
+        }
+
+        Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, ARENA_CHUNK_PAGES, &addr);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePages", Status);
+            return Status;
+        }
+
+        arena_ptr = (uint8_t*)(uintptr_t)addr;
+        arena_left = ARENA_CHUNK_PAGES * EFI_PAGE_SIZE;
+    }
+
+    *ptr = arena_ptr;
+
+    arena_ptr += size;
+    arena_left -= size;
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS arena_strdup(EFI_BOOT_SERVICES* bs, const wchar_t* s, wchar_t** ret) {
+    EFI_STATUS Status;
+    size_t len = (wcslen(s) + 1) * sizeof(wchar_t);
+
+    Status = arena_alloc(bs, len, (void**)ret);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    memcpy(*ret, s, len);
+
+    return EFI_SUCCESS;
+}
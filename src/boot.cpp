@@ -90,6 +90,14 @@ typedef struct _command_line {
     wchar_t* hal;
     wchar_t* kernel;
     uint64_t subvol;
+    bool timings;
+    bool export_timings;
+    bool large_pages;
+    bool mem_stats;
+    bool dump_mdl;
+    bool quiet;
+    bool boot_log;
+    bool free_font;
 #ifdef _X86_
     unsigned int pae;
     unsigned int nx;
@@ -145,9 +153,9 @@ EFI_STATUS add_image(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, const wchar_t* n
     EFI_STATUS Status;
     image* img;
 
-    Status = bs->AllocatePool(EfiLoaderData, sizeof(image), (void**)&img);
+    Status = arena_alloc(bs, sizeof(image), (void**)&img);
     if (EFI_ERROR(Status)) {
-        print_error("AllocatePool", Status);
+        print_error("arena_alloc", Status);
         return Status;
     }
 
@@ -261,11 +269,12 @@ static std::optional<loader_block_variant> find_loader_block(loader_store* store
 
 template<typename T>
 static EFI_STATUS initialize_loader_block(EFI_BOOT_SERVICES* bs, loader_store* store, T& loader_block, char* options, char* path,
-                                          char* arc_name, void** va, LIST_ENTRY* mappings, LIST_ENTRY* drivers, EFI_HANDLE image_handle,
+                                          char* arc_name, LIST_ENTRY* mappings, LIST_ENTRY* drivers, EFI_HANDLE image_handle,
                                           uint16_t version, uint16_t build, LIST_ENTRY* core_drivers) {
     EFI_STATUS Status;
     char* str;
     unsigned int pathlen;
+    void* va;
 
     cpu_frequency = get_cpu_frequency(bs);
 
@@ -372,9 +381,13 @@ static EFI_STATUS initialize_loader_block(EFI_BOOT_SERVICES* bs, loader_store* s
 
     loader_block.LoadOptions = str;
 
-    *va = (uint8_t*)*va + (STACK_SIZE * EFI_PAGE_SIZE);
+    Status = va_alloc(bs, VA_REGION_SYSTEM, "unused", NULL, STACK_SIZE, 0, &va);
+    if (EFI_ERROR(Status)) {
+        print_error("va_alloc", Status);
+        return Status;
+    }
 
-    Status = find_hardware(bs, loader_block.ConfigurationRoot, va, mappings,
+    Status = find_hardware(bs, loader_block.ConfigurationRoot, mappings,
                            image_handle, version);
     if (EFI_ERROR(Status)) {
         print_error("find_hardware", Status);
@@ -382,7 +395,7 @@ static EFI_STATUS initialize_loader_block(EFI_BOOT_SERVICES* bs, loader_store* s
     }
 
     Status = find_disks(bs, &loader_block.ArcDiskInformation->DiskSignatureListHead,
-                        va, mappings, loader_block.ConfigurationRoot,
+                        mappings, loader_block.ConfigurationRoot,
                         version >= _WIN32_WINNT_WIN7 || (version == _WIN32_WINNT_VISTA && build >= 6002));
     if (EFI_ERROR(Status)) {
         print_error("find_disks", Status);
@@ -642,8 +655,7 @@ static void fix_arc_disk_mapping(ARC_DISK_INFORMATION* arc_disk_info, LIST_ENTRY
 }
 
 template<typename T>
-static void fix_loader_block_mapping(loader_store* store, void* va, T& loader_block, LIST_ENTRY* mappings,
-                                     uint16_t version, uint16_t build) {
+static void fix_loader_block_mapping(T& loader_block, LIST_ENTRY* mappings, uint16_t version, uint16_t build) {
     void* ccd_va;
 
     if constexpr (requires { decltype(T::FirmwareInformation)::EfiInformation; }) {
@@ -679,12 +691,12 @@ static void fix_loader_block_mapping(loader_store* store, void* va, T& loader_bl
     fix_config_mapping(loader_block.ConfigurationRoot, mappings, NULL, &ccd_va);
     loader_block.ConfigurationRoot = (CONFIGURATION_COMPONENT_DATA*)ccd_va;
 
-    loader_block.Extension = fix_address_mapping(loader_block.Extension, store, va);
-    loader_block.NlsData = (NLS_DATA_BLOCK*)fix_address_mapping(loader_block.NlsData, store, va);
+    loader_block.Extension = va_translate(loader_block.Extension);
+    loader_block.NlsData = (NLS_DATA_BLOCK*)va_translate(loader_block.NlsData);
 
     fix_arc_disk_mapping(loader_block.ArcDiskInformation, mappings,
                          version >= _WIN32_WINNT_WIN7 || (version == _WIN32_WINNT_VISTA && build >= 6002));
-    loader_block.ArcDiskInformation = (ARC_DISK_INFORMATION*)fix_address_mapping(loader_block.ArcDiskInformation, store, va);
+    loader_block.ArcDiskInformation = (ARC_DISK_INFORMATION*)va_translate(loader_block.ArcDiskInformation);
 
     if (loader_block.ArcBootDeviceName)
         loader_block.ArcBootDeviceName = (char*)find_virtual_address(loader_block.ArcBootDeviceName, mappings);
@@ -862,6 +874,8 @@ static void page_fault(uintptr_t error_code, uintptr_t rip, uintptr_t cs/*, uint
         //     draw_text_hex(stack[i+3], &p);
         //     draw_text("\n", &p);
         // }
+
+        flush_console();
     }
 
     halt();
@@ -1125,52 +1139,61 @@ EFI_STATUS open_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* h, const wchar_t* nam
     return EFI_INVALID_PARAMETER;
 }
 
+static EFI_STATUS get_file_size(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE file, size_t* file_size) {
+    EFI_STATUS Status;
+    EFI_FILE_INFO file_info;
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+    UINTN size = sizeof(EFI_FILE_INFO);
+
+    Status = file->GetInfo(file, &guid, &size, &file_info);
+
+    if (Status == EFI_BUFFER_TOO_SMALL) {
+        EFI_FILE_INFO* file_info2;
+
+        Status = bs->AllocatePool(EfiLoaderData, size, (void**)&file_info2);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePool", Status);
+            return Status;
+        }
+
+        Status = file->GetInfo(file, &guid, &size, file_info2);
+        if (EFI_ERROR(Status)) {
+            print_error("file->GetInfo", Status);
+            bs->FreePool(file_info2);
+            return Status;
+        }
+
+        *file_size = file_info2->FileSize;
+
+        bs->FreePool(file_info2);
+    } else if (EFI_ERROR(Status)) {
+        print_error("file->GetInfo", Status);
+        return Status;
+    } else
+        *file_size = file_info.FileSize;
+
+    return EFI_SUCCESS;
+}
+
 EFI_STATUS read_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const wchar_t* name, void** data, size_t* size) {
     EFI_STATUS Status;
     EFI_FILE_HANDLE file;
     size_t file_size, pages;
     EFI_PHYSICAL_ADDRESS addr;
 
+    // callers deal with missing files themselves, as some of them are optional
     Status = open_file(dir, &file, name);
     if (EFI_ERROR(Status)) {
-        print_error("open_file", Status);
+        if (Status != EFI_NOT_FOUND)
+            print_error("open_file", Status);
+
         return Status;
     }
 
-    {
-        EFI_FILE_INFO file_info;
-        EFI_GUID guid = EFI_FILE_INFO_ID;
-        UINTN size = sizeof(EFI_FILE_INFO);
-
-        Status = file->GetInfo(file, &guid, &size, &file_info);
-
-        if (Status == EFI_BUFFER_TOO_SMALL) {
-            EFI_FILE_INFO* file_info2;
-
-            Status = bs->AllocatePool(EfiLoaderData, size, (void**)&file_info2);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePool", Status);
-                file->Close(file);
-                return Status;
-            }
-
-            Status = file->GetInfo(file, &guid, &size, file_info2);
-            if (EFI_ERROR(Status)) {
-                print_error("file->GetInfo", Status);
-                bs->FreePool(file_info2);
-                file->Close(file);
-                return Status;
-            }
-
-            file_size = file_info2->FileSize;
-
-            bs->FreePool(file_info2);
-        } else if (EFI_ERROR(Status)) {
-            print_error("file->GetInfo", Status);
-            file->Close(file);
-            return Status;
-        } else
-            file_size = file_info.FileSize;
+    Status = get_file_size(bs, file, &file_size);
+    if (EFI_ERROR(Status)) {
+        file->Close(file);
+        return Status;
     }
 
     pages = file_size / EFI_PAGE_SIZE;
@@ -1377,7 +1400,7 @@ static EFI_STATUS load_nls(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_
 }
 
 static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, HKEY ccs, LIST_ENTRY* images, LIST_ENTRY* boot_drivers,
-                               LIST_ENTRY* mappings, void** va, LIST_ENTRY* core_drivers, int32_t hwconfig, const wchar_t* fs_driver) {
+                               LIST_ENTRY* mappings, LIST_ENTRY* core_drivers, int32_t hwconfig, const wchar_t* fs_driver) {
     EFI_STATUS Status;
     HKEY services, sgokey;
     wchar_t name[255], group[255], *sgo;
@@ -1498,42 +1521,30 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
 
         // FIXME - check dir and image_name definitely have values
 
-        Status = bs->AllocatePool(EfiLoaderData, sizeof(driver), (void**)&d);
+        Status = arena_alloc(bs, sizeof(driver), (void**)&d);
         if (EFI_ERROR(Status)) {
-            print_error("AllocatePool", Status);
+            print_error("arena_alloc", Status);
             goto end;
         }
 
-        Status = bs->AllocatePool(EfiLoaderData, (wcslen(name) + 1) * sizeof(wchar_t), (void**)&d->name);
+        Status = arena_strdup(bs, name, &d->name);
         if (EFI_ERROR(Status)) {
-            print_error("AllocatePool", Status);
-            bs->FreePool(d);
+            print_error("arena_strdup", Status);
             goto end;
         }
 
-        memcpy(d->name, name, (wcslen(name) + 1) * sizeof(wchar_t));
-
-        Status = bs->AllocatePool(EfiLoaderData, (wcslen(image_name) + 1) * sizeof(wchar_t), (void**)&d->file);
+        Status = arena_strdup(bs, image_name, &d->file);
         if (EFI_ERROR(Status)) {
-            print_error("AllocatePool", Status);
-            bs->FreePool(d->name);
-            bs->FreePool(d);
+            print_error("arena_strdup", Status);
             goto end;
         }
 
-        memcpy(d->file, image_name, (wcslen(image_name) + 1) * sizeof(wchar_t));
-
-        Status = bs->AllocatePool(EfiLoaderData, (wcslen(dir) + 1) * sizeof(wchar_t), (void**)&d->dir);
+        Status = arena_strdup(bs, dir, &d->dir);
         if (EFI_ERROR(Status)) {
-            print_error("AllocatePool", Status);
-            bs->FreePool(d->file);
-            bs->FreePool(d->name);
-            bs->FreePool(d);
+            print_error("arena_strdup", Status);
             goto end;
         }
 
-        memcpy(d->dir, dir, (wcslen(dir) + 1) * sizeof(wchar_t));
-
         d->group = NULL;
 
         length = sizeof(group);
@@ -1543,17 +1554,11 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
         if (!EFI_ERROR(Status) && reg_type == REG_SZ) {
             group[length / sizeof(wchar_t)] = 0;
 
-            Status = bs->AllocatePool(EfiLoaderData, (wcslen(group) + 1) * sizeof(wchar_t), (void**)&d->group);
+            Status = arena_strdup(bs, group, &d->group);
             if (EFI_ERROR(Status)) {
-                print_error("AllocatePool", Status);
-                bs->FreePool(d->dir);
-                bs->FreePool(d->file);
-                bs->FreePool(d->name);
-                bs->FreePool(d);
+                print_error("arena_strdup", Status);
                 goto end;
             }
-
-            memcpy(d->group, group, (wcslen(group) + 1) * sizeof(wchar_t));
         }
 
         length = sizeof(tag);
@@ -1712,7 +1717,7 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
     {
         EFI_PHYSICAL_ADDRESS addr;
         void* pa;
-        void* va2 = *va;
+        void* va;
         unsigned int imgnum = 1;
 
         Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, page_count(boot_list_size), &addr);
@@ -1784,34 +1789,17 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
             le = le->Flink;
         }
 
-        Status = add_mapping(bs, mappings, va2, (void*)(uintptr_t)addr, page_count(boot_list_size), LoaderSystemBlock);
+        Status = va_map(bs, mappings, VA_REGION_LOADER, "boot driver list", (void*)(uintptr_t)addr,
+                        page_count(boot_list_size), LoaderSystemBlock, &va);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
-
-        va2 = (uint8_t*)va2 + (page_count(boot_list_size) * EFI_PAGE_SIZE);
-        *va = va2;
     }
 
     Status = EFI_SUCCESS;
 
 end:
-    while (!IsListEmpty(&drivers)) {
-        driver* d = _CR(drivers.Flink, driver, list_entry);
-
-        RemoveEntryList(&d->list_entry);
-
-        bs->FreePool(d->name);
-        bs->FreePool(d->file);
-        bs->FreePool(d->dir);
-
-        if (d->group)
-            bs->FreePool(d->group);
-
-        bs->FreePool(d);
-    }
-
     return Status;
 }
 
@@ -1881,33 +1869,178 @@ static EFI_STATUS load_errata_inf(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive
     return Status;
 }
 
-static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_REGISTRY_PROTOCOL* reg,
-                                void** data, uint32_t* size, LIST_ENTRY* images, LIST_ENTRY* drivers, LIST_ENTRY* mappings,
-                                void** va, uint16_t version, uint16_t build, EFI_FILE_HANDLE windir, LIST_ENTRY* core_drivers,
-                                wchar_t* fs_driver) {
+typedef struct {
+    EFI_FILE_HANDLE file;
+    void* data;
+    size_t size;
+    size_t pages;
+    EFI_FILE_IO_TOKEN token;
     EFI_STATUS Status;
-    EFI_FILE_HANDLE file = NULL;
-    EFI_REGISTRY_HIVE* hive;
-    uint32_t set, length, type;
-    HKEY rootkey, key, ccs;
-    wchar_t ccs_name[14];
-    int32_t hwconfig = -1;
+} hive_read;
 
-    Status = open_file(system32, &file, L"config\\SYSTEM");
-    if (EFI_ERROR(Status))
-        return Status;
+/* Reading the SYSTEM hive is one of the slowest parts of booting, but we can't
+ * parse it until we know which version of Windows we're dealing with. So we
+ * start the read before loading the kernel, and if the filesystem driver
+ * supports ReadEx it carries on in the background while the kernel is loaded. */
+static EFI_STATUS start_hive_read(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, hive_read* hr) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
 
-    Status = reg->OpenHive(file, &hive);
+    hr->data = NULL;
+    hr->token.Event = NULL;
+
+    Status = open_file(system32, &hr->file, L"config\\SYSTEM");
     if (EFI_ERROR(Status)) {
-        print_error("OpenHive", Status);
-        file->Close(file);
+        hr->file = NULL;
         return Status;
     }
 
-    Status = file->Close(file);
+    Status = get_file_size(bs, hr->file, &hr->size);
+    if (EFI_ERROR(Status))
+        goto fail;
+
+    hr->pages = page_count(hr->size);
+
+    if (hr->pages == 0) {
+        Status = EFI_INVALID_PARAMETER;
+        goto fail;
+    }
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, hr->pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        goto fail;
+    }
+
+    hr->data = (void*)(uintptr_t)addr;
+
+    if (hr->file->Revision >= EFI_FILE_HANDLE_REVISION2) {
+        Status = bs->CreateEvent(0, 0, NULL, NULL, &hr->token.Event);
+
+        if (!EFI_ERROR(Status)) {
+            hr->token.Status = EFI_SUCCESS;
+            hr->token.BufferSize = hr->pages * EFI_PAGE_SIZE;
+            hr->token.Buffer = hr->data;
+
+            Status = hr->file->ReadEx(hr->file, &hr->token);
+            if (!EFI_ERROR(Status)) {
+                hr->Status = EFI_NOT_READY;
+                return EFI_SUCCESS;
+            }
+
+            bs->CloseEvent(hr->token.Event);
+        }
+
+        // fall back to synchronous read
+        hr->token.Event = NULL;
+    }
+
+    {
+        UINTN read_size = hr->pages * EFI_PAGE_SIZE;
+
+        hr->Status = hr->file->Read(hr->file, &read_size, hr->data);
+        hr->token.BufferSize = read_size;
+    }
+
+    return EFI_SUCCESS;
+
+fail:
+    hr->file->Close(hr->file);
+    hr->file = NULL;
+
+    return Status;
+}
+
+static void wait_hive_read(EFI_BOOT_SERVICES* bs, hive_read* hr) {
+    EFI_STATUS Status;
+
+    if (hr->token.Event) {
+        UINTN index;
+
+        Status = bs->WaitForEvent(1, &hr->token.Event, &index);
+        if (EFI_ERROR(Status)) {
+            print_error("WaitForEvent", Status);
+            hr->Status = Status;
+
+            // read might still be in progress, so we mustn't free the buffer
+            hr->data = NULL;
+        } else
+            hr->Status = hr->token.Status;
+
+        bs->CloseEvent(hr->token.Event);
+        hr->token.Event = NULL;
+    }
+
+    Status = hr->file->Close(hr->file);
     if (EFI_ERROR(Status))
         print_error("file close", Status);
 
+    hr->file = NULL;
+}
+
+static void abort_hive_read(EFI_BOOT_SERVICES* bs, hive_read* hr) {
+    if (!hr->file)
+        return;
+
+    wait_hive_read(bs, hr);
+
+    if (hr->data) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)hr->data, hr->pages);
+        hr->data = NULL;
+    }
+}
+
+static EFI_STATUS finish_hive_read(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_PROTOCOL* reg, hive_read* hr,
+                                   EFI_REGISTRY_HIVE** hive) {
+    EFI_STATUS Status;
+
+    wait_hive_read(bs, hr);
+
+    if (EFI_ERROR(hr->Status)) {
+        print_error("file->Read", hr->Status);
+
+        if (hr->data) {
+            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)hr->data, hr->pages);
+            hr->data = NULL;
+        }
+
+        return hr->Status;
+    }
+
+    if (hr->token.BufferSize < hr->size) {
+        print_string("Short read of SYSTEM hive.\n");
+        Status = EFI_VOLUME_CORRUPTED;
+        goto fail;
+    }
+
+    // the hive only takes ownership of the buffer if this succeeds
+    Status = reg->OpenHiveFromBuffer(hr->data, hr->size, hive);
+    if (EFI_ERROR(Status)) {
+        print_error("OpenHiveFromBuffer", Status);
+        goto fail;
+    }
+
+    hr->data = NULL;
+
+    return EFI_SUCCESS;
+
+fail:
+    bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)hr->data, hr->pages);
+    hr->data = NULL;
+
+    return Status;
+}
+
+static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_REGISTRY_HIVE* hive,
+                                void** data, uint32_t* size, LIST_ENTRY* images, LIST_ENTRY* drivers, LIST_ENTRY* mappings,
+                                uint16_t version, uint16_t build, EFI_FILE_HANDLE windir, LIST_ENTRY* core_drivers,
+                                wchar_t* fs_driver) {
+    EFI_STATUS Status;
+    uint32_t set, length, type;
+    HKEY rootkey, key, ccs;
+    wchar_t ccs_name[14];
+    int32_t hwconfig = -1;
+
     // find where CurrentControlSet should point to
 
     // FIXME - LastKnownGood?
@@ -1996,7 +2129,7 @@ static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32,
         // FIXME - also grab GUID, and put into loader block?
     }
 
-    Status = load_drivers(bs, hive, ccs, images, drivers, mappings, va, version >= _WIN32_WINNT_WIN8 ? core_drivers : NULL,
+    Status = load_drivers(bs, hive, ccs, images, drivers, mappings, version >= _WIN32_WINNT_WIN8 ? core_drivers : NULL,
                           hwconfig, fs_driver);
     if (EFI_ERROR(Status)) {
         print_error("load_drivers", Status);
@@ -2030,64 +2163,46 @@ end:
     return Status;
 }
 
-static EFI_STATUS map_nls(EFI_BOOT_SERVICES* bs, NLS_DATA_BLOCK* nls, void** va, LIST_ENTRY* mappings) {
+static EFI_STATUS map_nls(EFI_BOOT_SERVICES* bs, NLS_DATA_BLOCK* nls, LIST_ENTRY* mappings) {
     EFI_STATUS Status;
-    void* va2 = *va;
 
-    Status = add_mapping(bs, mappings, va2, (void*)(uintptr_t)nls->AnsiCodePageData,
-                         page_count(acp_size), LoaderNlsData);
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "ANSI code page", nls->AnsiCodePageData,
+                    page_count(acp_size), LoaderNlsData, &nls->AnsiCodePageData);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
-    nls->AnsiCodePageData = va2;
-    va2 = (uint8_t*)va2 + (page_count(acp_size) * EFI_PAGE_SIZE);
-
-    Status = add_mapping(bs, mappings, va2, (void*)(uintptr_t)nls->OemCodePageData,
-                         page_count(oemcp_size), LoaderNlsData);
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "OEM code page", nls->OemCodePageData,
+                    page_count(oemcp_size), LoaderNlsData, &nls->OemCodePageData);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
-    nls->OemCodePageData = va2;
-    va2 = (uint8_t*)va2 + (page_count(oemcp_size) * EFI_PAGE_SIZE);
-
-    Status = add_mapping(bs, mappings, va2, (void*)(uintptr_t)nls->UnicodeCodePageData,
-                         page_count(lang_size), LoaderNlsData);
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "Unicode code page", nls->UnicodeCodePageData,
+                    page_count(lang_size), LoaderNlsData, &nls->UnicodeCodePageData);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
-    nls->UnicodeCodePageData = va2;
-    va2 = (uint8_t*)va2 + (page_count(lang_size) * EFI_PAGE_SIZE);
-
-    *va = va2;
-
     return EFI_SUCCESS;
 }
 
 template<typename T>
-static EFI_STATUS map_errata_inf(EFI_BOOT_SERVICES* bs, T& extblock, void** va,
-                                 LIST_ENTRY* mappings) {
+static EFI_STATUS map_errata_inf(EFI_BOOT_SERVICES* bs, T& extblock, LIST_ENTRY* mappings) {
     EFI_STATUS Status;
-    void* va2 = *va;
 
-    Status = add_mapping(bs, mappings, va2, errata_inf, page_count(errata_inf_size), LoaderRegistryData);
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "errata.inf", errata_inf, page_count(errata_inf_size),
+                    LoaderRegistryData, &extblock.EmInfFileImage);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
-    extblock.EmInfFileImage = va2;
     extblock.EmInfFileSize = errata_inf_size;
 
-    va2 = (uint8_t*)va2 + (page_count(errata_inf_size) * EFI_PAGE_SIZE);
-
-    *va = va2;
-
     return EFI_SUCCESS;
 }
 
@@ -2146,11 +2261,10 @@ static void add_loader_entry(image* img, LIST_ENTRY& load_order_list_head, void*
 }
 
 static EFI_STATUS generate_images_list(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, LIST_ENTRY& load_order_list_head,
-                                       void** va, LIST_ENTRY* mappings) {
+                                       LIST_ENTRY* mappings) {
     EFI_STATUS Status;
     LIST_ENTRY* le;
     size_t size = 0;
-    EFI_PHYSICAL_ADDRESS addr;
     void* pa;
 
     le = images->Flink;
@@ -2167,14 +2281,12 @@ static EFI_STATUS generate_images_list(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images
         le = le->Flink;
     }
 
-    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, page_count(size), &addr);
+    Status = slab_alloc(bs, mappings, size, &pa);
     if (EFI_ERROR(Status)) {
-        print_error("AllocatePages", Status);
+        print_error("slab_alloc", Status);
         return Status;
     }
 
-    pa = (void*)(uintptr_t)addr;
-
     le = images->Flink;
     while (le != images) {
         image* img = _CR(le, image, list_entry);
@@ -2185,14 +2297,6 @@ static EFI_STATUS generate_images_list(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images
         le = le->Flink;
     }
 
-    Status = add_mapping(bs, mappings, *va, (void*)(uintptr_t)addr, page_count(size), LoaderSystemBlock);
-    if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
-        return Status;
-    }
-
-    *va = (uint8_t*)*va + (page_count(size) * EFI_PAGE_SIZE);
-
     return EFI_SUCCESS;
 }
 
@@ -2253,7 +2357,7 @@ static EFI_STATUS make_images_contiguous(EFI_BOOT_SERVICES* bs, LIST_ENTRY* imag
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS load_drvdb(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir, void** va, LIST_ENTRY* mappings,
+static EFI_STATUS load_drvdb(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir, LIST_ENTRY* mappings,
                              void*& DrvDBImage, uintptr_t& DrvDBSize) {
     EFI_STATUS Status;
     void* data;
@@ -2273,17 +2377,15 @@ static EFI_STATUS load_drvdb(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir, void
     if (size == 0)
         return EFI_SUCCESS;
 
-    Status = add_mapping(bs, mappings, *va, data, page_count(size), LoaderRegistryData);
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "drvmain.sdb", data, page_count(size), LoaderRegistryData,
+                    &DrvDBImage);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
-    DrvDBImage = *va;
     DrvDBSize = size;
 
-    *va = (uint8_t*)*va + (page_count(size) * EFI_PAGE_SIZE);
-
     return EFI_SUCCESS;
 }
 
@@ -2443,7 +2545,20 @@ EFI_STATUS load_image(image* img, const wchar_t* name, EFI_PE_LOADER_PROTOCOL* p
 
     img->va = va;
 
-    Status = pe->Load(file, !is_kdstub ? va : NULL, &img->img);
+    {
+        char s[255], *p;
+        unsigned int phase;
+
+        p = stpcpy(s, "load_image ");
+        p = stpcpy_utf16(p, img->name);
+
+        phase = image_phase_begin(s);
+
+        Status = pe->Load(file, !is_kdstub ? va : NULL, &img->img);
+
+        image_phase_end(phase);
+    }
+
     if (EFI_ERROR(Status)) {
         char s[255], *p;
 
@@ -2643,6 +2758,42 @@ end:
     return EFI_SUCCESS;
 }
 
+EFI_STATUS commit_image_va(EFI_BOOT_SERVICES* bs, image* img, unsigned int region) {
+    EFI_STATUS Status;
+    char name[255];
+    size_t pages = page_count(img->img->GetSize(img->img));
+    void* va;
+
+    stpcpy_utf16(name, img->name);
+
+    // we only know how big the image is once it's loaded, so it may have run into something identity-mapped
+    va = va_place(img->va, pages);
+
+    if (va != img->va) {
+        {
+            char s[255], *p;
+
+            p = stpcpy(s, "Moving ");
+            p = stpcpy(p, name);
+            p = stpcpy(p, " to ");
+            p = hex_to_str(p, (uintptr_t)va);
+            p = stpcpy(p, " to avoid identity-mapped memory.\n");
+
+            print_string(s);
+        }
+
+        Status = img->img->Relocate(img->img, (uintptr_t)va);
+        if (EFI_ERROR(Status)) {
+            print_error("Relocate", Status);
+            return Status;
+        }
+
+        img->va = va;
+    }
+
+    return va_commit(bs, region, name, img->va, pages);
+}
+
 static EFI_STATUS load_kernel(image* img, EFI_PE_LOADER_PROTOCOL* pe, void* va, EFI_FILE_HANDLE system32,
                               command_line* cmdline) {
     EFI_STATUS Status;
@@ -2731,6 +2882,14 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
     static const char hal[] = "HAL=";
     static const char kernel[] = "KERNEL=";
     static const char subvol[] = "SUBVOL=";
+    static const char timings[] = "TIMINGS";
+    static const char export_timings[] = "EXPORTTIMINGS";
+    static const char large_pages[] = "LARGEPAGES";
+    static const char mem_stats[] = "MEMSTATS";
+    static const char dump_mdl[] = "DUMPMDL";
+    static const char quiet[] = "QUIETBOOT";
+    static const char boot_log[] = "BOOTLOG";
+    static const char free_font[] = "FREEFONT";
 #ifdef _X86_
     static const char pae[] = "PAE";
     static const char nopae[] = "NOPAE";
@@ -2832,6 +2991,22 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
         }
 
         cmdline->subvol = sn;
+    } else if (len == sizeof(timings) - 1 && !strnicmp(option, timings, sizeof(timings) - 1)) {
+        cmdline->timings = true;
+    } else if (len == sizeof(export_timings) - 1 && !strnicmp(option, export_timings, sizeof(export_timings) - 1)) {
+        cmdline->export_timings = true;
+    } else if (len == sizeof(large_pages) - 1 && !strnicmp(option, large_pages, sizeof(large_pages) - 1)) {
+        cmdline->large_pages = true;
+    } else if (len == sizeof(mem_stats) - 1 && !strnicmp(option, mem_stats, sizeof(mem_stats) - 1)) {
+        cmdline->mem_stats = true;
+    } else if (len == sizeof(dump_mdl) - 1 && !strnicmp(option, dump_mdl, sizeof(dump_mdl) - 1)) {
+        cmdline->dump_mdl = true;
+    } else if (len == sizeof(quiet) - 1 && !strnicmp(option, quiet, sizeof(quiet) - 1)) {
+        cmdline->quiet = true;
+    } else if (len == sizeof(boot_log) - 1 && !strnicmp(option, boot_log, sizeof(boot_log) - 1)) {
+        cmdline->boot_log = true;
+    } else if (len == sizeof(free_font) - 1 && !strnicmp(option, free_font, sizeof(free_font) - 1)) {
+        cmdline->free_font = true;
 #ifdef _X86_
     } else if (len == sizeof(pae) - 1 && !strnicmp(option, pae, sizeof(pae) - 1))
         cmdline->pae = PAE_FORCEENABLE;
@@ -2853,7 +3028,7 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
     }
 }
 
-static EFI_STATUS allocate_pcr(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** va, uint16_t build, void** pcrva) {
+static EFI_STATUS allocate_pcr(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uint16_t build, void** pcrva) {
     EFI_STATUS Status;
     EFI_PHYSICAL_ADDRESS addr;
     void* pcr;
@@ -2883,8 +3058,11 @@ static EFI_STATUS allocate_pcr(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void
         *pcrva = (void*)KIP0PCRADDRESS;
     else {
 #endif
-        *pcrva = *va;
-        *va = (uint8_t*)*va + (pages * EFI_PAGE_SIZE);
+        Status = va_alloc(bs, VA_REGION_SYSTEM, "PCR", pcr, pages, 0, pcrva);
+        if (EFI_ERROR(Status)) {
+            print_error("va_alloc", Status);
+            return Status;
+        }
 #ifdef _X86_
     }
 #endif
@@ -3111,7 +3289,7 @@ end:
 }
 
 template<typename T>
-static EFI_STATUS init_bgcontext(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** va,
+static EFI_STATUS init_bgcontext(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings,
                                  uint16_t version, uint16_t build, void* bgc, T& extblock) {
     EFI_STATUS Status;
     unsigned int bg_version;
@@ -3152,9 +3330,10 @@ static EFI_STATUS init_bgcontext(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, vo
 
     // map framebuffer
 
-    Status = add_mapping(bs, mappings, *va, framebuffer, page_count(framebuffer_size), LoaderFirmwarePermanent);
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "framebuffer", framebuffer, page_count(framebuffer_size),
+                    LoaderFirmwarePermanent, &framebuffer_va);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
@@ -3170,11 +3349,7 @@ static EFI_STATUS init_bgcontext(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, vo
 #ifdef __x86_64__
     block1->internal.bits_per_pixel = 32;
 #endif
-    block1->internal.framebuffer = *va;
-
-    framebuffer_va = *va;
-
-    *va = (uint8_t*)*va + (page_count(framebuffer_size) * EFI_PAGE_SIZE);
+    block1->internal.framebuffer = framebuffer_va;
 
     // allocate and map reserve pool (used as scratch space?)
 
@@ -3186,45 +3361,36 @@ static EFI_STATUS init_bgcontext(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, vo
         return Status;
     }
 
-    Status = add_mapping(bs, mappings, *va, (void*)(uintptr_t)rp,
-                            page_count(block2->reserve_pool_size), LoaderFirmwarePermanent); // FIXME - what should the memory type be?
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "reserve pool", (void*)(uintptr_t)rp,
+                    page_count(block2->reserve_pool_size), LoaderFirmwarePermanent, // FIXME - what should the memory type be?
+                    &block2->reserve_pool);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         return Status;
     }
 
-    block2->reserve_pool = *va;
-
-    *va = (uint8_t*)*va + (page_count(block2->reserve_pool_size) * EFI_PAGE_SIZE);
-
     // map fonts
 
     if (system_font) {
-        Status = add_mapping(bs, mappings, *va, system_font, page_count(system_font_size),
-                                LoaderFirmwarePermanent); // FIXME - what should the memory type be?
+        Status = va_map(bs, mappings, VA_REGION_SYSTEM, "system font", system_font, page_count(system_font_size),
+                        LoaderFirmwarePermanent, &block1->system_font); // FIXME - what should the memory type be?
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             return Status;
         }
 
-        block1->system_font = *va;
         block1->system_font_size = system_font_size;
-
-        *va = (uint8_t*)*va + (page_count(system_font_size) * EFI_PAGE_SIZE);
     }
 
     if (console_font) {
-        Status = add_mapping(bs, mappings, *va, console_font, page_count(console_font_size),
-                                LoaderFirmwarePermanent); // FIXME - what should the memory type be?
+        Status = va_map(bs, mappings, VA_REGION_SYSTEM, "console font", console_font, page_count(console_font_size),
+                        LoaderFirmwarePermanent, &block1->console_font); // FIXME - what should the memory type be?
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             return Status;
         }
 
-        block1->console_font = *va;
         block1->console_font_size = console_font_size;
-
-        *va = (uint8_t*)*va + (page_count(console_font_size) * EFI_PAGE_SIZE);
     }
 
     if (bg_edid && have_edid)
@@ -3236,21 +3402,20 @@ static EFI_STATUS init_bgcontext(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, vo
     return Status;
 }
 
-static EFI_STATUS map_debug_descriptor(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** va, DEBUG_DEVICE_DESCRIPTOR* ddd) {
+static EFI_STATUS map_debug_descriptor(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, DEBUG_DEVICE_DESCRIPTOR* ddd) {
     EFI_STATUS Status;
-    void* va2 = *va;
 
     for (unsigned int i = 0; i < MAXIMUM_DEBUG_BARS; i++) {
         if (ddd->BaseAddress[i].Valid && ddd->BaseAddress[i].Type == CmResourceTypeMemory) {
+            void* va;
+
             // FIXME - disable write-caching etc.
-            Status = add_mapping(bs, mappings, va2, ddd->BaseAddress[i].TranslatedAddress,
-                                 page_count(ddd->BaseAddress[i].Length), LoaderFirmwarePermanent);
+            Status = va_map(bs, mappings, VA_REGION_SYSTEM, "debug device BAR", ddd->BaseAddress[i].TranslatedAddress,
+                            page_count(ddd->BaseAddress[i].Length), LoaderFirmwarePermanent, &va);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("va_map", Status);
                 return Status;
             }
-
-            va2 = (uint8_t*)va2 + (page_count(ddd->BaseAddress[i].Length) * EFI_PAGE_SIZE);
         }
     }
 
@@ -3265,8 +3430,6 @@ static EFI_STATUS map_debug_descriptor(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappin
 //         va2 = (uint8_t*)va2 + ddd->Memory.Length;
 //     }
 
-    *va = va2;
-
     return EFI_SUCCESS;
 }
 
@@ -3304,6 +3467,37 @@ static EFI_STATUS load_fonts(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir) {
 void call_startup(void* stack, void* loader_block, void* KiSystemStartup);
 #endif
 
+/* Tells the OS where to find something of ours, by appending name and the address to
+ * SystemStartOptions. If *allocated is set, *options came from an earlier call, and is
+ * freed once it's been copied. */
+static EFI_STATUS add_address_option(EFI_BOOT_SERVICES* bs, char** options, bool* allocated, const char* name,
+                                     void* pa) {
+    EFI_STATUS Status;
+    char* new_options;
+    char* p;
+    size_t options_len = *options ? strlen(*options) : 0;
+
+    Status = bs->AllocatePool(EfiLoaderData, options_len + strlen(name) + 1 + 16, (void**)&new_options);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    if (*options)
+        memcpy(new_options, *options, options_len);
+
+    p = stpcpy(new_options + options_len, name);
+    hex_to_str(p, (uintptr_t)pa);
+
+    if (*allocated)
+        bs->FreePool(*options);
+
+    *options = new_options;
+    *allocated = true;
+
+    return EFI_SUCCESS;
+}
+
 static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE root, char* options,
                        char* path, char* arc_name, EFI_PE_LOADER_PROTOCOL* pe, EFI_REGISTRY_PROTOCOL* reg,
                        command_line* cmdline, wchar_t* fs_driver) {
@@ -3313,7 +3507,6 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
     KERNEL_ENTRY_POINT KiSystemStartup;
     LIST_ENTRY* le;
     void* va;
-    void* va2;
     loader_store* store;
     gdt_entry* gdt;
     idt_entry* idt;
@@ -3339,10 +3532,14 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
     wchar_t* pathw;
     KPCR* pcrva = NULL;
     bool kdstub_export_loaded = false;
+    bool options_allocated = false;
     std::optional<loader_block_variant> loader_block_opt;
     loader_block_variant loader_block;
     std::optional<extension_block_variant> extension_block_opt;
     extension_block_variant extension_block;
+    unsigned int phase;
+    hive_read hr;
+    EFI_REGISTRY_HIVE* hive;
 
     static const wchar_t drivers_dir_path[] = L"system32\\drivers";
 
@@ -3392,6 +3589,9 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     InitializeListHead(&images);
     InitializeListHead(&mappings);
+    index_reset(&mappings);
+
+    hr.file = NULL;
 
     Status = add_image(bs, &images, L"ntoskrnl.exe", LoaderSystemCode, L"system32", false, NULL, 0, false);
     if (EFI_ERROR(Status)) {
@@ -3405,13 +3605,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         goto end;
     }
 
-#ifdef _X86_
-    va = (void*)0x80000000;
-#elif defined(__x86_64__)
-    va = (void*)0xfffff80000000000;
-#endif
-
-    Status = process_memory_map(bs, &va, &mappings);
+    Status = process_memory_map(bs, &mappings);
     if (EFI_ERROR(Status)) {
         print_error("process_memory_map", Status);
         goto end;
@@ -3420,21 +3614,30 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
     InitializeListHead(&drivers);
     InitializeListHead(&core_drivers);
 
-#ifdef _X86_
-    // load kernel at 81800000, to match Windows
-    // FIXME - make sure no overlap! Load registry before kernel, and only then errata.inf?
+    phase = phase_begin("start SYSTEM hive read");
 
-    va2 = (void*)0x81800000;
-#elif defined(__x86_64__)
-    va2 = (void*)0xfffff80800000000;
-#endif
+    Status = start_hive_read(bs, system32, &hr);
 
-    Status = load_kernel(_CR(images.Flink, image, list_entry), pe, va2, system32, cmdline);
+    phase_end(phase);
+
+    if (EFI_ERROR(Status)) {
+        print_error("start_hive_read", Status);
+        goto end;
+    }
+
+    // kernel goes at the start of the system region, to match Windows
+    Status = load_kernel(_CR(images.Flink, image, list_entry), pe, va_next(VA_REGION_SYSTEM), system32, cmdline);
     if (EFI_ERROR(Status)) {
         print_error("load_kernel", Status);
         goto end;
     }
 
+    Status = commit_image_va(bs, _CR(images.Flink, image, list_entry), VA_REGION_SYSTEM);
+    if (EFI_ERROR(Status)) {
+        print_error("commit_image_va", Status);
+        goto end;
+    }
+
     Status = _CR(images.Flink, image, list_entry)->img->GetVersion(_CR(images.Flink, image, list_entry)->img, &version_ms, &version_ls);
     if (EFI_ERROR(Status)) {
         print_error("GetVersion", Status);
@@ -3476,8 +3679,24 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
     }
 
 
-    Status = load_registry(bs, system32, reg, &registry, &reg_size, &images, &drivers, &mappings, &va, version, build,
+    phase = phase_begin("finish SYSTEM hive read");
+
+    Status = finish_hive_read(bs, reg, &hr, &hive);
+
+    phase_end(phase);
+
+    if (EFI_ERROR(Status)) {
+        print_error("finish_hive_read", Status);
+        goto end;
+    }
+
+    phase = phase_begin("load_registry");
+
+    Status = load_registry(bs, system32, hive, &registry, &reg_size, &images, &drivers, &mappings, version, build,
                            windir, &core_drivers, fs_driver);
+
+    phase_end(phase);
+
     if (EFI_ERROR(Status)) {
         print_error("load_registry", Status);
         goto end;
@@ -3490,10 +3709,8 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         goto end;
     }
 #endif
-    // FIXME - make sure va doesn't collide with identity-mapped EFI space
-
     if (version >= _WIN32_WINNT_WIN8) {
-        Status = load_api_set(bs, &images, pe, system32, &va, version, &mappings, cmdline);
+        Status = load_api_set(bs, &images, pe, system32, version, &mappings, cmdline);
         if (EFI_ERROR(Status)) {
             print_error("load_api_set", Status);
             goto end;
@@ -3508,8 +3725,6 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         }
     }
 
-    va = va2;
-
     Status = open_file(windir, &drivers_dir, drivers_dir_path);
     if (EFI_ERROR(Status))
         drivers_dir = NULL;
@@ -3522,6 +3737,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
         if (!img->img) {
             bool is_driver_dir = false;
+            va = va_next(VA_REGION_SYSTEM);
 
             if (drivers_dir) {
                 size_t name_len = wcslen(img->dir);
@@ -3579,15 +3795,12 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
                 print_error("load_image", Status);
                 goto end;
             }
-        }
 
-        {
-            UINT32 size = img->img->GetSize(img->img);
-
-            if ((size % EFI_PAGE_SIZE) != 0)
-                size = ((size / EFI_PAGE_SIZE) + 1) * EFI_PAGE_SIZE;
-
-            va = (uint8_t*)va + size;
+            Status = commit_image_va(bs, img, VA_REGION_SYSTEM);
+            if (EFI_ERROR(Status)) {
+                print_error("commit_image_va", Status);
+                goto end;
+            }
         }
 
         {
@@ -3701,6 +3914,8 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     fix_image_order(&images);
 
+    phase = phase_begin("resolve imports");
+
     le = images.Flink;
     while (le != &images) {
         image* img = _CR(le, image, list_entry);
@@ -3766,7 +3981,14 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         le = le->Flink;
     }
 
+    phase_end(phase);
+
+    phase = phase_begin("make_images_contiguous");
+
     Status = make_images_contiguous(bs, &images);
+
+    phase_end(phase);
+
     if (EFI_ERROR(Status)) {
         print_error("make_images_contiguous", Status);
         goto end;
@@ -3774,7 +3996,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     // avoid problems caused by large pages, by shunting virtual address
     // to next 4MB boundary
-    va = (uint8_t*)va + (0x400000 - ((uintptr_t)va % 0x400000));
+    va_align(VA_REGION_SYSTEM, 0x400000);
 
     {
         image* kernel = _CR(images.Flink, image, list_entry);
@@ -3824,8 +4046,40 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     extension_block = *extension_block_opt;
 
+    if (cmdline->export_timings) {
+        void* timing_pa;
+
+        Status = allocate_timing_block(bs, &mappings, &timing_pa);
+        if (EFI_ERROR(Status)) {
+            print_error("allocate_timing_block", Status);
+            goto end;
+        }
+
+        Status = add_address_option(bs, &options, &options_allocated, " QUIBBLETIMINGS=", timing_pa);
+        if (EFI_ERROR(Status)) {
+            print_error("add_address_option", Status);
+            goto end;
+        }
+    }
+
+    if (cmdline->boot_log) {
+        void* log_pa;
+
+        Status = allocate_log_block(bs, &mappings, &log_pa);
+        if (EFI_ERROR(Status)) {
+            print_error("allocate_log_block", Status);
+            goto end;
+        }
+
+        Status = add_address_option(bs, &options, &options_allocated, " QUIBBLELOG=", log_pa);
+        if (EFI_ERROR(Status)) {
+            print_error("add_address_option", Status);
+            goto end;
+        }
+    }
+
     std::visit([&](auto&& b) {
-        Status = initialize_loader_block(bs, store, *b, options, path, arc_name, &va, &mappings, &drivers, image_handle,
+        Status = initialize_loader_block(bs, store, *b, options, path, arc_name, &mappings, &drivers, image_handle,
                                          version, build, &core_drivers);
     }, loader_block);
 
@@ -3903,17 +4157,15 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         }
     }
 
-    Status = add_mapping(bs, &mappings, va, store, page_count(sizeof(loader_store)), LoaderSystemBlock);
+    Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "loader block", store, page_count(sizeof(loader_store)),
+                    LoaderSystemBlock, &store_va);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         goto end;
     }
 
-    store_va = (loader_store*)va;
-    va = (uint8_t*)va + (page_count(sizeof(loader_store)) * EFI_PAGE_SIZE);
-
     std::visit([&](auto&& b) {
-        Status = generate_images_list(bs, &images, b->LoadOrderListHead, &va, &mappings);
+        Status = generate_images_list(bs, &images, b->LoadOrderListHead, &mappings);
     }, loader_block);
 
     if (EFI_ERROR(Status)) {
@@ -3924,7 +4176,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 #ifndef _X86_
     if (build >= WIN10_BUILD_1703) {
 #endif
-        Status = allocate_pcr(bs, &mappings, &va, build, (void**)&pcrva);
+        Status = allocate_pcr(bs, &mappings, build, (void**)&pcrva);
         if (EFI_ERROR(Status)) {
             print_error("allocate_pcr", Status);
             goto end;
@@ -3969,15 +4221,12 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
         memset(nmitsspa, 0, EFI_PAGE_SIZE);
 
-        Status = add_mapping(bs, &mappings, va, nmitsspa, 1, LoaderMemoryData);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "NMI TSS", nmitsspa, 1, LoaderMemoryData, (void**)&nmitss);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
 
-        nmitss = (KTSS*)va;
-        va = (uint8_t*)va + EFI_PAGE_SIZE;
-
         dftsspa = allocate_page(bs);
         if (!dftsspa) {
             print_string("out of memory\n");
@@ -3987,15 +4236,12 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
         memset(dftsspa, 0, EFI_PAGE_SIZE);
 
-        Status = add_mapping(bs, &mappings, va, dftsspa, 1, LoaderMemoryData);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "double fault TSS", dftsspa, 1, LoaderMemoryData, (void**)&dftss);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
 
-        dftss = (KTSS*)va;
-        va = (uint8_t*)va + EFI_PAGE_SIZE;
-
         mctsspa = allocate_page(bs);
         if (!mctsspa) {
             print_string("out of memory\n");
@@ -4005,14 +4251,11 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
         memset(mctsspa, 0, EFI_PAGE_SIZE);
 
-        Status = add_mapping(bs, &mappings, va, mctsspa, 1, LoaderMemoryData);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "machine check TSS", mctsspa, 1, LoaderMemoryData, (void**)&mctss);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
-
-        mctss = (KTSS*)va;
-        va = (uint8_t*)va + EFI_PAGE_SIZE;
     }
 #endif
 
@@ -4032,9 +4275,9 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
         idtgdt = (uint8_t*)(uintptr_t)addr;
 
-        Status = add_mapping(bs, &mappings, va, idtgdt, IDTGDT_PAGES, LoaderMemoryData);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "GDT and IDT", idtgdt, IDTGDT_PAGES, LoaderMemoryData, &va);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
 
@@ -4052,8 +4295,6 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         idt = (idt_entry*)((uint8_t*)va + (3 << EFI_PAGE_SHIFT));
 
         initialize_idt(idt_pa);
-
-        va = (uint8_t*)va + (IDTGDT_PAGES << EFI_PAGE_SHIFT);
     }
 
     {
@@ -4086,22 +4327,21 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
             goto end;
         }
 
-        Status = add_mapping(bs, &mappings, va, (void*)(uintptr_t)addr, allocation, LoaderStartupKernelStack);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "kernel stack", (void*)(uintptr_t)addr, allocation,
+                        LoaderStartupKernelStack, &va);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
 
         std::visit([&](auto&& b) {
             b->KernelStack = (uint8_t*)va + ((KERNEL_STACK_SIZE + 1) * EFI_PAGE_SIZE); // end of stack
         }, loader_block);
-
-        va = (uint8_t*)va + (allocation * EFI_PAGE_SIZE);
     }
 
     find_apic();
 
-    Status = map_nls(bs, &store->nls, &va, &mappings);
+    Status = map_nls(bs, &store->nls, &mappings);
     if (EFI_ERROR(Status)) {
         print_error("map_nls", Status);
         goto end;
@@ -4109,7 +4349,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     if (version >= _WIN32_WINNT_WINXP) {
         std::visit([&](auto&& e) {
-            Status = load_drvdb(bs, windir, &va, &mappings, e->DrvDBImage, e->DrvDBSize);
+            Status = load_drvdb(bs, windir, &mappings, e->DrvDBImage, e->DrvDBSize);
         }, extension_block);
 
         if (EFI_ERROR(Status)) {
@@ -4120,7 +4360,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     if (errata_inf) {
         std::visit([&](auto&& e) {
-            Status = map_errata_inf(bs, *e, &va, &mappings);
+            Status = map_errata_inf(bs, *e, &mappings);
         }, extension_block);
 
         if (EFI_ERROR(Status)) {
@@ -4129,9 +4369,10 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         }
     }
 
-    Status = add_mapping(bs, &mappings, va, registry, page_count(reg_size), LoaderRegistryData);
+    Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "registry", registry, page_count(reg_size), LoaderRegistryData,
+                    &va);
     if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
+        print_error("va_map", Status);
         goto end;
     }
 
@@ -4152,9 +4393,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         b->RegistryLength = reg_size;
     }, loader_block);
 
-    va = (uint8_t*)va + (page_count(reg_size) * EFI_PAGE_SIZE);
-
-    Status = map_efi_runtime(bs, &mappings, va, version);
+    Status = map_efi_runtime(bs, &mappings, version);
     if (EFI_ERROR(Status)) {
         print_error("map_efi_runtime", Status);
         return Status;
@@ -4168,7 +4407,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         }
     }, loader_block);
 
-    Status = map_debug_descriptor(bs, &mappings, &va, &store->debug_device_descriptor);
+    Status = map_debug_descriptor(bs, &mappings, &store->debug_device_descriptor);
     if (EFI_ERROR(Status)) {
         print_error("map_debug_descriptor", Status);
         return Status;
@@ -4189,9 +4428,10 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
             goto end;
         }
 
-        Status = add_mapping(bs, &mappings, va, (void*)(uintptr_t)addr, pages, LoaderStartupKernelStack);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "DPC stack", (void*)(uintptr_t)addr, pages,
+                        LoaderStartupKernelStack, &va);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
 
@@ -4209,9 +4449,10 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
                 goto end;
             }
 
-            Status = add_mapping(bs, &mappings, va, (void*)(uintptr_t)addr, pages, LoaderStartupKernelStack);
+            Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "IST stack", (void*)(uintptr_t)addr, pages,
+                            LoaderStartupKernelStack, &va);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("va_map", Status);
                 goto end;
             }
 
@@ -4225,15 +4466,13 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
     root->Close(root);
 
     if (kdstub_export_loaded && kdnet_scratch) {
-        Status = add_mapping(bs, &mappings, va, kdnet_scratch,
-                             page_count(store->debug_device_descriptor.TransportData.HwContextSize), LoaderFirmwarePermanent);
+        Status = va_map(bs, &mappings, VA_REGION_SYSTEM, "KDNET scratch", kdnet_scratch,
+                        page_count(store->debug_device_descriptor.TransportData.HwContextSize), LoaderFirmwarePermanent,
+                        &kdnet_scratch);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             goto end;
         }
-
-        kdnet_scratch = va;
-        va = (uint8_t*)va + (page_count(store->debug_device_descriptor.TransportData.HwContextSize) * EFI_PAGE_SIZE);
     }
 
     if (version >= _WIN32_WINNT_WIN8) {
@@ -4251,7 +4490,7 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     if (!EFI_ERROR(Status)) {
         std::visit([&](auto&& e) {
-            Status = init_bgcontext(bs, &mappings, &va, version, build, &store->bgc, *e);
+            Status = init_bgcontext(bs, &mappings, version, build, &store->bgc, *e);
         }, extension_block);
 
         if (EFI_ERROR(Status)) {
@@ -4268,12 +4507,25 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     merge_mappings(&mappings);
 
+#ifdef DEBUG
+    if (!verify_mappings(&mappings)) {
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+#endif
+
+    if (cmdline->mem_stats) {
+        print_memory_stats(&mappings);
+        print_va_plan();
+        print_pool_stats();
+    }
+
 #ifndef DEBUG
     print_string("Booting Windows " ELLIPSIS "\n");
 #endif
 
     std::visit([&](auto&& b) {
-        fix_loader_block_mapping(store, store_va, *b, &mappings, version, build);
+        fix_loader_block_mapping(*b, &mappings, version, build);
     }, loader_block);
 
     std::visit([&](auto&& e) {
@@ -4292,11 +4544,32 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     set_idt(idt_pa);
 
+    // nothing else gets drawn from here on, so we don't need to keep the font for the kernel
+    if (cmdline->free_font)
+        release_font();
+
+    if (cmdline->timings) {
+        save_phase_timings(bs);
+
+        if (!gop_console)
+            print_phase_timings();
+    }
+
+    if (cmdline->boot_log)
+        save_boot_log(bs);
+
+    large_pages = cmdline->large_pages;
+    dump_mdl = cmdline->dump_mdl;
+
+    phase = phase_begin("enable_paging");
+
     std::visit([&](auto&& b) {
         Status = enable_paging(image_handle, bs, &mappings, b->MemoryDescriptorListHead,
-                               va, loader_pages_spanned);
+                               loader_pages_spanned);
     }, loader_block);
 
+    phase_end(phase);
+
     if (EFI_ERROR(Status)) {
         print_error("enable_paging", Status);
         goto end;
@@ -4344,14 +4617,23 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
             desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size);
         }
 
+        phase = phase_begin("SetVirtualAddressMap");
+
         Status = systable->RuntimeServices->SetVirtualAddressMap(efi_runtime_map_size, map_desc_size,
                                                                 EFI_MEMORY_DESCRIPTOR_VERSION, efi_runtime_map);
+
+        phase_end(phase);
+
         if (EFI_ERROR(Status)) {
             print_error("SetVirtualAddressMap", Status);
             return Status;
         }
     }
 
+    // text console has gone by now, so we printed these before enable_paging
+    if (cmdline->timings && gop_console)
+        print_phase_timings();
+
 #if defined(_X86_) || defined(__x86_64__)
     /* Re-enable IDE interrupts - the IDE driver on OVMF disables them when not expecting anything,
      * which confuses Vista. */
@@ -4364,12 +4646,23 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
     if (kdstub_export_loaded)
         kdstub_init(&store->debug_device_descriptor, build);
 
+    if (cmdline->export_timings) {
+        store->loader_performance_data.StartTime = boot_start_tsc;
+        store->loader_performance_data.EndTime = __rdtsc();
+
+        export_phase_timings();
+    }
+
+    if (cmdline->boot_log)
+        export_boot_log();
+
 #ifdef __x86_64__
     // set syscall flag in EFER MSR
     __writemsr(0xc0000080, __readmsr(0xc0000080) | 1);
 
 #ifndef _MSC_VER
     print_string("Calling KiSystemStartup" ELLIPSIS "\n");
+    console_checkpoint();
 
     __asm__ __volatile__ (
         "mov %0, %%rsp\n\t"
@@ -4380,14 +4673,18 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
         : "rcx"
     );
 #else
+    console_checkpoint();
     call_startup(tss->Rsp0, &store->loader_block, KiSystemStartup);
 #endif
 
 #else
+    console_checkpoint();
     KiSystemStartup(&store->loader_block);
 #endif
 
 end:
+    abort_hive_read(bs, &hr);
+
     if (windir) {
         EFI_STATUS Status2 = windir->Close(windir);
         if (EFI_ERROR(Status2))
@@ -4407,16 +4704,6 @@ end:
             bs->FreePool(img->import_list);
 
         RemoveEntryList(&img->list_entry);
-
-        bs->FreePool(img);
-    }
-
-    while (!IsListEmpty(&mappings)) {
-        mapping* m = _CR(mappings.Flink, mapping, list_entry);
-
-        RemoveEntryList(&m->list_entry);
-
-        bs->FreePool(m);
     }
 
     return Status;
@@ -4721,6 +5008,160 @@ EFI_STATUS open_parent_dir(EFI_FILE_IO_INTERFACE* fs, EFI_DEVICE_PATH* dp, EFI_F
     return Status;
 }
 
+// opens the directory we were loaded from, which is where we keep our own files
+static EFI_STATUS open_esp_dir(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE* dir) {
+    EFI_STATUS Status;
+    EFI_GUID guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    EFI_GUID guid2 = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    EFI_LOADED_IMAGE_PROTOCOL* image;
+    EFI_FILE_IO_INTERFACE* fs;
+
+    Status = bs->OpenProtocol(image_handle, &guid, (void**)&image, image_handle, NULL,
+                              EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+    if (EFI_ERROR(Status)) {
+        print_error("OpenProtocol", Status);
+        return Status;
+    }
+
+    if (!image->DeviceHandle) {
+        Status = EFI_NOT_FOUND;
+        goto end2;
+    }
+
+    Status = bs->OpenProtocol(image->DeviceHandle, &guid2, (void**)&fs, image_handle, NULL,
+                              EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+    if (EFI_ERROR(Status)) {
+        print_error("OpenProtocol", Status);
+        goto end2;
+    }
+
+    Status = open_parent_dir(fs, image->FilePath, dir);
+    if (EFI_ERROR(Status))
+        print_error("open_parent_dir", Status);
+
+    bs->CloseProtocol(image->DeviceHandle, &guid2, image_handle, NULL);
+
+end2:
+    bs->CloseProtocol(image_handle, &guid, image_handle, NULL);
+
+    return Status;
+}
+
+EFI_STATUS write_esp_file(EFI_BOOT_SERVICES* bs, const wchar_t* name, const void* data, size_t size) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE dir, file;
+    UINTN write_size = size;
+
+    Status = open_esp_dir(bs, &dir);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    // delete any old version first, so we don't leave stale data at the end
+    Status = dir->Open(dir, &file, (CHAR16*)name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (!EFI_ERROR(Status))
+        file->Delete(file);
+
+    Status = dir->Open(dir, &file, (CHAR16*)name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+
+    dir->Close(dir);
+
+    if (EFI_ERROR(Status)) {
+        print_error("Open", Status);
+        return Status;
+    }
+
+    Status = file->Write(file, &write_size, (void*)data);
+    if (EFI_ERROR(Status))
+        print_error("file->Write", Status);
+
+    file->Close(file);
+
+    return Status;
+}
+
+// for optional files, so doesn't complain if it's not there
+EFI_STATUS read_esp_file(EFI_BOOT_SERVICES* bs, const wchar_t* name, void** data, size_t* size) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE dir;
+
+    Status = open_esp_dir(bs, &dir);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = read_file(bs, dir, name, data, size);
+
+    dir->Close(dir);
+
+    return Status;
+}
+
+static EFI_STATUS rename_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE file, const wchar_t* name) {
+    EFI_STATUS Status;
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+    EFI_FILE_INFO* info;
+    UINTN size = sizeof(EFI_FILE_INFO) + (MAX_PATH * sizeof(wchar_t));
+    size_t len = wcslen(name);
+
+    Status = bs->AllocatePool(EfiLoaderData, size, (void**)&info);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    Status = file->GetInfo(file, &guid, &size, info);
+    if (EFI_ERROR(Status)) {
+        print_error("file->GetInfo", Status);
+        bs->FreePool(info);
+        return Status;
+    }
+
+    memcpy(info->FileName, name, (len + 1) * sizeof(wchar_t));
+    info->Size = offsetof(EFI_FILE_INFO, FileName) + ((len + 1) * sizeof(wchar_t));
+
+    Status = file->SetInfo(file, &guid, info->Size, info);
+    if (EFI_ERROR(Status))
+        print_error("file->SetInfo", Status);
+
+    bs->FreePool(info);
+
+    return Status;
+}
+
+/* Shuffles names[0] to names[1], names[1] to names[2], and so on, deleting the last
+ * one, so that names[0] is free for write_esp_file. */
+EFI_STATUS rotate_esp_files(EFI_BOOT_SERVICES* bs, const wchar_t* const* names, unsigned int count) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE dir, file;
+
+    Status = open_esp_dir(bs, &dir);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = dir->Open(dir, &file, (CHAR16*)names[count - 1], EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (!EFI_ERROR(Status))
+        file->Delete(file);
+
+    Status = EFI_SUCCESS;
+
+    for (unsigned int i = count - 1; i > 0; i--) {
+        if (EFI_ERROR(dir->Open(dir, &file, (CHAR16*)names[i - 1], EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0)))
+            continue;
+
+        Status = rename_file(bs, file, names[i]);
+
+        file->Close(file);
+
+        if (EFI_ERROR(Status)) {
+            print_error("rename_file", Status);
+            break;
+        }
+    }
+
+    dir->Close(dir);
+
+    return Status;
+}
+
 static EFI_STATUS load_efi_drivers(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle) {
     EFI_STATUS Status;
     EFI_GUID guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
@@ -5083,9 +5524,17 @@ static EFI_STATUS parse_arc_name(EFI_BOOT_SERVICES* bs, char* system_path, EFI_F
     return EFI_SUCCESS;
 }
 
+static void wait_for_key(EFI_BOOT_SERVICES* bs) {
+    UINTN index;
+
+    // make sure whatever we're waiting on the user to read is actually on the screen
+    flush_console();
+
+    bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &index);
+}
+
 static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle) {
     EFI_STATUS Status;
-    UINTN Event;
     boot_option* opt;
     char* path;
     EFI_GUID guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
@@ -5100,7 +5549,14 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
     EFI_FILE_HANDLE root = NULL;
     wchar_t* fs_driver = NULL;
 
-    Status = show_menu(systable, &opt);
+    {
+        unsigned int phase = phase_begin("show_menu");
+
+        Status = show_menu(systable, &opt);
+
+        phase_end(phase);
+    }
+
     if (Status == EFI_ABORTED)
         return;
     else if (EFI_ERROR(Status)) {
@@ -5122,20 +5578,20 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
 
             print_string(s);
 
-            bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+            wait_for_key(bs);
         }
     }
 #endif
 
     if (!opt->system_path) {
         print_string("SystemPath not set.\n");
-        bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+        wait_for_key(bs);
         return;
     }
 
     Status = parse_arc_name(bs, opt->system_path, &fs, &arc_name, &path, &fs_handle);
     if (EFI_ERROR(Status)) {
-        bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+        wait_for_key(bs);
         return;
     }
 
@@ -5156,7 +5612,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
         print_error("load_reg_proto", Status);
         bs->FreePool(arc_name);
         bs->CloseProtocol(fs_handle, &guid, image_handle, NULL);
-        bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+        wait_for_key(bs);
         return;
     }
 
@@ -5165,7 +5621,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
         print_error("load_pe_proto", Status);
         bs->FreePool(arc_name);
         bs->CloseProtocol(fs_handle, &guid, image_handle, NULL);
-        bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+        wait_for_key(bs);
         return;
     }
 
@@ -5184,7 +5640,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
             if (EFI_ERROR(Status)) {
                 print_error("AllocatePool", Status);
                 bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
-                bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+                wait_for_key(bs);
                 return;
             }
 
@@ -5195,7 +5651,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
             print_error("GetArcName", Status);
             bs->FreePool(arc_name);
             bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
-            bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+            wait_for_key(bs);
             return;
         }
 
@@ -5220,7 +5676,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
             if (EFI_ERROR(Status)) {
                 print_error("AllocatePool", Status);
                 bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
-                bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+                wait_for_key(bs);
                 return;
             }
 
@@ -5232,7 +5688,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
             bs->FreePool(arc_name);
             bs->FreePool(fs_driver);
             bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
-            bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+            wait_for_key(bs);
             return;
         }
 
@@ -5244,6 +5700,9 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
     if (opt->options)
         parse_options(opt->options, &cmdline);
 
+    if (cmdline.quiet)
+        set_console_mode(CONSOLE_QUIET);
+
     if (cmdline.subvol != 0) {
         EFI_GUID open_subvol_guid = EFI_OPEN_SUBVOL_GUID;
         EFI_OPEN_SUBVOL_PROTOCOL* open_subvol;
@@ -5267,7 +5726,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
             print_error("OpenVolume", Status);
             bs->FreePool(arc_name);
             bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
-            bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+            wait_for_key(bs);
             return;
         }
     }
@@ -5281,7 +5740,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
     bs->FreePool(arc_name);
     bs->CloseProtocol(fs_handle, &guid, image_handle, NULL);
 
-    bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+    wait_for_key(bs);
 }
 
 /* This is just used for setting the security cookie in the PE files - it doesn't
@@ -5366,6 +5825,8 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     systable = SystemTable;
     image_handle = ImageHandle;
 
+    timing_init();
+
     Status = SystemTable->ConIn->Reset(systable->ConIn, false);
     if (EFI_ERROR(Status))
         return Status;
@@ -5406,13 +5867,27 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
         goto end;
     }
 
-    Status = load_efi_drivers(systable->BootServices, ImageHandle);
+    {
+        unsigned int phase = phase_begin("load_efi_drivers");
+
+        Status = load_efi_drivers(systable->BootServices, ImageHandle);
+
+        phase_end(phase);
+    }
+
     if (EFI_ERROR(Status)) {
         print_error("load_efi_drivers", Status);
         goto end;
     }
 
-    Status = look_for_block_devices(systable->BootServices);
+    {
+        unsigned int phase = phase_begin("look_for_block_devices");
+
+        Status = look_for_block_devices(systable->BootServices);
+
+        phase_end(phase);
+    }
+
     if (EFI_ERROR(Status)) {
         print_error("look_for_block_devices", Status);
         goto end;
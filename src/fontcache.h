@@ -0,0 +1,68 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Layout of quibble-font.bin, the pre-rendered copy of font.ttf which we can load from
+ * the ESP rather than starting up FreeType. This is made by tools/mkfontcache, and
+ * everything is little-endian, with offsets from the start of the file. */
+
+#define FONT_CACHE_SIGNATURE 0x544e4651 // "QFNT"
+#define FONT_CACHE_VERSION 2
+
+/* Both Quibble and mkfontcache set the font up by pixel size rather than by DPI, so
+ * that what gets drawn only depends on this, and any DPI which rounds to the same
+ * size can use the same strike. */
+static inline unsigned int font_ppem(unsigned int point_size, unsigned int dpi) {
+    return ((point_size * dpi) + 36) / 72;
+}
+
+typedef struct {
+    uint32_t signature;
+    uint32_t version;
+    uint32_t font_size; // of the TTF file it was made from
+    uint32_t font_hash; // FNV-1a of the TTF file
+    uint32_t point_size;
+    uint32_t num_strikes;
+} font_cache_header;
+
+// followed by num_strikes of these
+typedef struct {
+    uint32_t dpi; // the first one mkfontcache was asked for which gives this size
+    uint16_t x_ppem;
+    uint16_t y_ppem;
+    uint32_t height; // line height in pixels
+    uint32_t num_glyphs;
+    uint32_t offset; // of the first font_cache_glyph
+} font_cache_strike;
+
+typedef struct {
+    uint32_t codepoint;
+    uint32_t glyph; // index in the font
+    int32_t advance; // 26.6, as HarfBuzz gives it
+    int16_t left;
+    int16_t top;
+    uint16_t width;
+    uint16_t rows;
+    uint32_t offset; // of the 8-bit coverage bitmap
+} font_cache_glyph;
+
+static_assert(sizeof(font_cache_header) == 24);
+static_assert(sizeof(font_cache_strike) == 20);
+static_assert(sizeof(font_cache_glyph) == 24);
@@ -54,11 +54,10 @@ LIST_ENTRY block_devices;
 static EFI_STATUS add_ccd(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent, CONFIGURATION_CLASS cclass,
                           CONFIGURATION_TYPE type, IDENTIFIER_FLAG flags, uint32_t key, uint32_t affinity,
                           const char* identifier_string, CM_PARTIAL_RESOURCE_LIST* resource_list, uint32_t resource_list_size,
-                          void** va, LIST_ENTRY* mappings, CONFIGURATION_COMPONENT_DATA** pccd) {
+                          LIST_ENTRY* mappings, CONFIGURATION_COMPONENT_DATA** pccd) {
     EFI_STATUS Status;
     CONFIGURATION_COMPONENT_DATA* ccd;
     size_t size, identifier_length;
-    EFI_PHYSICAL_ADDRESS addr;
 
     size = sizeof(CONFIGURATION_COMPONENT_DATA);
 
@@ -71,16 +70,12 @@ static EFI_STATUS add_ccd(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* p
     if (resource_list)
         size += resource_list_size;
 
-    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, page_count(size), &addr);
+    Status = slab_alloc(bs, mappings, size, (void**)&ccd);
     if (EFI_ERROR(Status)) {
-        print_error("AllocatePages", Status);
+        print_error("slab_alloc", Status);
         return Status;
     }
 
-    ccd = (CONFIGURATION_COMPONENT_DATA*)(uintptr_t)addr;
-
-    memset(ccd, 0, sizeof(CONFIGURATION_COMPONENT_DATA));
-
     ccd->Parent = parent;
     ccd->ComponentEntry.Class = cclass;
     ccd->ComponentEntry.Type = type;
@@ -110,21 +105,13 @@ static EFI_STATUS add_ccd(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* p
         parent->Child = ccd;
     }
 
-    Status = add_mapping(bs, mappings, *va, ccd, page_count(size), LoaderSystemBlock);
-    if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
-        return Status;
-    }
-
-    *va = (uint8_t*)*va + (page_count(size) * EFI_PAGE_SIZE);
-
     if (pccd)
         *pccd = ccd;
 
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS add_acpi_config_data(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent, void** va,
+static EFI_STATUS add_acpi_config_data(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent,
                                        LIST_ENTRY* mappings, uint16_t version) {
     EFI_STATUS Status;
     EFI_GUID acpi1_guid = ACPI_TABLE_GUID;
@@ -212,14 +199,14 @@ static EFI_STATUS add_acpi_config_data(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMP
     // FIXME - copy memory map into abd->MemoryMap
 
     Status = add_ccd(bs, parent, AdapterClass, MultiFunctionAdapter, (IDENTIFIER_FLAG)0, 0, 0xffffffff, "ACPI BIOS",
-                     prl, sizeof(CM_PARTIAL_RESOURCE_LIST) + table_size, va, mappings, NULL);
+                     prl, sizeof(CM_PARTIAL_RESOURCE_LIST) + table_size, mappings, NULL);
 
     bs->FreePool(prl);
 
     return Status;
 }
 
-static EFI_STATUS create_system_key(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA** system_key, void** va,
+static EFI_STATUS create_system_key(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA** system_key,
                                     LIST_ENTRY* mappings, EFI_HANDLE image_handle) {
     EFI_STATUS Status;
     EFI_GUID guid = BLOCK_IO_PROTOCOL;
@@ -280,7 +267,7 @@ static EFI_STATUS create_system_key(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONE
     }
 
     Status = add_ccd(bs, NULL, SystemClass, MaximumType, (IDENTIFIER_FLAG)0, 0, 0xffffffff, NULL, prl, size,
-                     va, mappings, system_key);
+                     mappings, system_key);
     if (EFI_ERROR(Status)) {
         print_error("add_ccd", Status);
         goto end;
@@ -298,7 +285,7 @@ typedef struct {
     PCI_REGISTRY_INFO reg_info;
 } pci_resource_list;
 
-static EFI_STATUS add_pci_config(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent, void** va, LIST_ENTRY* mappings) {
+static EFI_STATUS add_pci_config(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent, LIST_ENTRY* mappings) {
     EFI_STATUS Status;
     EFI_GUID guid = EFI_PCI_ROOT_BRIDGE_IO_PROTOCOL_GUID;
     EFI_HANDLE* handles = NULL;
@@ -335,7 +322,7 @@ static EFI_STATUS add_pci_config(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_
     reslist.reg_info.HardwareMechanism = 1;
 
     Status = add_ccd(bs, parent, AdapterClass, MultiFunctionAdapter, (IDENTIFIER_FLAG)0, 0, 0xffffffff, "PCI", &reslist.prl,
-                     sizeof(reslist), va, mappings, NULL);
+                     sizeof(reslist), mappings, NULL);
     if (EFI_ERROR(Status)) {
         print_error("add_ccd", Status);
         return Status;
@@ -345,20 +332,20 @@ static EFI_STATUS add_pci_config(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_
 }
 #endif
 
-EFI_STATUS find_hardware(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA*& config_root, void** va,
+EFI_STATUS find_hardware(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA*& config_root,
                          LIST_ENTRY* mappings, EFI_HANDLE image_handle, uint16_t version) {
     EFI_STATUS Status;
     CONFIGURATION_COMPONENT_DATA* system_key;
 
     UNUSED(version);
 
-    Status = create_system_key(bs, &system_key, va, mappings, image_handle);
+    Status = create_system_key(bs, &system_key, mappings, image_handle);
     if (EFI_ERROR(Status)) {
         print_error("create_system_key", Status);
         return Status;
     }
 
-    Status = add_acpi_config_data(bs, system_key, va, mappings, version);
+    Status = add_acpi_config_data(bs, system_key, mappings, version);
     if (EFI_ERROR(Status)) {
         print_error("add_acpi_config_data", Status);
         return Status;
@@ -366,7 +353,7 @@ EFI_STATUS find_hardware(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA*& c
 
 #ifdef _X86_
     if (version < _WIN32_WINNT_WIN8) {
-        Status = add_pci_config(bs, system_key, va, mappings);
+        Status = add_pci_config(bs, system_key, mappings);
         if (EFI_ERROR(Status)) {
             print_error("add_pci_config", Status);
             return Status;
@@ -379,34 +366,18 @@ EFI_STATUS find_hardware(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA*& c
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS found_block_device(EFI_BOOT_SERVICES* bs, EFI_BLOCK_IO* io, unsigned int disk_num, unsigned int part_num,
-                                     EFI_DEVICE_PATH_PROTOCOL* device_path) {
+static EFI_STATUS found_block_device(EFI_BOOT_SERVICES* bs, unsigned int disk_num, unsigned int part_num,
+                                     EFI_DEVICE_PATH_PROTOCOL* device_path, MASTER_BOOT_RECORD* mbr,
+                                     EFI_PARTITION_TABLE_HEADER* gpt) {
     EFI_STATUS Status;
-    MASTER_BOOT_RECORD* mbr;
-    size_t mbr_size = sizeof(MASTER_BOOT_RECORD);
     block_device* bd;
 
-    if (io->Media->BlockSize != 0 && (mbr_size % io->Media->BlockSize) != 0)
-        mbr_size += io->Media->BlockSize - (mbr_size % io->Media->BlockSize);
-
-    Status = bs->AllocatePool(EfiLoaderData, mbr_size, (void**)&mbr);
+    Status = arena_alloc(bs, sizeof(block_device), (void**)&bd);
     if (EFI_ERROR(Status)) {
-        print_error("AllocatePool", Status);
+        print_error("arena_alloc", Status);
         return Status;
     }
 
-    Status = io->ReadBlocks(io, io->Media->MediaId, 0, mbr_size, mbr);
-    if (EFI_ERROR(Status)) {
-        print_error("io->ReadBlocks", Status);
-        goto end;
-    }
-
-    Status = bs->AllocatePool(EfiLoaderData, sizeof(block_device), (void**)&bd);
-    if (EFI_ERROR(Status)) {
-        print_error("AllocatePool", Status);
-        goto end;
-    }
-
     memset(bd, 0, sizeof(block_device));
 
     bd->disk_num = disk_num;
@@ -428,50 +399,22 @@ static EFI_STATUS found_block_device(EFI_BOOT_SERVICES* bs, EFI_BLOCK_IO* io, un
             bd->arc.CheckSum++;
 
             if (mbr->Partition[0].OSIndicator == 0xEE) { // GPT
-                EFI_PARTITION_TABLE_HEADER* gpt;
-                size_t gpt_size = sizeof(EFI_PARTITION_TABLE_HEADER);
-
-                if (io->Media->BlockSize != 0 && (gpt_size % io->Media->BlockSize) != 0)
-                    gpt_size += io->Media->BlockSize - (gpt_size % io->Media->BlockSize);
-
-                Status = bs->AllocatePool(EfiLoaderData, gpt_size, (void**)&gpt);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePool", Status);
-                    return Status;
-                }
-
-                Status = io->ReadBlocks(io, io->Media->MediaId, PRIMARY_PART_HEADER_LBA, gpt_size, gpt);
-                if (EFI_ERROR(Status)) {
-                    print_error("io->ReadBlocks", Status);
-                    bs->FreePool(gpt);
-                    goto end;
-                }
-
                 if (memcmp(&gpt->Header.Signature, EFI_PTAB_HEADER_ID, sizeof(EFI_PTAB_HEADER_ID) - 1)) {
                     print_string("GPT has invalid signature (expected \"EFI PART\")\n");
-                    bs->FreePool(gpt);
-                    Status = EFI_INVALID_PARAMETER;
-                    goto end;
+                    return EFI_INVALID_PARAMETER;
                 }
 
                 // FIXME - check gpt->Header.CRC32
 
                 bd->arc.IsGpt = true;
                 memcpy(bd->arc.GptSignature, &gpt->DiskGUID, sizeof(EFI_GUID));
-
-                bs->FreePool(gpt);
             }
         }
     }
 
     InsertTailList(&block_devices, &bd->list_entry);
 
-    Status = EFI_SUCCESS;
-
-end:
-    bs->FreePool(mbr);
-
-    return Status;
+    return EFI_SUCCESS;
 }
 
 static void int_to_string(char** addr, unsigned int n) {
@@ -513,37 +456,36 @@ static void int_to_string(char** addr, unsigned int n) {
     *addr = *addr + digits;
 }
 
-static EFI_STATUS add_isa_key(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent, void** va,
+static EFI_STATUS add_isa_key(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent,
                               LIST_ENTRY* mappings, CONFIGURATION_COMPONENT_DATA** ret) {
     return add_ccd(bs, parent, AdapterClass, MultiFunctionAdapter, (IDENTIFIER_FLAG)0, 0, 0xffffffff, "ISA", NULL, 0,
-                   va, mappings, ret);
+                   mappings, ret);
 }
 
-static EFI_STATUS add_disk_controller(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent, void** va,
+static EFI_STATUS add_disk_controller(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA* parent,
                                       LIST_ENTRY* mappings, CONFIGURATION_COMPONENT_DATA** ret) {
     return add_ccd(bs, parent, ControllerClass, DiskController, (IDENTIFIER_FLAG)0, 0, 0xffffffff, NULL, NULL, 0,
-                   va, mappings, ret);
+                   mappings, ret);
 }
 
-EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, void** va, LIST_ENTRY* mappings,
+EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, LIST_ENTRY* mappings,
                       CONFIGURATION_COMPONENT_DATA* system_key, bool new_disk_format) {
     EFI_STATUS Status;
     size_t disk_list_size;
     LIST_ENTRY* le;
-    EFI_PHYSICAL_ADDRESS addr;
     void* pa;
     CONFIGURATION_COMPONENT_DATA* isakey;
     CONFIGURATION_COMPONENT_DATA* diskcon;
 
     static const char arc_prefix[] = "multi(0)disk(0)rdisk(";
 
-    Status = add_isa_key(bs, system_key, va, mappings, &isakey);
+    Status = add_isa_key(bs, system_key, mappings, &isakey);
     if (EFI_ERROR(Status)) {
         print_error("add_isa_key", Status);
         return Status;
     }
 
-    Status = add_disk_controller(bs, isakey, va, mappings, &diskcon);
+    Status = add_disk_controller(bs, isakey, mappings, &diskcon);
     if (EFI_ERROR(Status)) {
         print_error("add_disk_controller", Status);
         return Status;
@@ -570,14 +512,12 @@ EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, void** v
         le = le->Flink;
     }
 
-    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, page_count(disk_list_size), &addr);
+    Status = slab_alloc(bs, mappings, disk_list_size, &pa);
     if (EFI_ERROR(Status)) {
-        print_error("AllocatePages", Status);
+        print_error("slab_alloc", Status);
         return Status;
     }
 
-    pa = (void*)(uintptr_t)addr;
-
     le = block_devices.Flink;
     while (le != &block_devices) {
         block_device* bd = _CR(le, block_device, list_entry);
@@ -639,14 +579,6 @@ EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, void** v
         le = le->Flink;
     }
 
-    Status = add_mapping(bs, mappings, *va, (void*)(uintptr_t)addr, page_count(disk_list_size), LoaderSystemBlock);
-    if (EFI_ERROR(Status)) {
-        print_error("add_mapping", Status);
-        return Status;
-    }
-
-    *va = (uint8_t*)*va + (page_count(disk_list_size) * EFI_PAGE_SIZE);
-
     le = block_devices.Flink;
     while (le != &block_devices) {
         block_device* bd = _CR(le, block_device, list_entry);
@@ -693,7 +625,7 @@ EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, void** v
             // FIXME - put "geometry" into partial resource list?
 
             Status = add_ccd(bs, diskcon, PeripheralClass, DiskPeripheral, (IDENTIFIER_FLAG)(IdentifierFlag_Input | IdentifierFlag_Output),
-                            0, 0xffffffff, identifier, NULL, 0, va, mappings, NULL);
+                            0, 0xffffffff, identifier, NULL, 0, mappings, NULL);
             if (EFI_ERROR(Status)) {
                 print_error("add_ccd", Status);
                 return Status;
@@ -706,30 +638,6 @@ EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, void** v
     return EFI_SUCCESS;
 }
 
-static bool device_path_is_child(EFI_DEVICE_PATH_PROTOCOL* parent, EFI_DEVICE_PATH_PROTOCOL* child) {
-    EFI_DEVICE_PATH_PROTOCOL* pbit = parent;
-    EFI_DEVICE_PATH_PROTOCOL* cbit = child;
-
-    do {
-        unsigned int plen, clen;
-
-        if (pbit->Type == END_DEVICE_PATH_TYPE)
-            return true;
-
-        plen = *(uint16_t*)pbit->Length;
-        clen = *(uint16_t*)cbit->Length;
-
-        if (plen != clen)
-            return false;
-
-        if (memcmp(pbit, cbit, plen))
-            return false;
-
-        pbit = (EFI_DEVICE_PATH_PROTOCOL*)((uint8_t*)pbit + *(uint16_t*)pbit->Length);
-        cbit = (EFI_DEVICE_PATH_PROTOCOL*)((uint8_t*)cbit + *(uint16_t*)cbit->Length);
-    } while (true);
-}
-
 static EFI_DEVICE_PATH_PROTOCOL* duplicate_device_path(EFI_DEVICE_PATH_PROTOCOL* device_path) {
     EFI_STATUS Status;
     unsigned int len = 0;
@@ -778,115 +686,308 @@ static unsigned int get_partition_number(EFI_DEVICE_PATH_PROTOCOL* device_path)
     return 0;
 }
 
+static size_t device_path_length(EFI_DEVICE_PATH_PROTOCOL* device_path) {
+    EFI_DEVICE_PATH_PROTOCOL* dpbit = device_path;
+    size_t len = 0;
+
+    // not including end node
+
+    while (dpbit->Type != END_DEVICE_PATH_TYPE) {
+        len += *(uint16_t*)dpbit->Length;
+        dpbit = (EFI_DEVICE_PATH_PROTOCOL*)((uint8_t*)dpbit + *(uint16_t*)dpbit->Length);
+    }
+
+    return len;
+}
+
+typedef struct {
+    EFI_HANDLE handle;
+    EFI_BLOCK_IO* io;
+    EFI_BLOCK_IO2_PROTOCOL* io2;
+    EFI_DEVICE_PATH_PROTOCOL* device_path;
+    size_t dp_len;
+    unsigned int disk_num;
+    uint8_t* buf;
+    size_t buf_size;
+    EFI_BLOCK_IO2_TOKEN token;
+    EFI_STATUS Status;
+} block_handle;
+
+static int compare_device_paths(const block_handle* bh, EFI_DEVICE_PATH_PROTOCOL* device_path, size_t dp_len) {
+    int ret = memcmp(bh->device_path, device_path, bh->dp_len < dp_len ? bh->dp_len : dp_len);
+
+    if (ret != 0)
+        return ret;
+
+    if (bh->dp_len == dp_len)
+        return 0;
+
+    return bh->dp_len < dp_len ? -1 : 1;
+}
+
+static void start_disk_read(EFI_BOOT_SERVICES* bs, block_handle* bh) {
+    EFI_STATUS Status;
+    size_t block_size = bh->io->Media->BlockSize;
+
+    // read the MBR and the GPT header in one go
+
+    if (block_size < sizeof(MASTER_BOOT_RECORD))
+        block_size = sizeof(MASTER_BOOT_RECORD);
+
+    bh->buf_size = block_size * 2;
+
+    Status = bs->AllocatePool(EfiLoaderData, bh->buf_size, (void**)&bh->buf);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        bh->buf = NULL;
+        bh->Status = Status;
+        return;
+    }
+
+    if (bh->io2) {
+        Status = bs->CreateEvent(0, 0, NULL, NULL, &bh->token.Event);
+
+        if (!EFI_ERROR(Status)) {
+            bh->token.TransactionStatus = EFI_SUCCESS;
+
+            Status = bh->io2->ReadBlocksEx(bh->io2, bh->io2->Media->MediaId, 0, &bh->token, bh->buf_size, bh->buf);
+            if (!EFI_ERROR(Status)) {
+                bh->Status = EFI_NOT_READY;
+                return;
+            }
+
+            bs->CloseEvent(bh->token.Event);
+        }
+
+        // fall back to synchronous read
+        bh->token.Event = NULL;
+    }
+
+    bh->Status = bh->io->ReadBlocks(bh->io, bh->io->Media->MediaId, 0, bh->buf_size, bh->buf);
+}
+
+static void finish_disk_read(EFI_BOOT_SERVICES* bs, block_handle* bh) {
+    EFI_STATUS Status;
+    UINTN index;
+
+    if (!bh->token.Event)
+        return;
+
+    Status = bs->WaitForEvent(1, &bh->token.Event, &index);
+    if (EFI_ERROR(Status)) {
+        print_error("WaitForEvent", Status);
+        bh->Status = Status;
+
+        // read might still be in progress, so we mustn't free the buffer
+        bh->buf = NULL;
+    } else
+        bh->Status = bh->token.TransactionStatus;
+
+    bs->CloseEvent(bh->token.Event);
+    bh->token.Event = NULL;
+}
+
+static block_handle* find_parent_disk(block_handle** disks, unsigned int num_disks, block_handle* part) {
+    unsigned int lo = 0, hi = num_disks;
+    size_t first_node_len = *(uint16_t*)part->device_path->Length;
+
+    // find the first disk which sorts after the partition
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (compare_device_paths(disks[mid], part->device_path, part->dp_len) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // the parent's device path is a prefix of ours, so will sort immediately before us
+    // unless other disks are sharing the same prefix
+
+    while (lo > 0) {
+        block_handle* disk;
+
+        lo--;
+        disk = disks[lo];
+
+        if (disk->dp_len < part->dp_len && !memcmp(disk->device_path, part->device_path, disk->dp_len))
+            return EFI_ERROR(disk->Status) ? NULL : disk;
+
+        if (disk->dp_len < first_node_len || memcmp(disk->device_path, part->device_path, first_node_len))
+            break;
+    }
+
+    return NULL;
+}
+
 EFI_STATUS look_for_block_devices(EFI_BOOT_SERVICES* bs) {
     EFI_STATUS Status;
     EFI_GUID guid = BLOCK_IO_PROTOCOL;
+    EFI_GUID guid2 = EFI_DEVICE_PATH_PROTOCOL_GUID;
+    EFI_GUID guid3 = EFI_BLOCK_IO2_PROTOCOL_GUID;
     EFI_HANDLE* handles = NULL;
     UINTN count;
-    unsigned int next_disk_num = 0;
+    block_handle* bhs;
+    block_handle** disks;
+    unsigned int num_handles = 0, num_disks = 0;
 
     InitializeListHead(&block_devices);
 
-    // do twice - first time for disks, second time for partitions
-    for (unsigned int time = 0; time < 2; time++) {
-        Status = bs->LocateHandleBuffer(ByProtocol, &guid, NULL, &count, &handles);
+    Status = bs->LocateHandleBuffer(ByProtocol, &guid, NULL, &count, &handles);
+    if (EFI_ERROR(Status)) {
+        print_error("LocateHandleBuffer", Status);
+        return Status;
+    }
 
+    Status = bs->AllocatePool(EfiLoaderData, count * (sizeof(block_handle) + sizeof(block_handle*)), (void**)&bhs);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        bs->FreePool(handles);
+        return Status;
+    }
+
+    disks = (block_handle**)&bhs[count];
+
+    /* Disks are numbered in the order the firmware gives them to us, which is what
+     * the ARC names depend on. We issue the reads for the partition tables as we go,
+     * and use BLOCK_IO2 if it's there so that they can all be in flight at once. */
+
+    for (unsigned int i = 0; i < count; i++) {
+        block_handle* bh = &bhs[num_handles];
+        EFI_DEVICE_PATH_PROTOCOL* device_path;
+        EFI_BLOCK_IO* io = NULL;
+
+        Status = bs->OpenProtocol(handles[i], &guid, (void**)&io, image_handle, NULL,
+                                  EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+        if (EFI_ERROR(Status))
+            continue;
+
+        if (io->Media->LastBlock == 0) {
+            bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
+            continue;
+        }
+
+        // FIXME - better way of ignoring CD drives? Does Windows give USB keys etc. an ARC name?
+
+        if (io->Media->RemovableMedia) {
+            bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
+            continue;
+        }
+
+        Status = bs->HandleProtocol(handles[i], &guid2, (void**)&device_path);
         if (EFI_ERROR(Status)) {
-            print_error("LocateHandleBuffer", Status);
-            return Status;
+            print_error("HandleProtocol", Status);
+            bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
+            continue;
         }
 
-        for (unsigned int i = 0; i < count; i++) {
-            EFI_GUID guid2 = EFI_DEVICE_PATH_PROTOCOL_GUID;
-            EFI_DEVICE_PATH_PROTOCOL* device_path;
-            EFI_BLOCK_IO* io = NULL;
-            unsigned int disk_num, part_num;
+        bh->handle = handles[i];
+        bh->io = io;
+        bh->io2 = NULL;
+        bh->device_path = device_path;
+        bh->dp_len = device_path_length(device_path);
+        bh->disk_num = 0;
+        bh->buf = NULL;
+        bh->token.Event = NULL;
+        bh->Status = EFI_SUCCESS;
 
-            Status = bs->OpenProtocol(handles[i], &guid, (void**)&io, image_handle, NULL,
-                                    EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
-            if (EFI_ERROR(Status))
-                continue;
+        num_handles++;
 
-            if (io->Media->LastBlock == 0) {
-                bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-                continue;
-            }
+        if (io->Media->LogicalPartition)
+            continue;
 
-            Status = bs->HandleProtocol(handles[i], &guid2, (void**)&device_path);
-            if (EFI_ERROR(Status)) {
-                print_error("HandleProtocol", Status);
-                bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-                continue;
-            }
+        bh->disk_num = num_disks;
+        disks[num_disks] = bh;
+        num_disks++;
 
-            // FIXME - better way of ignoring CD drives? Does Windows give USB keys etc. an ARC name?
+        Status = bs->OpenProtocol(handles[i], &guid3, (void**)&bh->io2, image_handle, NULL,
+                                  EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+        if (EFI_ERROR(Status))
+            bh->io2 = NULL;
 
-            if (time == 0) {
-                if (!io->Media->LogicalPartition && !io->Media->RemovableMedia) { // non-removable disk
-                    disk_num = next_disk_num;
-                    part_num = 0;
+        start_disk_read(bs, bh);
+    }
 
-                    next_disk_num++;
-                } else {
-                    bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-                    bs->CloseProtocol(handles[i], &guid2, image_handle, NULL);
-                    continue;
-                }
-            } else {
-                if (io->Media->LogicalPartition && !io->Media->RemovableMedia) { // partition on non-removable disk
-                    LIST_ENTRY* le = block_devices.Flink;
-                    bool found = false;
+    // sort disks by device path, so that partitions can find their parent with a binary search
 
-                    while (le != &block_devices) {
-                        block_device* bd = _CR(le, block_device, list_entry);
+    for (unsigned int i = 1; i < num_disks; i++) {
+        block_handle* bh = disks[i];
+        unsigned int j = i;
 
-                        if (bd->part_num == 0 && device_path_is_child(bd->device_path, device_path)) {
-                            disk_num = bd->disk_num;
-                            found = true;
-                            break;
-                        }
+        while (j > 0 && compare_device_paths(disks[j - 1], bh->device_path, bh->dp_len) > 0) {
+            disks[j] = disks[j - 1];
+            j--;
+        }
 
-                        le = le->Flink;
-                    }
+        disks[j] = bh;
+    }
 
-                    if (!found) {
-                        print_string("error - partition found without disk\n");
+    for (unsigned int i = 0; i < num_handles; i++) {
+        block_handle* bh = &bhs[i];
 
-                        bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-                        bs->CloseProtocol(handles[i], &guid2, image_handle, NULL);
+        if (bh->io->Media->LogicalPartition)
+            continue;
 
-                        continue;
-                    }
+        finish_disk_read(bs, bh);
+
+        if (EFI_ERROR(bh->Status)) {
+            print_error("io->ReadBlocks", bh->Status);
+            continue;
+        }
 
-                    part_num = get_partition_number(device_path);
+        Status = found_block_device(bs, bh->disk_num, 0, duplicate_device_path(bh->device_path),
+                                    (MASTER_BOOT_RECORD*)bh->buf,
+                                    (EFI_PARTITION_TABLE_HEADER*)(bh->buf + (bh->buf_size / 2)));
+        if (EFI_ERROR(Status)) {
+            print_error("found_block_device", Status);
+            bh->Status = Status;
+        }
+    }
 
-                    if (part_num == 0) {
-                        print_string("Could not get partition number.\n");
+    for (unsigned int i = 0; i < num_handles; i++) {
+        block_handle* bh = &bhs[i];
+        block_handle* disk;
+        unsigned int part_num;
 
-                        bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-                        bs->CloseProtocol(handles[i], &guid2, image_handle, NULL);
+        if (!bh->io->Media->LogicalPartition)
+            continue;
 
-                        continue;
-                    }
-                } else {
-                    bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-                    bs->CloseProtocol(handles[i], &guid2, image_handle, NULL);
-                    continue;
-                }
-            }
+        disk = find_parent_disk(disks, num_disks, bh);
 
-            Status = found_block_device(bs, io, disk_num, part_num, duplicate_device_path(device_path));
+        if (!disk) {
+            print_string("error - partition found without disk\n");
+            continue;
+        }
 
-            if (EFI_ERROR(Status))
-                print_error("found_block_device", Status);
+        part_num = get_partition_number(bh->device_path);
 
-            bs->CloseProtocol(handles[i], &guid, image_handle, NULL);
-            bs->CloseProtocol(handles[i], &guid2, image_handle, NULL);
+        if (part_num == 0) {
+            print_string("Could not get partition number.\n");
+            continue;
         }
 
-        bs->FreePool(handles);
+        Status = found_block_device(bs, disk->disk_num, part_num, duplicate_device_path(bh->device_path),
+                                    NULL, NULL);
+        if (EFI_ERROR(Status))
+            print_error("found_block_device", Status);
     }
 
+    for (unsigned int i = 0; i < num_handles; i++) {
+        block_handle* bh = &bhs[i];
+
+        if (bh->buf)
+            bs->FreePool(bh->buf);
+
+        if (bh->io2)
+            bs->CloseProtocol(bh->handle, &guid3, image_handle, NULL);
+
+        bs->CloseProtocol(bh->handle, &guid, image_handle, NULL);
+    }
+
+    bs->FreePool(bhs);
+    bs->FreePool(handles);
+
     return EFI_SUCCESS;
 }
 
@@ -0,0 +1,212 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "x86.h"
+
+/* Everything we print goes into a ring buffer first. Depending on the console mode
+ * we either draw it straight away, or leave it until the next convenient point -
+ * a phase boundary, waiting for the user, or ExitBootServices - so that we don't
+ * hold up the actual work of booting with font rendering or slow serial consoles. */
+
+#define LOG_SIZE 131072
+
+static char log_buf[LOG_SIZE];
+static uint64_t log_written = 0;
+static uint64_t log_rendered = 0;
+
+#define LOG_BLOCK_SIGNATURE 0x474f4c51 // "QLOG"
+
+/* What we hand to the OS if BOOTLOG is given, so that something running there can
+ * pick up our messages. Its physical address is appended to the load options as
+ * QUIBBLELOG=. */
+typedef struct {
+    uint32_t signature;
+    uint32_t version;
+    uint64_t lost;
+    uint32_t size;
+    char text[LOG_SIZE];
+} log_block;
+
+static const wchar_t* const log_files[] = {
+    L"quibble-log.txt",
+    L"quibble-log.1.txt",
+    L"quibble-log.2.txt"
+};
+
+static void* log_block_va = nullptr;
+
+#ifdef DEBUG
+static unsigned int console_mode = CONSOLE_IMMEDIATE;
+#else
+static unsigned int console_mode = CONSOLE_DEFERRED;
+#endif
+
+void log_write(std::string_view s) {
+    while (!s.empty()) {
+        size_t off = log_written % LOG_SIZE;
+        size_t len = s.size();
+
+        if (len > LOG_SIZE - off)
+            len = LOG_SIZE - off;
+
+        memcpy(log_buf + off, s.data(), len);
+
+        log_written += len;
+        s = s.substr(len);
+    }
+
+    if (console_mode == CONSOLE_IMMEDIATE)
+        flush_console();
+}
+
+void flush_console() {
+    // don't recurse if anything we call prints something
+    static bool flushing = false;
+
+    // nowhere to draw to, so it just stays in the log
+    if (flushing || console_mode == CONSOLE_NONE)
+        return;
+
+    flushing = true;
+
+    if (log_written - log_rendered > LOG_SIZE) {
+        char s[255], *p;
+
+        p = stpcpy(s, "(");
+        p = dec_to_str(p, log_written - log_rendered - LOG_SIZE);
+        p = stpcpy(p, " bytes of log lost)\n");
+
+        log_rendered = log_written - LOG_SIZE;
+
+        console_write(s);
+    }
+
+    while (log_rendered < log_written) {
+        size_t off = log_rendered % LOG_SIZE;
+        size_t len = log_written - log_rendered;
+
+        if (len > LOG_SIZE - off)
+            len = LOG_SIZE - off;
+
+        console_write(std::string_view(log_buf + off, len));
+
+        log_rendered += len;
+    }
+
+    flushing = false;
+}
+
+void set_console_mode(unsigned int mode) {
+    console_mode = mode;
+
+    if (mode == CONSOLE_IMMEDIATE)
+        flush_console();
+}
+
+// for points where it's convenient to draw things, unless we've been told to keep quiet
+void console_checkpoint() {
+    if (console_mode != CONSOLE_QUIET)
+        flush_console();
+}
+
+// copies the log out of the ring, oldest first
+static size_t copy_log(char* buf) {
+    uint64_t first = log_written > LOG_SIZE ? log_written - LOG_SIZE : 0;
+    size_t len = log_written - first;
+    size_t off = first % LOG_SIZE;
+    size_t part = LOG_SIZE - off;
+
+    if (part > len)
+        part = len;
+
+    memcpy(buf, log_buf + off, part);
+    memcpy(buf + part, log_buf, len - part);
+
+    return len;
+}
+
+EFI_STATUS save_boot_log(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+    char* buf;
+    size_t len;
+
+    Status = bs->AllocatePool(EfiLoaderData, LOG_SIZE, (void**)&buf);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    len = copy_log(buf);
+
+    Status = rotate_esp_files(bs, log_files, sizeof(log_files) / sizeof(log_files[0]));
+    if (EFI_ERROR(Status))
+        print_error("rotate_esp_files", Status); // carry on and overwrite the newest
+
+    // all in one go, so this is the only I/O the log costs us
+    Status = write_esp_file(bs, log_files[0], buf, len);
+    if (EFI_ERROR(Status))
+        print_error("write_esp_file", Status);
+
+    bs->FreePool(buf);
+
+    return Status;
+}
+
+EFI_STATUS allocate_log_block(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** pa) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    static constexpr size_t pages = page_count(sizeof(log_block));
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return Status;
+    }
+
+    memset((void*)(uintptr_t)addr, 0, pages * EFI_PAGE_SIZE);
+
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "boot log", (void*)(uintptr_t)addr, pages,
+                    LoaderSystemBlock, &log_block_va);
+    if (EFI_ERROR(Status)) {
+        print_error("va_map", Status);
+        log_block_va = NULL;
+        bs->FreePages(addr, pages);
+        return Status;
+    }
+
+    *pa = (void*)(uintptr_t)addr;
+
+    return EFI_SUCCESS;
+}
+
+// called once paging has been enabled, just before we hand over to the kernel
+void export_boot_log() {
+    if (!log_block_va)
+        return;
+
+    auto& lb = *(log_block*)log_block_va;
+
+    lb.signature = LOG_BLOCK_SIGNATURE;
+    lb.version = 1;
+    lb.lost = log_written > LOG_SIZE ? log_written - LOG_SIZE : 0;
+    lb.size = copy_log(lb.text);
+}
@@ -0,0 +1,451 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+
+/* Bookkeeping for the list of mappings we hand over to the kernel. Nothing in here
+ * touches the page tables or any firmware state other than the allocator, so it can
+ * be built separately from the rest of the loader and exercised against recorded
+ * memory maps. */
+
+void* fix_address_mapping(void* addr, void* pa, void* va) {
+    return (uint8_t*)addr - (uint8_t*)pa + (uint8_t*)va;
+}
+
+/* The mappings list is kept sorted by physical address, and we keep an array of
+ * pointers to its entries alongside it, in the same order. This means add_mapping and
+ * find_virtual_address can binary search rather than walking the whole list, while
+ * everything else can carry on iterating through the list as before. */
+
+typedef struct {
+    LIST_ENTRY* list;
+    mapping** entries;
+    size_t count;
+    size_t size;
+} mapping_index;
+
+static mapping_index map_index;
+
+static void* mapping_end(mapping* m) {
+    return (uint8_t*)m->pa + ((size_t)m->pages * EFI_PAGE_SIZE);
+}
+
+// returns the first entry in the index which ends after pa
+static size_t index_find(void* pa) {
+    size_t lo = 0, hi = map_index.count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if ((uint8_t*)mapping_end(map_index.entries[mid]) > (uint8_t*)pa)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+static EFI_STATUS index_reserve(EFI_BOOT_SERVICES* bs, size_t count) {
+    EFI_STATUS Status;
+    mapping** entries;
+    size_t size;
+
+    if (count <= map_index.size)
+        return EFI_SUCCESS;
+
+    size = map_index.size == 0 ? 256 : map_index.size;
+
+    while (size < count) {
+        size *= 2;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, size * sizeof(mapping*), (void**)&entries);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    if (map_index.entries) {
+        memcpy(entries, map_index.entries, map_index.count * sizeof(mapping*));
+        bs->FreePool(map_index.entries);
+    }
+
+    map_index.entries = entries;
+    map_index.size = size;
+
+    return EFI_SUCCESS;
+}
+
+/* Called whenever the mappings list is (re)initialised, so that nothing left over from
+ * an earlier list - which may well have lived at the same address - survives. */
+void index_reset(LIST_ENTRY* mappings) {
+    map_index.list = mappings;
+    map_index.count = 0;
+}
+
+// rebuild the index from the list, if we've been given a list that index_reset hasn't seen
+static EFI_STATUS index_sync(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
+    EFI_STATUS Status;
+    LIST_ENTRY* le;
+    size_t count = 0;
+
+    if (map_index.list == mappings)
+        return EFI_SUCCESS;
+
+    le = mappings->Flink;
+    while (le != mappings) {
+        count++;
+        le = le->Flink;
+    }
+
+    Status = index_reserve(bs, count);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    map_index.count = 0;
+
+    le = mappings->Flink;
+    while (le != mappings) {
+        map_index.entries[map_index.count] = _CR(le, mapping, list_entry);
+        map_index.count++;
+        le = le->Flink;
+    }
+
+    map_index.list = mappings;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS index_insert(EFI_BOOT_SERVICES* bs, size_t pos, mapping* m) {
+    EFI_STATUS Status;
+
+    Status = index_reserve(bs, map_index.count + 1);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    memmove(&map_index.entries[pos + 1], &map_index.entries[pos], (map_index.count - pos) * sizeof(mapping*));
+    map_index.entries[pos] = m;
+    map_index.count++;
+
+    return EFI_SUCCESS;
+}
+
+static void index_remove(size_t pos) {
+    memmove(&map_index.entries[pos], &map_index.entries[pos + 1], (map_index.count - pos - 1) * sizeof(mapping*));
+    map_index.count--;
+}
+
+void* find_virtual_address(void* pa, LIST_ENTRY* mappings) {
+    if (map_index.list == mappings) {
+        size_t pos = index_find(pa);
+
+        if (pos < map_index.count) {
+            mapping* m = map_index.entries[pos];
+
+            if (m->va && (uint8_t*)pa >= (uint8_t*)m->pa)
+                return (uint8_t*)pa - (uint8_t*)m->pa + (uint8_t*)m->va;
+        }
+    } else {
+        LIST_ENTRY* le;
+
+        le = mappings->Flink;
+        while (le != mappings) {
+            mapping* m = _CR(le, mapping, list_entry);
+
+            if (m->va) {
+                if ((uint8_t*)pa >= (uint8_t*)m->pa && (uint8_t*)pa < (uint8_t*)m->pa + ((size_t)m->pages * EFI_PAGE_SIZE))
+                    return (uint8_t*)pa - (uint8_t*)m->pa + (uint8_t*)m->va;
+            }
+
+            le = le->Flink;
+        }
+    }
+
+    {
+        char s[255], *p;
+
+        p = stpcpy(s, "Could not find virtual address for physical address ");
+        p = hex_to_str(p, (uintptr_t)pa);
+        p = stpcpy(p, ".\n");
+
+        print_string(s);
+    }
+
+    return NULL;
+}
+
+EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, void* pa, unsigned int pages,
+                       TYPE_OF_MEMORY type) {
+    EFI_STATUS Status;
+    mapping* m;
+    LIST_ENTRY* le;
+    size_t pos;
+    void* pa_end = (uint8_t*)pa + ((size_t)pages * EFI_PAGE_SIZE) - 1;
+
+    Status = index_sync(bs, mappings);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = arena_alloc(bs, sizeof(mapping), (void**)&m);
+    if (EFI_ERROR(Status)) {
+        print_error("arena_alloc", Status);
+        return Status;
+    }
+
+    m->va = va;
+    m->pa = pa;
+    m->pages = pages;
+    m->type = type;
+
+    // skip over everything which ends before we start
+    pos = index_find(pa);
+
+    le = pos < map_index.count ? &map_index.entries[pos]->list_entry : mappings;
+    while (le != mappings) {
+        mapping* m2 = _CR(le, mapping, list_entry);
+        void* pa2_end = (uint8_t*)m2->pa + ((size_t)m2->pages * EFI_PAGE_SIZE) - 1;
+
+        if (pa_end > m2->pa && pa_end <= pa2_end) { // split off beginning of block
+            mapping* m3;
+            size_t pages2;
+
+            if (m2->type != LoaderFree) {
+                print_string("error - cutting into non-free mapping\n");
+                halt();
+                return EFI_INVALID_PARAMETER;
+            }
+
+            pages2 = ((uint8_t*)pa2_end - (uint8_t*)pa_end) / EFI_PAGE_SIZE;
+
+            if (pages2 > 0) {
+                Status = arena_alloc(bs, sizeof(mapping), (void**)&m3);
+                if (EFI_ERROR(Status)) {
+                    print_error("arena_alloc", Status);
+                    return Status;
+                }
+
+                m3->va = NULL;
+                m3->pa = (uint8_t*)pa_end + 1;
+                m3->pages = pages2;
+                m3->type = m2->type;
+
+                Status = index_insert(bs, pos + 1, m3);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                InsertHeadList(&m2->list_entry, &m3->list_entry);
+            }
+
+            m2->pages = ((uint8_t*)pa_end + 1 - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+
+            pa2_end = (uint8_t*)m2->pa + ((size_t)m2->pages * EFI_PAGE_SIZE) - 1;
+        }
+
+        if (m->pa > m2->pa && m->pa < pa2_end) { // split off end of block
+            mapping* m3;
+            size_t pages2;
+
+            if (m2->type != LoaderFree) {
+                print_string("error - cutting into non-free mapping\n");
+                halt();
+                return EFI_INVALID_PARAMETER;
+            }
+
+            pages2 = ((uint8_t*)pa2_end + 1 - (uint8_t*)m->pa) / EFI_PAGE_SIZE;
+
+            if (pages2 > 0) {
+                Status = arena_alloc(bs, sizeof(mapping), (void**)&m3);
+                if (EFI_ERROR(Status)) {
+                    print_error("arena_alloc", Status);
+                    return Status;
+                }
+
+                m3->va = NULL;
+                m3->pa = m->pa;
+                m3->pages = pages2;
+                m3->type = m2->type;
+
+                Status = index_insert(bs, pos + 1, m3);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                InsertHeadList(&m2->list_entry, &m3->list_entry);
+            }
+
+            m2->pages = ((uint8_t*)m->pa - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+
+            pa2_end = (uint8_t*)m2->pa + ((size_t)m2->pages * EFI_PAGE_SIZE) - 1;
+        }
+
+        if ((m2->pa >= m->pa && pa2_end <= pa_end) || m2->pages == 0) { // remove block entirely
+            LIST_ENTRY* le2 = le->Flink;
+
+            if (m2->type != LoaderFree) {
+                print_string("error - cutting into non-free mapping\n");
+                halt();
+                return EFI_INVALID_PARAMETER;
+            }
+
+            RemoveEntryList(&m2->list_entry);
+            index_remove(pos);
+
+            le = le2;
+            continue;
+        }
+
+        if (m2->pa > m->pa) {
+            Status = index_insert(bs, pos, m);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            InsertHeadList(m2->list_entry.Blink, &m->list_entry);
+
+            return EFI_SUCCESS;
+        }
+
+        le = le->Flink;
+        pos++;
+    }
+
+    Status = index_insert(bs, map_index.count, m);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    InsertTailList(mappings, &m->list_entry);
+
+    return EFI_SUCCESS;
+}
+
+// memory we've allocated ourselves, which it's safe to describe with fewer, larger mappings
+static bool is_compactable_type(TYPE_OF_MEMORY type) {
+    switch (type) {
+        case LoaderSystemBlock:
+        case LoaderRegistryData:
+        case LoaderMemoryData:
+        case LoaderNlsData:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static bool can_merge_mappings(mapping* m, mapping* m2) {
+    if (m->type != m2->type || m2->pa != (uint8_t*)m->pa + ((size_t)m->pages * EFI_PAGE_SIZE))
+        return false;
+
+    if (m->type == LoaderFree)
+        return !m->va && !m2->va;
+
+    if (!is_compactable_type(m->type))
+        return false;
+
+    if (!m->va)
+        return !m2->va;
+
+    return m2->va == (uint8_t*)m->va + ((size_t)m->pages * EFI_PAGE_SIZE);
+}
+
+void merge_mappings(LIST_ENTRY* mappings) {
+    LIST_ENTRY* le = mappings->Flink;
+    bool indexed = map_index.list == mappings;
+    size_t pos = 0;
+
+    while (le != mappings) {
+        mapping* m = _CR(le, mapping, list_entry);
+
+        while (le->Flink != mappings) {
+            mapping* m2 = _CR(le->Flink, mapping, list_entry);
+
+            if (!can_merge_mappings(m, m2))
+                break;
+
+            m->pages += m2->pages;
+            RemoveEntryList(&m2->list_entry);
+        }
+
+        // rewrite the index as we go, rather than moving everything down for each merge
+        if (indexed)
+            map_index.entries[pos] = m;
+
+        le = le->Flink;
+        pos++;
+    }
+
+    if (indexed)
+        map_index.count = pos;
+}
+
+/* Checks the invariants everything else relies on - that the list is sorted by physical
+ * address, that no two entries overlap, and that the index agrees with the list. Returns
+ * false and prints the first problem found, if any. */
+bool verify_mappings(LIST_ENTRY* mappings) {
+    LIST_ENTRY* le = mappings->Flink;
+    mapping* prev = NULL;
+    size_t pos = 0;
+    bool indexed = map_index.list == mappings;
+
+    while (le != mappings) {
+        mapping* m = _CR(le, mapping, list_entry);
+
+        if (m->pages == 0) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Empty mapping at ");
+            p = hex_to_str(p, (uintptr_t)m->pa);
+            p = stpcpy(p, ".\n");
+
+            print_string(s);
+
+            return false;
+        }
+
+        if (prev && (uint8_t*)m->pa < (uint8_t*)mapping_end(prev)) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Mapping at ");
+            p = hex_to_str(p, (uintptr_t)m->pa);
+            p = stpcpy(p, " overlaps or is out of order with mapping at ");
+            p = hex_to_str(p, (uintptr_t)prev->pa);
+            p = stpcpy(p, ".\n");
+
+            print_string(s);
+
+            return false;
+        }
+
+        if (indexed && (pos >= map_index.count || map_index.entries[pos] != m)) {
+            print_string("Mapping index does not match list.\n");
+            return false;
+        }
+
+        prev = m;
+        pos++;
+        le = le->Flink;
+    }
+
+    if (indexed && pos != map_index.count) {
+        print_string("Mapping index does not match list.\n");
+        return false;
+    }
+
+    return true;
+}
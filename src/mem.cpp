@@ -21,19 +21,31 @@
 #include "misc.h"
 #include "x86.h"
 #include "print.h"
+#include "pagetable.h"
 
-#ifdef _X86_
-bool pae = true;
-HARDWARE_PTE* page_directory;
-HARDWARE_PTE_PAE* pdpt;
-#elif defined(__x86_64__)
-HARDWARE_PTE_PAE* pml4;
+#ifdef __x86_64__
+static bool no_execute = false;
 #endif
 
+bool large_pages = false;
+bool dump_mdl = false;
+
 #ifdef __x86_64__
 #define HAL_MEMORY 0xffffffffffc00000
 #endif
 
+#define EFI_MEMORY_CACHE_MASK (EFI_MEMORY_UC | EFI_MEMORY_WC | EFI_MEMORY_WT | EFI_MEMORY_WB)
+
+#define EFI_MEMORY_ATTRIBUTES_TABLE_GUID { 0xdcfa911d, 0x26eb, 0x469f, {0xa2, 0x20, 0x38, 0xb7, 0xdc, 0x46, 0x12, 0x20 } }
+
+typedef struct {
+    uint32_t Version;
+    uint32_t NumberOfEntries;
+    uint32_t DescriptorSize;
+    uint32_t Reserved;
+    // EFI_MEMORY_DESCRIPTOR Entry[1];
+} EFI_MEMORY_ATTRIBUTES_TABLE;
+
 EFI_MEMORY_DESCRIPTOR* efi_memory_map;
 EFI_MEMORY_DESCRIPTOR* efi_runtime_map;
 UINTN efi_map_size, efi_runtime_map_size, map_desc_size;
@@ -54,361 +66,164 @@ static TYPE_OF_MEMORY map_memory_type(UINTN memory_type) {
     }
 }
 
-void* fix_address_mapping(void* addr, void* pa, void* va) {
-    return (uint8_t*)addr - (uint8_t*)pa + (uint8_t*)va;
-}
-
-void* find_virtual_address(void* pa, LIST_ENTRY* mappings) {
-    LIST_ENTRY* le;
-
-    le = mappings->Flink;
-    while (le != mappings) {
-        mapping* m = _CR(le, mapping, list_entry);
-
-        if (m->va) {
-            if ((uint8_t*)pa >= (uint8_t*)m->pa && (uint8_t*)pa < (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE))
-                return (uint8_t*)pa - (uint8_t*)m->pa + (uint8_t*)m->va;
-        }
-
-        le = le->Flink;
-    }
-
-    {
-        char s[255], *p;
-
-        p = stpcpy(s, "Could not find virtual address for physical address ");
-        p = hex_to_str(p, (uintptr_t)pa);
-        p = stpcpy(p, ".\n");
-
-        print_string(s);
-    }
-
-    return NULL;
-}
+/* We size the page table pool beforehand by looking at what we're going to map - see
+ * pagetable.cpp. */
 
-static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t va, uintptr_t pa, unsigned int pages) {
-    uintptr_t pfn = pa >> EFI_PAGE_SHIFT;
+typedef struct {
+    uintptr_t last[3];
+    size_t count;
+} pt_estimate;
 
+static void estimate_page_tables(pt_estimate& est, uintptr_t va, size_t pages) {
 #ifdef _X86_
-    UNUSED(mappings);
-
-    if (pae) {
-        do {
-            HARDWARE_PTE_PAE* dir = (HARDWARE_PTE_PAE*)(pdpt[va >> 30].PageFrameNumber * EFI_PAGE_SIZE);
-            unsigned int index = (va >> 21) & 0x1ff;
-            unsigned int index2 = (va & 0x1ff000) >> 12;
-            HARDWARE_PTE_PAE* page_table;
-
-            if (!dir[index].Valid) { // allocate new page table
-                EFI_STATUS Status;
-                EFI_PHYSICAL_ADDRESS addr;
-
-                Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePages", Status);
-                    return Status;
-                }
-
-                memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
-                dir[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
-                dir[index].Valid = 1;
-                dir[index].Write = 1;
-
-                page_table = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
-            } else
-                page_table = (HARDWARE_PTE_PAE*)(dir[index].PageFrameNumber * EFI_PAGE_SIZE);
-
-            page_table[index2].PageFrameNumber = pfn;
-            page_table[index2].Valid = 1;
-            page_table[index2].Write = 1;
-
-            va += EFI_PAGE_SIZE;
-            pfn++;
-            pages--;
-        } while (pages > 0);
-    } else {
-        do {
-            unsigned int index = va >> 22;
-            unsigned int index2 = (va & 0x3ff000) >> 12;
-            HARDWARE_PTE* page_table;
-
-            if (!page_directory[index].Valid) { // allocate new page table
-                EFI_STATUS Status;
-                EFI_PHYSICAL_ADDRESS addr;
-
-                Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePages", Status);
-                    return Status;
-                }
-
-                memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
-                page_directory[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
-                page_directory[index].Valid = 1;
-                page_directory[index].Write = 1;
-
-                page_table = (HARDWARE_PTE*)(uintptr_t)addr;
-            } else
-                page_table = (HARDWARE_PTE*)(page_directory[index].PageFrameNumber * EFI_PAGE_SIZE);
-
-            page_table[index2].PageFrameNumber = pfn;
-            page_table[index2].Valid = 1;
-            page_table[index2].Write = 1;
-
-            va += EFI_PAGE_SIZE;
-            pfn++;
-            pages--;
-        } while (pages > 0);
-    }
+    static const unsigned int shifts[] = { 21 }; // page directories are allocated separately
+    unsigned int levels = 1;
+    unsigned int shift_nopae = 22;
 #elif defined(__x86_64__)
-    do {
-        HARDWARE_PTE_PAE* pdpt;
-        HARDWARE_PTE_PAE* pd;
-        HARDWARE_PTE_PAE* pt;
-        unsigned int index = (va & 0xff8000000000) >> 39;
-        unsigned int index2 = (va & 0x7fc0000000) >> 30;
-        unsigned int index3 = (va & 0x3fe00000) >> 21;
-        unsigned int index4 = (va & 0x1ff000) >> 12;
-
-        if (!pml4[index].Valid) {
-            EFI_STATUS Status;
-            EFI_PHYSICAL_ADDRESS addr;
-
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
-            if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
-                return Status;
-            }
-
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
-            pml4[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
-            pml4[index].Valid = 1;
-            pml4[index].Write = 1;
-
-            pdpt = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
-        } else {
-            uint64_t ptr;
-
-            /* Somewhat surprising behaviour from gcc here - combining the following two lines into one
-             * results in the value being sign-extended. Compiler bug? */
-
-            ptr = pml4[index].PageFrameNumber;
-            ptr <<= EFI_PAGE_SHIFT;
-
-            pdpt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
-        }
-
-        if (!pdpt[index2].Valid) {
-            EFI_STATUS Status;
-            EFI_PHYSICAL_ADDRESS addr;
-
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
-            if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
-                return Status;
-            }
-
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
-            pdpt[index2].PageFrameNumber = addr / EFI_PAGE_SIZE;
-            pdpt[index2].Valid = 1;
-            pdpt[index2].Write = 1;
-
-            pd = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
-        } else {
-            uint64_t ptr;
-
-            ptr = pdpt[index2].PageFrameNumber;
-            ptr <<= EFI_PAGE_SHIFT;
-
-            pd = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
-        }
-
-        if (!pd[index3].Valid) {
-            EFI_STATUS Status;
-            EFI_PHYSICAL_ADDRESS addr;
-
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
-            if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
-                return Status;
-            }
+    static const unsigned int shifts[] = { 21, 30, 39 };
+    unsigned int levels = 3;
+#endif
 
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
+    if (pages == 0)
+        return;
 
-            pd[index3].PageFrameNumber = addr / EFI_PAGE_SIZE;
-            pd[index3].Valid = 1;
-            pd[index3].Write = 1;
+    for (unsigned int i = 0; i < levels; i++) {
+        unsigned int shift = shifts[i];
+        uintptr_t first, last;
 
-            pt = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
-        } else {
-            uint64_t ptr;
+#ifdef _X86_
+        if (!pae)
+            shift = shift_nopae;
+#endif
 
-            ptr = pd[index3].PageFrameNumber;
-            ptr <<= EFI_PAGE_SHIFT;
+        first = va >> shift;
+        last = (va + (pages * EFI_PAGE_SIZE) - 1) >> shift;
 
-            pt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
-        }
+        est.count += last - first + 1;
 
-        pt[index4].PageFrameNumber = pfn;
-        pt[index4].Valid = 1;
-        pt[index4].Write = 1;
+        // we allocate VAs sequentially, so consecutive ranges often share tables
+        if (first == est.last[i])
+            est.count--;
 
-        va += EFI_PAGE_SIZE;
-        pfn++;
-        pages--;
-    } while (pages > 0);
-#endif
-
-    return EFI_SUCCESS;
+        est.last[i] = last;
+    }
 }
 
-EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, void* pa, unsigned int pages,
-                       TYPE_OF_MEMORY type) {
-    EFI_STATUS Status;
-    mapping* m;
+static EFI_STATUS reserve_pt_pool(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t mdl_va) {
     LIST_ENTRY* le;
-    void* pa_end = (uint8_t*)pa + (pages * EFI_PAGE_SIZE) - 1;
+    pt_estimate est;
+    size_t num_mappings = 0;
 
-    Status = bs->AllocatePool(EfiLoaderData, sizeof(mapping), (void**)&m);
-    if (EFI_ERROR(Status)) {
-        print_error("AllocatePool", Status);
-        return Status;
+    for (unsigned int i = 0; i < sizeof(est.last) / sizeof(est.last[0]); i++) {
+        est.last[i] = (uintptr_t)-1;
     }
 
-    m->va = va;
-    m->pa = pa;
-    m->pages = pages;
-    m->type = type;
+    est.count = 0;
 
     le = mappings->Flink;
     while (le != mappings) {
-        mapping* m2 = _CR(le, mapping, list_entry);
-        void* pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE) - 1;
-
-        if (pa_end > m2->pa && pa_end <= pa2_end) { // split off beginning of block
-            mapping* m3;
-            size_t pages2;
+        mapping* m = _CR(le, mapping, list_entry);
 
-            if (m2->type != LoaderFree) {
-                print_string("error - cutting into non-free mapping\n");
-                halt();
-                return EFI_INVALID_PARAMETER;
-            }
+        if (m->va)
+            estimate_page_tables(est, (uintptr_t)m->va, m->pages);
 
-            pages2 = ((uint8_t*)pa2_end - (uint8_t*)pa_end) / EFI_PAGE_SIZE;
+        num_mappings++;
 
-            if (pages2 > 0) {
-                Status = bs->AllocatePool(EfiLoaderData, sizeof(mapping), (void**)&m3);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePool", Status);
-                    return Status;
-                }
+        le = le->Flink;
+    }
 
-                m3->va = NULL;
-                m3->pa = (uint8_t*)pa_end + 1;
-                m3->pages = pages2;
-                m3->type = m2->type;
+    estimate_page_tables(est, 0, 1);
 
-                InsertHeadList(&m2->list_entry, &m3->list_entry);
-            }
+    if (apic)
+        estimate_page_tables(est, APIC_BASE, 1);
 
-            m2->pages = ((uint8_t*)pa_end + 1 - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+    {
+        void* base;
+        size_t pages;
 
-            pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE) - 1;
+        for (unsigned int i = 0; pool_get_chunk(i, &base, &pages); i++) {
+            estimate_page_tables(est, (uintptr_t)base, pages);
         }
+    }
 
-        if (m->pa > m2->pa && m->pa < pa2_end) { // split off end of block
-            mapping* m3;
-            size_t pages2;
-
-            if (m2->type != LoaderFree) {
-                print_string("error - cutting into non-free mapping\n");
-                halt();
-                return EFI_INVALID_PARAMETER;
-            }
+    if (shadow_fb)
+        estimate_page_tables(est, (uintptr_t)shadow_fb, page_count(framebuffer_size));
 
-            pages2 = ((uint8_t*)pa2_end + 1 - (uint8_t*)m->pa) / EFI_PAGE_SIZE;
+    if (efi_runtime_map) {
+        auto desc = efi_runtime_map;
 
-            if (pages2 > 0) {
-                Status = bs->AllocatePool(EfiLoaderData, sizeof(mapping), (void**)&m3);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePool", Status);
-                    return Status;
-                }
+        while ((uint8_t*)desc < (uint8_t*)efi_runtime_map + efi_runtime_map_size) {
+            estimate_page_tables(est, (uintptr_t)desc->PhysicalStart, desc->NumberOfPages);
 
-                m3->va = NULL;
-                m3->pa = m->pa;
-                m3->pages = pages2;
-                m3->type = m2->type;
+            desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size);
+        }
 
-                InsertHeadList(&m2->list_entry, &m3->list_entry);
-            }
+        estimate_page_tables(est, (uintptr_t)efi_runtime_map, page_count(efi_runtime_map_size));
+    }
 
-            m2->pages = ((uint8_t*)m->pa - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+#ifdef _X86_
+    if (pae)
+        estimate_page_tables(est, (uintptr_t)pdpt + MM_KSEG0_BASE, 1);
+#elif defined(__x86_64__)
+    est.count += 4; // add_hal_mappings
+#endif
 
-            pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE) - 1;
-        }
+    // the MDL itself, allowing for the splits that page tables will cause
+    estimate_page_tables(est, mdl_va, page_count((num_mappings * 2 + 64) * sizeof(MEMORY_ALLOCATION_DESCRIPTOR)));
 
-        if ((m2->pa >= m->pa && pa2_end <= pa_end) || m2->pages == 0) { // remove block entirely
-            LIST_ENTRY* le2 = le->Flink;
+    return alloc_pt_pool(bs, est.count);
+}
 
-            if (m2->type != LoaderFree) {
-                print_string("error - cutting into non-free mapping\n");
-                halt();
-                return EFI_INVALID_PARAMETER;
-            }
+static EFI_STATUS reserve_identity_maps(EFI_BOOT_SERVICES* bs, EFI_MEMORY_DESCRIPTOR* desc, UINTN count) {
+    EFI_STATUS Status;
 
-            RemoveEntryList(&m2->list_entry);
-            bs->FreePool(m2);
+    // keep the virtual address planner away from anything we're going to identity-map
 
-            le = le2;
-            continue;
+    for (unsigned int i = 0; i < count; i++) {
+        if (desc->Type == EfiLoaderCode || desc->Type == EfiBootServicesCode || desc->Type == EfiBootServicesData ||
+            desc->Attribute & EFI_MEMORY_RUNTIME) {
+            Status = va_reserve_identity(bs, (void*)(uintptr_t)desc->PhysicalStart, desc->NumberOfPages);
+            if (EFI_ERROR(Status))
+                return Status;
         }
 
-        if (m2->pa > m->pa) {
-            InsertHeadList(m2->list_entry.Blink, &m->list_entry);
+        desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size);
+    }
 
-            return EFI_SUCCESS;
-        }
+    Status = va_reserve_identity(bs, stack, STACK_SIZE);
+    if (EFI_ERROR(Status))
+        return Status;
 
-        le = le->Flink;
+    {
+        void* base;
+        size_t pages;
+
+        for (unsigned int i = 0; pool_get_chunk(i, &base, &pages); i++) {
+            Status = va_reserve_identity(bs, base, pages);
+            if (EFI_ERROR(Status))
+                return Status;
+        }
     }
 
-    InsertTailList(mappings, &m->list_entry);
+    if (shadow_fb) {
+        Status = va_reserve_identity(bs, shadow_fb, page_count(framebuffer_size));
+        if (EFI_ERROR(Status))
+            return Status;
+    }
 
     return EFI_SUCCESS;
 }
 
-EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, void** va, LIST_ENTRY* mappings) {
+EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
     EFI_STATUS Status;
     UINTN key, count;
     UINT32 version;
     EFI_MEMORY_DESCRIPTOR* desc = NULL;
-    uint8_t* va2 = (uint8_t*)*va;
     bool map_video_ram = true, map_first_page = true;
 
+    // the font pool can't grow after this, as we need to know where it is
+    pool_freeze();
+
     efi_map_size = 0;
 
     do {
@@ -443,6 +258,12 @@ EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, void** va, LIST_ENTRY* mapp
     count = efi_map_size / map_desc_size;
     efi_memory_map = desc;
 
+    Status = reserve_identity_maps(bs, desc, count);
+    if (EFI_ERROR(Status)) {
+        print_error("reserve_identity_maps", Status);
+        return Status;
+    }
+
     for (unsigned int i = 0; i < count; i++) {
         TYPE_OF_MEMORY memory_type = map_memory_type(desc->Type);
 
@@ -463,15 +284,15 @@ EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, void** va, LIST_ENTRY* mapp
         }
 
         if (memory_type != LoaderFree) {
-            Status = add_mapping(bs, mappings, va2, (void*)(uintptr_t)desc->PhysicalStart,
-                                 desc->NumberOfPages, memory_type);
+            void* va;
+
+            Status = va_map(bs, mappings, VA_REGION_LOADER, "firmware memory", (void*)(uintptr_t)desc->PhysicalStart,
+                            desc->NumberOfPages, memory_type, &va);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("va_map", Status);
                 return Status;
             }
 
-            va2 += desc->NumberOfPages * EFI_PAGE_SIZE;
-
             if (desc->PhysicalStart <= 0xa0000 && desc->PhysicalStart + (desc->NumberOfPages << EFI_PAGE_SHIFT) > 0xa0000)
                 map_video_ram = false;
 
@@ -516,99 +337,218 @@ EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, void** va, LIST_ENTRY* mapp
         }
     }
 
-    *va = va2;
-
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS setup_memory_descriptor_list(LIST_ENTRY* mappings, LIST_ENTRY& mdl, void* pa, void* va) {
-    LIST_ENTRY* le;
-    void* data;
-
-    data = pa;
+// the mappings list is sorted by physical address, so merging neighbours needs only one pass
+static bool can_merge_mdl(MEMORY_ALLOCATION_DESCRIPTOR* mad, mapping* m) {
+    return mad->MemoryType == m->type && mad->BasePage + mad->PageCount == (uintptr_t)m->pa / EFI_PAGE_SIZE;
+}
 
-    // populate list based on mappings
+static size_t count_mdl_entries(LIST_ENTRY* mappings) {
+    LIST_ENTRY* le;
+    MEMORY_ALLOCATION_DESCRIPTOR last;
+    size_t count = 0;
 
     le = mappings->Flink;
     while (le != mappings) {
         mapping* m = _CR(le, mapping, list_entry);
-        MEMORY_ALLOCATION_DESCRIPTOR* mad = (MEMORY_ALLOCATION_DESCRIPTOR*)data;
-
-        mad->MemoryType = m->type;
-        mad->BasePage = (uintptr_t)m->pa / EFI_PAGE_SIZE;
-        mad->PageCount = m->pages;
 
-        InsertTailList(&mdl, &mad->ListEntry);
-
-        data = (uint8_t*)data + sizeof(MEMORY_ALLOCATION_DESCRIPTOR);
+        if (count > 0 && can_merge_mdl(&last, m))
+            last.PageCount += m->pages;
+        else {
+            last.MemoryType = m->type;
+            last.BasePage = (uintptr_t)m->pa / EFI_PAGE_SIZE;
+            last.PageCount = m->pages;
+            count++;
+        }
 
         le = le->Flink;
     }
 
-    // merge together where we can
+    return count;
+}
+
+static EFI_STATUS setup_memory_descriptor_list(LIST_ENTRY* mappings, LIST_ENTRY& mdl, void* pa, void* va,
+                                               size_t max_entries, size_t* num_entries) {
+    LIST_ENTRY* le;
+    MEMORY_ALLOCATION_DESCRIPTOR* mads = (MEMORY_ALLOCATION_DESCRIPTOR*)pa;
+    MEMORY_ALLOCATION_DESCRIPTOR* mads_va = (MEMORY_ALLOCATION_DESCRIPTOR*)va;
+    LIST_ENTRY* head_va = (LIST_ENTRY*)find_virtual_address(&mdl, mappings);
+    size_t count = 0;
 
-    le = mdl.Flink;
-    while (le != &mdl) {
-        MEMORY_ALLOCATION_DESCRIPTOR* mad = _CR(le, MEMORY_ALLOCATION_DESCRIPTOR, ListEntry);
-        MEMORY_ALLOCATION_DESCRIPTOR* mad2 = _CR(le->Flink, MEMORY_ALLOCATION_DESCRIPTOR, ListEntry);
+    // populate array based on mappings, merging together where we can
 
-        if (le->Flink == &mdl)
-            break;
+    le = mappings->Flink;
+    while (le != mappings) {
+        mapping* m = _CR(le, mapping, list_entry);
 
-        if (mad->BasePage + mad->PageCount == mad2->BasePage && mad->MemoryType == mad2->MemoryType) {
-            mad->PageCount += mad2->PageCount;
-            RemoveEntryList(&mad2->ListEntry);
-            continue;
+        if (count > 0 && can_merge_mdl(&mads[count - 1], m))
+            mads[count - 1].PageCount += m->pages;
+        else {
+            if (count == max_entries) {
+                print_string("Memory descriptor list too small.\n");
+                return EFI_BUFFER_TOO_SMALL;
+            }
+
+            mads[count].MemoryType = m->type;
+            mads[count].BasePage = (uintptr_t)m->pa / EFI_PAGE_SIZE;
+            mads[count].PageCount = m->pages;
+            count++;
         }
 
         le = le->Flink;
     }
 
-    // change to virtual addresses
+    // link together, using virtual addresses
 
-    le = mdl.Flink;
+    for (size_t i = 0; i < count; i++) {
+        mads[i].ListEntry.Flink = i + 1 < count ? &mads_va[i + 1].ListEntry : head_va;
+        mads[i].ListEntry.Blink = i > 0 ? &mads_va[i - 1].ListEntry : head_va;
+    }
+
+    if (count == 0) {
+        mdl.Flink = head_va;
+        mdl.Blink = head_va;
+    } else {
+        mdl.Flink = &mads_va[0].ListEntry;
+        mdl.Blink = &mads_va[count - 1].ListEntry;
+    }
 
-    while (le != &mdl) {
-        LIST_ENTRY* le2 = le->Flink;
+    *num_entries = count;
 
-        if (le->Flink == &mdl)
-            le->Flink = mdl.Flink->Blink;
-        else
-            le->Flink = (LIST_ENTRY*)fix_address_mapping(le->Flink, pa, va);
+    return EFI_SUCCESS;
+}
 
-        if (le->Blink == &mdl)
-            le->Blink = (LIST_ENTRY*)find_virtual_address(le->Blink, mappings);
-        else
-            le->Blink = (LIST_ENTRY*)fix_address_mapping(le->Blink, pa, va);
+static const char* memory_type_name(TYPE_OF_MEMORY type) {
+    static const char* names[] = {
+        "ExceptionBlock", "SystemBlock", "Free", "Bad", "LoadedProgram", "FirmwareTemporary",
+        "FirmwarePermanent", "OsloaderHeap", "OsloaderStack", "SystemCode", "HalCode", "BootDriver",
+        "ConsoleInDriver", "ConsoleOutDriver", "StartupDpcStack", "StartupKernelStack", "StartupPanicStack",
+        "StartupPcrPage", "StartupPdrPage", "RegistryData", "MemoryData", "NlsData", "SpecialMemory",
+        "BBTMemory", "Reserve", "XIPRom", "HALCachedMemory", "LargePageFiller", "ErrorLogMemory",
+        "VsmMemory", "FirmwareCode", "FirmwareData", "FirmwareReserved", "EnclaveMemory", "FirmwareKsr",
+        "EnclaveKsr", "SkMemory", "SkFirmwareReserved", "IoSpaceMemoryZeroed", "IoSpaceMemoryFree",
+        "IoSpaceMemoryKsr"
+    };
 
-        le = le2;
-    }
+    static_assert(sizeof(names) / sizeof(names[0]) == LoaderMaximum);
 
-    mdl.Flink = (LIST_ENTRY*)fix_address_mapping(mdl.Flink, pa, va);
-    mdl.Blink = (LIST_ENTRY*)fix_address_mapping(mdl.Blink, pa, va);
+    if (type >= LoaderMaximum)
+        return "unknown";
 
-    return EFI_SUCCESS;
+    return names[type];
 }
 
-static EFI_STATUS allocate_mdl(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va,
-                               void** pa, size_t* mdl_pages) {
+// write the final MDL to the ESP, for looking at after a failed boot
+static void save_mdl(EFI_BOOT_SERVICES* bs, MEMORY_ALLOCATION_DESCRIPTOR* mads, size_t count) {
     EFI_STATUS Status;
-    unsigned int num_entries = 0;
+    char* buf;
+    char* p;
+
+    static const size_t line_length = 80;
+
+    Status = bs->AllocatePool(EfiLoaderData, (count * line_length) + 1, (void**)&buf);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return;
+    }
+
+    p = buf;
+
+    for (size_t i = 0; i < count; i++) {
+        p = hex_to_str(p, mads[i].BasePage * EFI_PAGE_SIZE);
+        p = stpcpy(p, ", ");
+        p = dec_to_str(p, mads[i].PageCount);
+        p = stpcpy(p, " pages: Loader");
+        p = stpcpy(p, memory_type_name(mads[i].MemoryType));
+        p = stpcpy(p, "\n");
+    }
+
+    Status = write_esp_file(bs, L"quibble-mdl.txt", buf, p - buf);
+    if (EFI_ERROR(Status))
+        print_error("write_esp_file", Status);
+
+    bs->FreePool(buf);
+}
+
+void print_memory_stats(LIST_ENTRY* mappings) {
     LIST_ENTRY* le;
-    size_t pages;
-    EFI_PHYSICAL_ADDRESS addr;
+    uint64_t totals[LoaderMaximum];
+    size_t num_mappings = 0, free_runs = 0;
+    uint64_t free_pages = 0, largest_free = 0, run = 0;
+    void* run_end = NULL;
+    char s[255], *p;
 
-    // FIXME - ought to loop until no. of pages required for list is stable
+    memset(totals, 0, sizeof(totals));
 
-    // count entries needed
     le = mappings->Flink;
     while (le != mappings) {
-        num_entries++;
+        mapping* m = _CR(le, mapping, list_entry);
+
+        num_mappings++;
+
+        if (m->type < LoaderMaximum)
+            totals[m->type] += m->pages;
+
+        if (m->type == LoaderFree) {
+            if (run > 0 && m->pa == run_end)
+                run += m->pages;
+            else {
+                run = m->pages;
+                free_runs++;
+            }
+
+            run_end = (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE);
+
+            if (run > largest_free)
+                largest_free = run;
+
+            free_pages += m->pages;
+        }
+
         le = le->Flink;
     }
 
-    // add one for list itself
-    num_entries++;
+    p = stpcpy(s, "Memory map has ");
+    p = dec_to_str(p, num_mappings);
+    p = stpcpy(p, " mappings:\n");
+    print_string(s);
+
+    for (unsigned int i = 0; i < LoaderMaximum; i++) {
+        if (totals[i] == 0)
+            continue;
+
+        p = stpcpy(s, "  Loader");
+        p = stpcpy(p, memory_type_name((TYPE_OF_MEMORY)i));
+        p = stpcpy(p, ": ");
+        p = dec_to_str(p, totals[i]);
+        p = stpcpy(p, " pages\n");
+        print_string(s);
+    }
+
+    p = stpcpy(s, "Free memory: ");
+    p = dec_to_str(p, free_pages);
+    p = stpcpy(p, " pages in ");
+    p = dec_to_str(p, free_runs);
+    p = stpcpy(p, " runs, largest ");
+    p = dec_to_str(p, largest_free);
+    p = stpcpy(p, " pages (");
+    p = dec_to_str(p, free_pages == 0 ? 0 : 100 - ((largest_free * 100) / free_pages));
+    p = stpcpy(p, "% fragmented).\n");
+    print_string(s);
+}
+
+static EFI_STATUS allocate_mdl(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va,
+                               void** pa, size_t* mdl_pages, size_t* max_entries) {
+    EFI_STATUS Status;
+    size_t num_entries, pages;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    /* Adding the mapping for the list itself can split a free region in two, so
+     * allow for two more entries than we have now. Any space left over at the end
+     * of the last page is kept in case mapping the list needs more page tables. */
+    num_entries = count_mdl_entries(mappings) + 2;
 
     // allocate pages for list
     pages = page_count(num_entries * sizeof(MEMORY_ALLOCATION_DESCRIPTOR));
@@ -627,6 +567,7 @@ static EFI_STATUS allocate_mdl(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void
 
     *pa = (void*)(uintptr_t)addr;
     *mdl_pages = pages;
+    *max_entries = (pages * EFI_PAGE_SIZE) / sizeof(MEMORY_ALLOCATION_DESCRIPTOR);
 
     return EFI_SUCCESS;
 }
@@ -711,19 +652,9 @@ static EFI_STATUS add_hal_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings)
         EFI_STATUS Status;
         EFI_PHYSICAL_ADDRESS addr;
 
-        Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-        if (EFI_ERROR(Status)) {
-            print_error("AllocatePages", Status);
-            return Status;
-        }
-
-        Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
-        if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+        Status = allocate_page_table(bs, mappings, &addr);
+        if (EFI_ERROR(Status))
             return Status;
-        }
-
-        memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
 
         pml4[(HAL_MEMORY >> 39) & 0x1ff].PageFrameNumber = addr / EFI_PAGE_SIZE;
         pml4[(HAL_MEMORY >> 39) & 0x1ff].Valid = 1;
@@ -743,19 +674,9 @@ static EFI_STATUS add_hal_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings)
         EFI_STATUS Status;
         EFI_PHYSICAL_ADDRESS addr;
 
-        Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-        if (EFI_ERROR(Status)) {
-            print_error("AllocatePages", Status);
-            return Status;
-        }
-
-        Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
-        if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+        Status = allocate_page_table(bs, mappings, &addr);
+        if (EFI_ERROR(Status))
             return Status;
-        }
-
-        memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
 
         pdpt[(HAL_MEMORY >> 30) & 0x1ff].PageFrameNumber = addr / EFI_PAGE_SIZE;
         pdpt[(HAL_MEMORY >> 30) & 0x1ff].Valid = 1;
@@ -776,59 +697,305 @@ static EFI_STATUS add_hal_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings)
             EFI_STATUS Status;
             EFI_PHYSICAL_ADDRESS addr;
 
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
+            Status = allocate_page_table(bs, mappings, &addr);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            pd[((HAL_MEMORY >> 21) & 0x1ff) + i].PageFrameNumber = addr / EFI_PAGE_SIZE;
+            pd[((HAL_MEMORY >> 21) & 0x1ff) + i].Valid = 1;
+            pd[((HAL_MEMORY >> 21) & 0x1ff) + i].Write = 1;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+#endif
+
+/* Sets the caching and execute permission of pages which have already been mapped,
+ * splitting any large pages we come across. We don't use the PAT, as Windows reprograms
+ * it, so anything which can't be write-back is mapped uncached. */
+static EFI_STATUS set_page_attributes(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t va, size_t pages,
+                                      bool uncached, bool nx) {
+    EFI_STATUS Status;
+
+#ifdef _X86_
+    UNUSED(nx);
+
+    for (size_t i = 0; i < pages; i++, va += EFI_PAGE_SIZE) {
+        if (pae) {
+            HARDWARE_PTE_PAE* dir = (HARDWARE_PTE_PAE*)(pdpt[va >> 30].PageFrameNumber * EFI_PAGE_SIZE);
+            unsigned int index = (va >> 21) & 0x1ff;
+            unsigned int index2 = (va & 0x1ff000) >> 12;
+            HARDWARE_PTE_PAE* page_table;
+
+            if (!dir[index].Valid)
+                continue;
+
+            if (dir[index].LargePage) {
+                Status = split_large_page(bs, mappings, &dir[index], 1);
+                if (EFI_ERROR(Status)) {
+                    print_error("split_large_page", Status);
+                    return Status;
+                }
+            }
+
+            page_table = (HARDWARE_PTE_PAE*)(dir[index].PageFrameNumber * EFI_PAGE_SIZE);
+
+            if (page_table[index2].Valid && uncached) {
+                page_table[index2].CacheDisable = 1;
+                page_table[index2].WriteThrough = 1;
+            }
+        } else {
+            unsigned int index = va >> 22;
+            unsigned int index2 = (va & 0x3ff000) >> 12;
+            HARDWARE_PTE* page_table;
+
+            if (!page_directory[index].Valid)
+                continue;
+
+            page_table = (HARDWARE_PTE*)(page_directory[index].PageFrameNumber * EFI_PAGE_SIZE);
+
+            if (page_table[index2].Valid && uncached) {
+                page_table[index2].CacheDisable = 1;
+                page_table[index2].WriteThrough = 1;
+            }
+        }
+    }
+#elif defined(__x86_64__)
+    for (size_t i = 0; i < pages; i++, va += EFI_PAGE_SIZE) {
+        HARDWARE_PTE_PAE* pdpt;
+        HARDWARE_PTE_PAE* pd;
+        HARDWARE_PTE_PAE* pt;
+        unsigned int index = (va & 0xff8000000000) >> 39;
+        unsigned int index2 = (va & 0x7fc0000000) >> 30;
+        unsigned int index3 = (va & 0x3fe00000) >> 21;
+        unsigned int index4 = (va & 0x1ff000) >> 12;
+        uint64_t ptr;
+
+        if (!pml4[index].Valid)
+            continue;
+
+        ptr = pml4[index].PageFrameNumber;
+        ptr <<= EFI_PAGE_SHIFT;
+        pdpt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
+
+        if (!pdpt[index2].Valid)
+            continue;
+
+        if (pdpt[index2].LargePage) {
+            Status = split_large_page(bs, mappings, &pdpt[index2], 0x200);
             if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
+                print_error("split_large_page", Status);
                 return Status;
             }
+        }
+
+        ptr = pdpt[index2].PageFrameNumber;
+        ptr <<= EFI_PAGE_SHIFT;
+        pd = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
 
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+        if (!pd[index3].Valid)
+            continue;
+
+        if (pd[index3].LargePage) {
+            Status = split_large_page(bs, mappings, &pd[index3], 1);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("split_large_page", Status);
                 return Status;
             }
+        }
 
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
+        ptr = pd[index3].PageFrameNumber;
+        ptr <<= EFI_PAGE_SHIFT;
+        pt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
 
-            pd[((HAL_MEMORY >> 21) & 0x1ff) + i].PageFrameNumber = addr / EFI_PAGE_SIZE;
-            pd[((HAL_MEMORY >> 21) & 0x1ff) + i].Valid = 1;
-            pd[((HAL_MEMORY >> 21) & 0x1ff) + i].Write = 1;
+        if (!pt[index4].Valid)
+            continue;
+
+        if (uncached) {
+            pt[index4].CacheDisable = 1;
+            pt[index4].WriteThrough = 1;
         }
+
+        if (nx && no_execute)
+            pt[index4].NoExecute = 1;
     }
+#endif
 
     return EFI_SUCCESS;
 }
-#endif
 
-EFI_STATUS map_efi_runtime(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void*& va, uint16_t version) {
+static EFI_STATUS set_runtime_attributes(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, EFI_MEMORY_DESCRIPTOR* desc,
+                                         uint64_t pa, size_t pages, bool uncached, bool nx) {
+    EFI_STATUS Status;
+
+    // identity map
+    Status = set_page_attributes(bs, mappings, (uintptr_t)pa, pages, uncached, nx);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (desc->VirtualStart == 0)
+        return EFI_SUCCESS;
+
+    return set_page_attributes(bs, mappings, (uintptr_t)(desc->VirtualStart + pa - desc->PhysicalStart), pages,
+                               uncached, nx);
+}
+
+/* The memory attributes table only has to describe the runtime images, so there may be
+ * runtime data regions, or parts of them, that it doesn't mention. These are marked
+ * non-executable, as they would have been if there were no table. */
+static EFI_STATUS set_uncovered_nx(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, EFI_MEMORY_ATTRIBUTES_TABLE* mat,
+                                   EFI_MEMORY_DESCRIPTOR* desc) {
+    EFI_STATUS Status;
+    uint64_t addr = desc->PhysicalStart;
+    uint64_t end = desc->PhysicalStart + (desc->NumberOfPages << EFI_PAGE_SHIFT);
+
+    while (addr < end) {
+        uint64_t next = end;
+        bool covered = false;
+
+        // find the entry covering addr, or failing that the first one starting after it
+
+        for (unsigned int i = 0; i < mat->NumberOfEntries; i++) {
+            auto entry = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)mat + sizeof(EFI_MEMORY_ATTRIBUTES_TABLE) + (i * mat->DescriptorSize));
+            uint64_t entry_end = entry->PhysicalStart + (entry->NumberOfPages << EFI_PAGE_SHIFT);
+
+            if (entry->PhysicalStart <= addr && entry_end > addr) {
+                next = entry_end < end ? entry_end : end;
+                covered = true;
+                break;
+            }
+
+            if (entry->PhysicalStart > addr && entry->PhysicalStart < next)
+                next = entry->PhysicalStart;
+        }
+
+        if (!covered) {
+            Status = set_runtime_attributes(bs, mappings, desc, addr, (next - addr) >> EFI_PAGE_SHIFT, false, true);
+            if (EFI_ERROR(Status))
+                return Status;
+        }
+
+        addr = next;
+    }
+
+    return EFI_SUCCESS;
+}
+
+/* The descriptors in the memory map tell us how each runtime region may be cached. If the
+ * firmware provides a memory attributes table, this tells us which parts of the runtime
+ * images are code and which are data - otherwise all we can do is mark the whole of each
+ * runtime data region as non-executable. We leave code writable, as SetVirtualAddressMap
+ * has to relocate it. */
+static EFI_STATUS apply_runtime_attributes(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
+    EFI_STATUS Status;
+    EFI_GUID mat_guid = EFI_MEMORY_ATTRIBUTES_TABLE_GUID;
+    EFI_MEMORY_ATTRIBUTES_TABLE* mat = NULL;
+    EFI_MEMORY_DESCRIPTOR* desc;
+
+    for (unsigned int i = 0; i < systable->NumberOfTableEntries; i++) {
+        if (!memcmp(&systable->ConfigurationTable[i].VendorGuid, &mat_guid, sizeof(EFI_GUID))) {
+            mat = (EFI_MEMORY_ATTRIBUTES_TABLE*)systable->ConfigurationTable[i].VendorTable;
+            break;
+        }
+    }
+
+    if (mat && (mat->Version < 1 || mat->DescriptorSize < sizeof(EFI_MEMORY_DESCRIPTOR)))
+        mat = NULL;
+
+    for (desc = efi_runtime_map; (uint8_t*)desc < (uint8_t*)efi_runtime_map + efi_runtime_map_size;
+         desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size)) {
+        bool uncached, nx;
+
+        if (!(desc->Attribute & EFI_MEMORY_RUNTIME))
+            continue;
+
+        uncached = (desc->Attribute & EFI_MEMORY_CACHE_MASK) && !(desc->Attribute & EFI_MEMORY_WB);
+
+        if (mat)
+            nx = desc->Type == EfiMemoryMappedIO || desc->Type == EfiMemoryMappedIOPortSpace;
+        else {
+            nx = desc->Type == EfiRuntimeServicesData || desc->Type == EfiMemoryMappedIO ||
+                 desc->Type == EfiMemoryMappedIOPortSpace || desc->Attribute & EFI_MEMORY_XP;
+        }
+
+        if (mat && desc->Type == EfiRuntimeServicesData) {
+            Status = set_uncovered_nx(bs, mappings, mat, desc);
+            if (EFI_ERROR(Status))
+                return Status;
+        }
+
+        if (!uncached && !nx)
+            continue;
+
+        Status = set_runtime_attributes(bs, mappings, desc, desc->PhysicalStart, desc->NumberOfPages, uncached, nx);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    if (!mat)
+        return EFI_SUCCESS;
+
+    for (unsigned int i = 0; i < mat->NumberOfEntries; i++) {
+        auto entry = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)mat + sizeof(EFI_MEMORY_ATTRIBUTES_TABLE) + (i * mat->DescriptorSize));
+
+        if (!(entry->Attribute & EFI_MEMORY_XP))
+            continue;
+
+        // find the runtime region this is part of
+
+        for (desc = efi_runtime_map; (uint8_t*)desc < (uint8_t*)efi_runtime_map + efi_runtime_map_size;
+             desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size)) {
+            if (!(desc->Attribute & EFI_MEMORY_RUNTIME))
+                continue;
+
+            if (entry->PhysicalStart >= desc->PhysicalStart &&
+                entry->PhysicalStart + (entry->NumberOfPages << EFI_PAGE_SHIFT) <= desc->PhysicalStart + (desc->NumberOfPages << EFI_PAGE_SHIFT)) {
+                Status = set_runtime_attributes(bs, mappings, desc, entry->PhysicalStart, entry->NumberOfPages,
+                                                false, true);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                break;
+            }
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+static bool is_runtime_desc(EFI_MEMORY_DESCRIPTOR* desc) {
+    return desc->Attribute & EFI_MEMORY_RUNTIME || desc->Type == EfiBootServicesData || desc->Type == EfiBootServicesCode;
+}
+
+EFI_STATUS map_efi_runtime(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uint16_t version) {
     EFI_STATUS Status;
-    unsigned int num_entries = 0;
     EFI_MEMORY_DESCRIPTOR* desc;
     EFI_MEMORY_DESCRIPTOR* desc2;
+    EFI_MEMORY_DESCRIPTOR* prev = NULL;
     EFI_PHYSICAL_ADDRESS addr;
-
-    desc = efi_memory_map;
+    size_t alloc_pages;
 
     /* Unfortunately faulty UEFI implementations mean that we have to identity-map
      * the boot services code as well, otherwise there can be a page fault within
      * SetVirtualAddressMap. See https://lwn.net/Articles/444666/ for Matthew Garrett's
      * dispassionate discussion of the issue. */
 
-    for (unsigned int i = 0; i < efi_map_size / map_desc_size; i++) {
-        if (desc->Attribute & EFI_MEMORY_RUNTIME || desc->Type == EfiBootServicesData || desc->Type == EfiBootServicesCode)
-            num_entries++;
-
-        desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size);
-    }
+    /* We build the runtime map in a single pass over the memory map, merging neighbouring
+     * descriptors which are physically contiguous and have the same type and attributes.
+     * We don't know how many entries there'll be until we've finished, so allocate enough
+     * for the whole memory map and give back what we don't need afterwards. */
 
-    efi_runtime_map_size = num_entries * map_desc_size;
+    alloc_pages = page_count(efi_map_size);
 
-    if (num_entries == 0) {
-        efi_runtime_map = NULL;
-        return EFI_SUCCESS;
-    }
+#ifdef _X86_
+    // we've already started handing out kernel addresses, so keep this below them
+    addr = 0x7fffffff;
 
-    Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, page_count(efi_runtime_map_size), &addr);
+    Status = bs->AllocatePages(AllocateMaxAddress, EfiBootServicesData, alloc_pages, &addr);
+#else
+    Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, alloc_pages, &addr);
+#endif
     if (EFI_ERROR(Status)) {
         print_error("AllocatePages", Status);
         return Status;
@@ -836,51 +1003,81 @@ EFI_STATUS map_efi_runtime(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void*& v
 
     efi_runtime_map = (EFI_MEMORY_DESCRIPTOR*)(uintptr_t)addr;
 
-    memset(efi_runtime_map, 0, efi_runtime_map_size);
-
     desc = efi_memory_map;
     desc2 = efi_runtime_map;
 
     for (unsigned int i = 0; i < efi_map_size / map_desc_size; i++) {
-        if (desc->Attribute & EFI_MEMORY_RUNTIME || desc->Type == EfiBootServicesData || desc->Type == EfiBootServicesCode) {
-            memcpy(desc2, desc, map_desc_size);
+        if (is_runtime_desc(desc)) {
+            if (prev && prev->Type == desc->Type && prev->Attribute == desc->Attribute &&
+                prev->PhysicalStart + (prev->NumberOfPages << EFI_PAGE_SHIFT) == desc->PhysicalStart) {
+                prev->NumberOfPages += desc->NumberOfPages;
+            } else {
+                memcpy(desc2, desc, map_desc_size);
+                desc2->VirtualStart = 0;
+
+                prev = desc2;
+                desc2 = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc2 + map_desc_size);
+            }
+        }
 
-            if (desc->Attribute & EFI_MEMORY_RUNTIME) {
-                desc2->VirtualStart = (EFI_VIRTUAL_ADDRESS)(uintptr_t)va;
+        desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size);
+    }
 
-                Status = add_mapping(bs, mappings, va, (void*)(uintptr_t)desc->PhysicalStart,
-                                     desc->NumberOfPages, LoaderFirmwarePermanent);
-                if (EFI_ERROR(Status)) {
-                    print_error("add_mapping", Status);
-                    return Status;
-                }
+    efi_runtime_map_size = (uint8_t*)desc2 - (uint8_t*)efi_runtime_map;
 
-                va = (uint8_t*)va + (desc->NumberOfPages * EFI_PAGE_SIZE);
-            }
+    if (efi_runtime_map_size == 0) {
+        bs->FreePages(addr, alloc_pages);
+        efi_runtime_map = NULL;
+        return EFI_SUCCESS;
+    }
+
+    if (page_count(efi_runtime_map_size) < alloc_pages) {
+        bs->FreePages(addr + (page_count(efi_runtime_map_size) * EFI_PAGE_SIZE),
+                      alloc_pages - page_count(efi_runtime_map_size));
+    }
+
+    Status = va_reserve_identity(bs, efi_runtime_map, page_count(efi_runtime_map_size));
+    if (EFI_ERROR(Status)) {
+        print_error("va_reserve_identity", Status);
+        return Status;
+    }
 
-            desc2 = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc2 + map_desc_size);
+    // now give each runtime range a virtual address
+
+    for (desc = efi_runtime_map; (uint8_t*)desc < (uint8_t*)desc2; desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size)) {
+        void* va;
+
+        if (!(desc->Attribute & EFI_MEMORY_RUNTIME))
+            continue;
+
+        Status = va_map(bs, mappings, VA_REGION_SYSTEM, "EFI runtime", (void*)(uintptr_t)desc->PhysicalStart,
+                        desc->NumberOfPages, LoaderFirmwarePermanent, &va);
+        if (EFI_ERROR(Status)) {
+            print_error("va_map", Status);
+            return Status;
         }
 
-        desc = (EFI_MEMORY_DESCRIPTOR*)((uint8_t*)desc + map_desc_size);
+        desc->VirtualStart = (EFI_VIRTUAL_ADDRESS)(uintptr_t)va;
     }
 
     if (version >= _WIN32_WINNT_WINBLUE) {
-        Status = add_mapping(bs, mappings, va, (void*)(uintptr_t)efi_runtime_map,
-                             page_count(efi_runtime_map_size), LoaderFirmwarePermanent);
+        void* va;
+
+        Status = va_map(bs, mappings, VA_REGION_SYSTEM, "EFI runtime map", efi_runtime_map,
+                        page_count(efi_runtime_map_size), LoaderFirmwarePermanent, &va);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("va_map", Status);
             return Status;
         }
-
-        va = (uint8_t*)va + (page_count(efi_runtime_map_size) * EFI_PAGE_SIZE);
     }
 
     return EFI_SUCCESS;
 }
 
 EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings,
-                         LIST_ENTRY& mdl_head, void* va, uintptr_t* loader_pages_spanned) {
+                         LIST_ENTRY& mdl_head, uintptr_t* loader_pages_spanned) {
     EFI_STATUS Status;
+    void* va = va_next(VA_REGION_SYSTEM);
     UINTN size, key, descsize;
     UINT32 version;
     EFI_MEMORY_DESCRIPTOR* mapdesc;
@@ -889,7 +1086,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
     LIST_ENTRY* le;
     EFI_SYSTEM_TABLE* new_ST;
     void* mdl_pa;
-    size_t mdl_pages;
+    size_t mdl_pages, mdl_entries, mdl_count;
     mapping* first_map = _CR(mappings->Flink, mapping, list_entry);
 
     size = 0;
@@ -963,6 +1160,22 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
 
     memset(pml4, 0, EFI_PAGE_SIZE);
 
+    if (large_pages) {
+        int cpu_info[4];
+
+        __cpuid(cpu_info, 0x80000001);
+
+        huge_pages = cpu_info[3] & (1 << 26);
+    }
+
+    {
+        int cpu_info[4];
+
+        __cpuid(cpu_info, 0x80000001);
+
+        no_execute = cpu_info[3] & (1 << 20);
+    }
+
     Status = add_mapping(bs, mappings, NULL, pml4, 1, LoaderMemoryData);
     if (EFI_ERROR(Status)) {
         print_error("add_mapping", Status);
@@ -970,6 +1183,10 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
     }
 #endif
 
+    Status = reserve_pt_pool(bs, mappings, (uintptr_t)va);
+    if (EFI_ERROR(Status))
+        print_error("reserve_pt_pool", Status); // not fatal, we'll allocate tables as we go
+
     num_entries = 0;
 
     le = mappings->Flink;
@@ -1035,7 +1252,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
                 if ((uint8_t*)systable >= (uint8_t*)m->pa && (uint8_t*)systable < (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE))
                     new_ST = (EFI_SYSTEM_TABLE*)((uint8_t*)systable - (uint8_t*)m->pa + (uint8_t*)m->va);
 
-                Status = map_memory(bs, mappings, (uintptr_t)m->va, (uintptr_t)m->pa, m->pages);
+                Status = map_memory(bs, mappings, (uintptr_t)m->va, (uintptr_t)m->pa, m->pages, false);
                 if (EFI_ERROR(Status)) {
                     print_error("map_memory", Status);
                     return Status;
@@ -1048,30 +1265,36 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
 
     // map first page (doesn't get mapped above because VA is 0)
     // needed by HalInitializeBios unless DbgNoLegacyServices is set
-    Status = map_memory(bs, mappings, 0, 0, 1);
+    Status = map_memory(bs, mappings, 0, 0, 1, false);
     if (EFI_ERROR(Status)) {
         print_error("map_memory", Status);
         return Status;
     }
 
     if (apic) {
-        Status = map_memory(bs, mappings, APIC_BASE, (uintptr_t)apic, 1);
+        Status = map_memory(bs, mappings, APIC_BASE, (uintptr_t)apic, 1, false);
         if (EFI_ERROR(Status)) {
             print_error("map_memory", Status);
             return Status;
         }
     }
 
-    if (ft_pool) {
-        Status = map_memory(bs, mappings, (uintptr_t)ft_pool, (uintptr_t)ft_pool, FT_POOL_PAGES);
-        if (EFI_ERROR(Status)) {
-            print_error("map_memory", Status);
-            return Status;
+    {
+        void* base;
+        size_t pages;
+
+        for (unsigned int i = 0; pool_get_chunk(i, &base, &pages); i++) {
+            Status = map_memory(bs, mappings, (uintptr_t)base, (uintptr_t)base, pages, large_pages);
+            if (EFI_ERROR(Status)) {
+                print_error("map_memory", Status);
+                return Status;
+            }
         }
     }
 
     if (shadow_fb) {
-        Status = map_memory(bs, mappings, (uintptr_t)shadow_fb, (uintptr_t)shadow_fb, page_count(framebuffer_size));
+        Status = map_memory(bs, mappings, (uintptr_t)shadow_fb, (uintptr_t)shadow_fb, page_count(framebuffer_size),
+                            large_pages);
         if (EFI_ERROR(Status)) {
             print_error("map_memory", Status);
             return Status;
@@ -1082,7 +1305,8 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         auto desc = efi_runtime_map;
 
         while ((uint8_t*)desc < (uint8_t*)efi_runtime_map + efi_runtime_map_size) {
-            Status = map_memory(bs, mappings, (uintptr_t)desc->PhysicalStart, (uintptr_t)desc->PhysicalStart, desc->NumberOfPages);
+            Status = map_memory(bs, mappings, (uintptr_t)desc->PhysicalStart, (uintptr_t)desc->PhysicalStart, desc->NumberOfPages,
+                                large_pages);
             if (EFI_ERROR(Status)) {
                 print_error("map_memory", Status);
                 return Status;
@@ -1092,16 +1316,22 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         }
 
         Status = map_memory(bs, mappings, (uintptr_t)efi_runtime_map, (uintptr_t)efi_runtime_map,
-                            page_count(efi_runtime_map_size));
+                            page_count(efi_runtime_map_size), large_pages);
         if (EFI_ERROR(Status)) {
             print_error("map_memory", Status);
             return Status;
         }
+
+        Status = apply_runtime_attributes(bs, mappings);
+        if (EFI_ERROR(Status)) {
+            print_error("apply_runtime_attributes", Status);
+            return Status;
+        }
     }
 
 #ifdef _X86_
     if (pae) { // map cr3
-        Status = map_memory(bs, mappings, ((uintptr_t)pdpt + MM_KSEG0_BASE), (uintptr_t)pdpt, 1);
+        Status = map_memory(bs, mappings, ((uintptr_t)pdpt + MM_KSEG0_BASE), (uintptr_t)pdpt, 1, false);
         if (EFI_ERROR(Status)) {
             print_error("map_memory", Status);
             return Status;
@@ -1113,7 +1343,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
             HARDWARE_PTE_PAE* dir = (HARDWARE_PTE_PAE*)(pdpt[i].PageFrameNumber * EFI_PAGE_SIZE);
 
             for (unsigned int j = 0; j < EFI_PAGE_SIZE / sizeof(HARDWARE_PTE_PAE); j++) {
-                if (dir[j].Valid) {
+                if (dir[j].Valid && !dir[j].LargePage && !in_pt_pool(dir[j].PageFrameNumber)) {
                     Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)(dir[j].PageFrameNumber * EFI_PAGE_SIZE),
                                          1, LoaderMemoryData);
                     if (EFI_ERROR(Status)) {
@@ -1131,7 +1361,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         }
     } else {
         for (unsigned int i = 0; i < EFI_PAGE_SIZE / sizeof(HARDWARE_PTE); i++) {
-            if (page_directory[i].Valid) {
+            if (page_directory[i].Valid && !in_pt_pool(page_directory[i].PageFrameNumber)) {
                 Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)(page_directory[i].PageFrameNumber * EFI_PAGE_SIZE),
                                      1, LoaderMemoryData);
                 if (EFI_ERROR(Status)) {
@@ -1149,26 +1379,49 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
     }
 #endif
 
-    Status = allocate_mdl(bs, mappings, va, &mdl_pa, &mdl_pages);
+    Status = finish_pt_pool(bs, mappings);
+    if (EFI_ERROR(Status)) {
+        print_error("finish_pt_pool", Status);
+        return Status;
+    }
+
+    Status = allocate_mdl(bs, mappings, va, &mdl_pa, &mdl_pages, &mdl_entries);
     if (EFI_ERROR(Status)) {
         print_error("allocate_mdl", Status);
         return Status;
     }
 
-    Status = map_memory(bs, mappings, (uintptr_t)va, (uintptr_t)mdl_pa, mdl_pages);
+    Status = map_memory(bs, mappings, (uintptr_t)va, (uintptr_t)mdl_pa, mdl_pages, false);
     if (EFI_ERROR(Status)) {
         print_error("map_memory", Status);
         return Status;
     }
 
-    Status = setup_memory_descriptor_list(mappings, mdl_head, mdl_pa, va);
+#ifdef _X86_
+    if (!pae)
+#endif
+    {
+        Status = va_commit(bs, VA_REGION_SYSTEM, "memory descriptor list", va, mdl_pages);
+        if (EFI_ERROR(Status)) {
+            print_error("va_commit", Status);
+            return Status;
+        }
+    }
+
+    Status = setup_memory_descriptor_list(mappings, mdl_head, mdl_pa, va, mdl_entries, &mdl_count);
     if (EFI_ERROR(Status)) {
         print_error("setup_memory_descriptor_list", Status);
         return Status;
     }
 
+    if (dump_mdl)
+        save_mdl(bs, (MEMORY_ALLOCATION_DESCRIPTOR*)mdl_pa, mdl_count);
+
     va = (uint8_t*)va + (mdl_pages * EFI_PAGE_SIZE);
 
+    // draw anything outstanding while we can still use the text console
+    console_checkpoint();
+
     // get new key
     Status = bs->GetMemoryMap(&size, NULL, &key, &descsize, &version);
     if (EFI_ERROR(Status) && Status != EFI_BUFFER_TOO_SMALL) {
@@ -1200,6 +1453,10 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         return Status;
     }
 
+    // the text console has gone now
+    if (!gop_console)
+        set_console_mode(CONSOLE_NONE);
+
 #ifdef DEBUG
     print_string("Enabling paging" ELLIPSIS "\n");
 #endif
@@ -1243,6 +1500,10 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
     // clear MP flag
     __writecr0(__readcr0() & ~CR0_MP);
 
+    // set NXE flag in EFER MSR, as we may have used the NX bit
+    if (no_execute)
+        __writemsr(0xc0000080, __readmsr(0xc0000080) | 0x800);
+
     // set cr3
     __writecr3((uintptr_t)pml4);
 #endif
@@ -1251,23 +1512,3 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
 
     return EFI_SUCCESS;
 }
-
-void merge_mappings(LIST_ENTRY* mappings) {
-    LIST_ENTRY* le = mappings->Flink;
-
-    while (le != mappings) {
-        if (le->Flink == mappings)
-            break;
-
-        mapping* m = _CR(le, mapping, list_entry);
-        mapping* m2 = _CR(le->Flink, mapping, list_entry);
-
-        if (m->type == LoaderFree && m2->type == LoaderFree && !m->va && !m2->va && m2->pa == (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE)) {
-            m->pages += m2->pages;
-            RemoveEntryList(&m2->list_entry);
-            continue;
-        }
-
-        le = le->Flink;
-    }
-}
@@ -42,8 +42,8 @@ typedef struct {
 
 static boot_option* options = NULL;
 static unsigned int num_options, selected_option;
+static unsigned int first_option = 0, page_size = 1;
 
-extern void* framebuffer;
 extern EFI_GRAPHICS_OUTPUT_MODE_INFORMATION gop_info;
 extern unsigned int font_height;
 extern text_pos console_pos;
@@ -134,10 +134,10 @@ static EFI_STATUS parse_ini_file(char* data, LIST_ENTRY* ini_sections) {
             }
 
             if (!sect) { // allocate new section
-                Status = systable->BootServices->AllocatePool(EfiLoaderData, offsetof(ini_section, name[0]) + sectnamelen + 1,
-                                                              (void**)&sect);
+                Status = arena_alloc(systable->BootServices, offsetof(ini_section, name[0]) + sectnamelen + 1,
+                                     (void**)&sect);
                 if (EFI_ERROR(Status)) {
-                    print_error("AllocatePool", Status);
+                    print_error("arena_alloc", Status);
                     return Status;
                 }
 
@@ -148,10 +148,10 @@ static EFI_STATUS parse_ini_file(char* data, LIST_ENTRY* ini_sections) {
                 InsertTailList(ini_sections, &sect->list_entry);
             }
 
-            Status = systable->BootServices->AllocatePool(EfiLoaderData, sizeof(ini_value) + namelen + 1 + valuelen + 1,
-                                                          (void**)&item);
+            Status = arena_alloc(systable->BootServices, sizeof(ini_value) + namelen + 1 + valuelen + 1,
+                                 (void**)&item);
             if (EFI_ERROR(Status)) {
-                print_error("AllocatePool", Status);
+                print_error("arena_alloc", Status);
                 return Status;
             }
 
@@ -426,22 +426,6 @@ static EFI_STATUS load_ini_file(unsigned int* timeout) {
     Status = EFI_SUCCESS;
 
 end:
-    while (!IsListEmpty(&ini_sections)) {
-        ini_section* sect = _CR(ini_sections.Flink, ini_section, list_entry);
-
-        RemoveEntryList(&sect->list_entry);
-
-        while (!IsListEmpty(&sect->children)) {
-            ini_value* v = _CR(sect->children.Flink, ini_value, list_entry);
-
-            RemoveEntryList(&v->list_entry);
-
-            bs->FreePool(v);
-        }
-
-        bs->FreePool(sect);
-    }
-
     if (data)
         bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, page_count(size));
 
@@ -581,13 +565,29 @@ static EFI_STATUS draw_option(EFI_SIMPLE_TEXT_OUT_PROTOCOL* con, unsigned int po
     return EFI_SUCCESS;
 }
 
+// moves the page of options we're showing so that the selected one is on it
+static bool scroll_to_selected() {
+    unsigned int old_first = first_option;
+
+    if (selected_option < first_option)
+        first_option = selected_option;
+    else if (selected_option >= first_option + page_size)
+        first_option = selected_option - page_size + 1;
+
+    return first_option != old_first;
+}
+
+static unsigned int visible_options() {
+    return num_options - first_option < page_size ? num_options - first_option : page_size;
+}
+
 static EFI_STATUS draw_options(EFI_SIMPLE_TEXT_OUT_PROTOCOL* con, unsigned int cols) {
     EFI_STATUS Status;
 
-    // FIXME - paging
+    for (unsigned int i = 0; i < visible_options(); i++) {
+        unsigned int num = first_option + i;
 
-    for (unsigned int i = 0; i < num_options; i++) {
-        Status = draw_option(con, i, cols - 3, options[i].namew, i == selected_option);
+        Status = draw_option(con, i, cols - 3, options[num].namew, num == selected_option);
         if (EFI_ERROR(Status)) {
             print_error("draw_option", Status);
             return Status;
@@ -638,43 +638,23 @@ static void print_dec(uint32_t v) {
 }
 
 static void draw_box_gop(unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
-    uint32_t* base;
-
-    memset((uint32_t*)framebuffer + (y * gop_info.PixelsPerScanLine) + x, 0xff, w * sizeof(uint32_t));
-    memset((uint32_t*)framebuffer + ((y + h) * gop_info.PixelsPerScanLine) + x, 0xff, w * sizeof(uint32_t));
-
-    base = (uint32_t*)framebuffer + ((y + 1) * gop_info.PixelsPerScanLine);
-    for (unsigned int i = 0; i < h - 1; i++) {
-        base[x] = base[x + w - 1] = 0xffffffff;
-        base += gop_info.PixelsPerScanLine;
-    }
+    fill_rect(x, y, w, 1, 0xffffffff);
+    fill_rect(x, y + h, w, 1, 0xffffffff);
+    fill_rect(x, y + 1, 1, h - 1, 0xffffffff);
+    fill_rect(x + w - 1, y + 1, 1, h - 1, 0xffffffff);
 }
 
-static void draw_rect(unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint32_t colour) {
-    uint32_t* base;
-
-    base = (uint32_t*)framebuffer + (y * gop_info.PixelsPerScanLine) + x;
-
-    for (unsigned int i = 0; i < h; i++) {
-        for (unsigned int j = 0; j < w; j++) {
-            base[j] = colour;
-        }
-
-        base += gop_info.PixelsPerScanLine;
-    }
-}
-
-static void draw_option_gop(unsigned int num, const char* name, bool selected) {
+static void draw_option_gop(unsigned int row, const char* name, bool selected) {
     text_pos p;
 
     // FIXME - non-TTF
 
-    draw_rect(font_height + 1, (font_height * (num + 3)) + 1 + (font_height / 4),
+    fill_rect(font_height + 1, (font_height * (row + 3)) + 1 + (font_height / 4),
               gop_info.HorizontalResolution - (2 * font_height) - 2, font_height,
               selected ? 0xcccccc : 0x000000);
 
     p.x = font_height * 3 / 2;
-    p.y = font_height * (num + 4);
+    p.y = font_height * (row + 4);
 
     if (selected)
         draw_text_ft(name, p, 0xcccccc, 0x000000);
@@ -683,16 +663,65 @@ static void draw_option_gop(unsigned int num, const char* name, bool selected) {
 }
 
 static void draw_options_gop() {
-    // FIXME - paging
+    for (unsigned int i = 0; i < visible_options(); i++) {
+        unsigned int num = first_option + i;
+
+        draw_option_gop(i, options[num].name, num == selected_option);
+    }
+}
+
+// how many options fit inside the box
+static unsigned int gop_page_size() {
+    unsigned int box_bottom = gop_info.VerticalResolution - (font_height * 2);
+    unsigned int first_top = (font_height * 3) + 1 + (font_height / 4);
+
+    if (box_bottom < first_top + font_height)
+        return 1;
+
+    return (box_bottom - first_top) / font_height;
+}
+
+// only redraws what's changed, unless we've moved onto a different page
+static EFI_STATUS redraw_selection(EFI_SIMPLE_TEXT_OUT_PROTOCOL* con, unsigned int cols, unsigned int old_option) {
+    EFI_STATUS Status;
+    bool scrolled = scroll_to_selected();
 
-    for (unsigned int i = 0; i < num_options; i++) {
-        draw_option_gop(i, options[i].name, i == selected_option);
+    if (gop_console) {
+        begin_update();
+
+        if (scrolled)
+            draw_options_gop();
+        else {
+            draw_option_gop(old_option - first_option, options[old_option].name, false);
+            draw_option_gop(selected_option - first_option, options[selected_option].name, true);
+        }
+
+        end_update();
+
+        return EFI_SUCCESS;
     }
+
+    if (scrolled)
+        return draw_options(con, cols);
+
+    Status = draw_option(con, old_option - first_option, cols - 3, options[old_option].namew, false);
+    if (EFI_ERROR(Status)) {
+        print_error("draw_option", Status);
+        return Status;
+    }
+
+    Status = draw_option(con, selected_option - first_option, cols - 3, options[selected_option].namew, true);
+    if (EFI_ERROR(Status)) {
+        print_error("draw_option", Status);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
 }
 
 EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
     EFI_STATUS Status;
-    UINTN cols, rows;
+    UINTN cols = 0, rows = 0;
     EFI_EVENT evt;
     EFI_SIMPLE_TEXT_OUT_PROTOCOL* con = systable->ConOut;
     bool cursor_visible = con->Mode->CursorVisible;
@@ -711,7 +740,7 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
     if (gop_console) {
         text_pos p;
 
-        memset(framebuffer, 0, gop_info.PixelsPerScanLine * gop_info.VerticalResolution * 4); // clear screen
+        clear_screen();
 
         p.x = 0;
         p.y = font_height;
@@ -770,6 +799,11 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
             text_pos p;
             char s[10];
 
+            page_size = gop_page_size();
+            scroll_to_selected();
+
+            begin_update();
+
             draw_box_gop(font_height, font_height * 3, gop_info.HorizontalResolution - (font_height * 2), gop_info.VerticalResolution - (font_height * 5));
 
             draw_options_gop();
@@ -783,10 +817,15 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
 
             dec_to_str(s, timer);
             draw_text_ft(s, p, 0x000000, 0xffffff);
+
+            end_update();
         } else {
             if (cursor_visible)
                 con->EnableCursor(con, false);
 
+            page_size = rows > 5 ? rows - 5 : 1;
+            scroll_to_selected();
+
             Status = draw_box(con, 0, 2, cols - 1, rows - 3);
             if (EFI_ERROR(Status)) {
                 print_error("draw_box", Status);
@@ -847,11 +886,15 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
                     p.x = timer_pos;
                     p.y = gop_info.VerticalResolution - (font_height * 3 / 4);
 
-                    draw_rect(p.x, p.y - font_height, font_height * 5,
+                    begin_update();
+
+                    fill_rect(p.x, p.y - font_height, font_height * 5,
                               gop_info.VerticalResolution - p.y + font_height, 0x000000);
 
                     dec_to_str(s, timer);
                     draw_text_ft(s, p, 0x000000, 0xffffff);
+
+                    end_update();
                 } else {
                     Status = con->SetCursorPosition(con, (sizeof(timeout_messagew) - sizeof(wchar_t)) / sizeof(wchar_t), rows - 1);
                     if (EFI_ERROR(Status)) {
@@ -898,8 +941,9 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
                     if (gop_console) {
                         unsigned int y = gop_info.VerticalResolution - (font_height * 7 / 4);
 
-                        draw_rect(font_height, y, timer_pos + (font_height * 5),
+                        fill_rect(font_height, y, timer_pos + (font_height * 5),
                                   gop_info.VerticalResolution - y, 0x000000);
+                        flush_framebuffer();
                     } else {
                         Status = con->SetCursorPosition(con, 0, rows - 1);
                         if (EFI_ERROR(Status)) {
@@ -936,19 +980,28 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
                         selected_option = num_options - 1;
                     else
                         selected_option--;
-                } else if (key.ScanCode == 0x17) // escape
+                } else if (key.ScanCode == 9) { // page up
+                    if (selected_option > page_size)
+                        selected_option -= page_size;
+                    else
+                        selected_option = 0;
+                } else if (key.ScanCode == 0xa) { // page down
+                    selected_option += page_size;
+
+                    if (selected_option >= num_options)
+                        selected_option = num_options - 1;
+                } else if (key.ScanCode == 5) // home
+                    selected_option = 0;
+                else if (key.ScanCode == 6) // end
+                    selected_option = num_options - 1;
+                else if (key.ScanCode == 0x17) // escape
                     return EFI_ABORTED;
 
-                if (key.ScanCode == 1 || key.ScanCode == 2) {
-                    if (gop_console) {
-                        draw_option_gop(old_option, options[old_option].name, false);
-                        draw_option_gop(selected_option, options[selected_option].name, true);
-                    } else {
-                        Status = draw_options(con, cols);
-                        if (EFI_ERROR(Status)) {
-                            print_error("draw_options", Status);
-                            goto end;
-                        }
+                if (selected_option != old_option) {
+                    Status = redraw_selection(con, cols, old_option);
+                    if (EFI_ERROR(Status)) {
+                        print_error("redraw_selection", Status);
+                        goto end;
                     }
                 }
             }
@@ -958,8 +1011,7 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
     *ret = &options[selected_option];
 
     if (gop_console) {
-        memset(framebuffer, 0, gop_info.PixelsPerScanLine * gop_info.VerticalResolution * 4); // clear screen
-        memset(shadow_fb, 0, gop_info.PixelsPerScanLine * gop_info.VerticalResolution * 4);
+        clear_screen();
 
         console_pos.x = 0;
         console_pos.y = font_height;
@@ -0,0 +1,378 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "pagetable.h"
+
+/* Builds the page tables we hand over to the kernel. Like mapping.cpp, this only needs
+ * the allocator from the firmware - the tables are written through their physical
+ * addresses, which are identity-mapped until we switch cr3 in enable_paging. */
+
+#ifdef _X86_
+bool pae = true;
+HARDWARE_PTE* page_directory;
+HARDWARE_PTE_PAE* pdpt;
+#elif defined(__x86_64__)
+HARDWARE_PTE_PAE* pml4;
+bool huge_pages = false;
+#endif
+
+/* Page tables come out of a pool, which we size beforehand by looking at what we're
+ * going to map. This saves calling AllocatePages for every table, and means the whole
+ * lot can be described by one LoaderMemoryData mapping. If we guess too low, we fall
+ * back to allocating tables one at a time. */
+
+static EFI_PHYSICAL_ADDRESS pt_pool = 0;
+static size_t pt_pool_pages = 0;
+static size_t pt_pool_used = 0;
+
+EFI_STATUS alloc_pt_pool(EFI_BOOT_SERVICES* bs, size_t pages) {
+    EFI_STATUS Status;
+
+    pt_pool_pages = pages;
+    pt_pool_used = 0;
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, pt_pool_pages, &pt_pool);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        pt_pool = 0;
+        pt_pool_pages = 0;
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+bool in_pt_pool(uint64_t pfn) {
+    return pt_pool && pfn >= pt_pool / EFI_PAGE_SIZE && pfn < (pt_pool / EFI_PAGE_SIZE) + pt_pool_pages;
+}
+
+// give back what we haven't used, apart from enough to map the MDL, and record the rest
+EFI_STATUS finish_pt_pool(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
+    EFI_STATUS Status;
+    size_t keep;
+
+    static const size_t reserve = 3;
+
+    if (!pt_pool)
+        return EFI_SUCCESS;
+
+    keep = pt_pool_used + reserve;
+
+    if (keep < pt_pool_pages) {
+        Status = bs->FreePages(pt_pool + (keep * EFI_PAGE_SIZE), pt_pool_pages - keep);
+        if (EFI_ERROR(Status))
+            print_error("FreePages", Status);
+        else
+            pt_pool_pages = keep;
+    }
+
+    Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)pt_pool, pt_pool_pages, LoaderMemoryData);
+    if (EFI_ERROR(Status)) {
+        print_error("add_mapping", Status);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS allocate_page_table(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, EFI_PHYSICAL_ADDRESS* addr) {
+    if (pt_pool_used < pt_pool_pages) {
+        *addr = pt_pool + (pt_pool_used * EFI_PAGE_SIZE);
+        pt_pool_used++;
+    } else {
+        EFI_STATUS Status;
+
+        Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, addr);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePages", Status);
+            return Status;
+        }
+
+#ifdef __x86_64__
+        Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)*addr, 1, LoaderMemoryData);
+        if (EFI_ERROR(Status)) {
+            print_error("add_mapping", Status);
+            return Status;
+        }
+#else
+        UNUSED(mappings); // picked up when we walk the page directory
+#endif
+    }
+
+    memset((void*)(uintptr_t)*addr, 0, EFI_PAGE_SIZE);
+
+    return EFI_SUCCESS;
+}
+
+// replace a large page with a table of 512 smaller ones, mapping the same memory
+EFI_STATUS split_large_page(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, HARDWARE_PTE_PAE* entry,
+                            unsigned int pages_per_entry) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+    HARDWARE_PTE_PAE* table;
+    uint64_t pfn = entry->PageFrameNumber;
+
+    Status = allocate_page_table(bs, mappings, &addr);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    table = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
+
+    for (unsigned int i = 0; i < EFI_PAGE_SIZE / sizeof(HARDWARE_PTE_PAE); i++) {
+        table[i].PageFrameNumber = pfn + (i * pages_per_entry);
+        table[i].Valid = 1;
+        table[i].Write = 1;
+
+        if (pages_per_entry > 1) // 1 GB page split into 2 MB pages
+            table[i].LargePage = 1;
+    }
+
+    entry->PageFrameNumber = addr / EFI_PAGE_SIZE;
+    entry->LargePage = 0;
+
+    return EFI_SUCCESS;
+}
+
+/* If large is set, we use 2 MB pages (and 1 GB pages on amd64, if the CPU supports
+ * them) wherever both addresses are suitably aligned. Only our identity maps use this -
+ * the kernel expects the regions in the loader block to be mapped with 4 KB pages. */
+EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t va, uintptr_t pa, unsigned int pages,
+                      bool large) {
+    uintptr_t pfn = pa >> EFI_PAGE_SHIFT;
+
+#ifdef _X86_
+    if (pae) {
+        do {
+            HARDWARE_PTE_PAE* dir = (HARDWARE_PTE_PAE*)(pdpt[va >> 30].PageFrameNumber * EFI_PAGE_SIZE);
+            unsigned int index = (va >> 21) & 0x1ff;
+            unsigned int index2 = (va & 0x1ff000) >> 12;
+            HARDWARE_PTE_PAE* page_table;
+
+            if (large && !dir[index].Valid && index2 == 0 && (pfn & 0x1ff) == 0 && pages >= 0x200) { // 2 MB page
+                dir[index].PageFrameNumber = pfn;
+                dir[index].Valid = 1;
+                dir[index].Write = 1;
+                dir[index].LargePage = 1;
+
+                va += 0x200 * EFI_PAGE_SIZE;
+                pfn += 0x200;
+                pages -= 0x200;
+                continue;
+            }
+
+            if (dir[index].Valid && dir[index].LargePage) {
+                EFI_STATUS Status = split_large_page(bs, mappings, &dir[index], 1);
+                if (EFI_ERROR(Status)) {
+                    print_error("split_large_page", Status);
+                    return Status;
+                }
+            }
+
+            if (!dir[index].Valid) { // allocate new page table
+                EFI_STATUS Status;
+                EFI_PHYSICAL_ADDRESS addr;
+
+                Status = allocate_page_table(bs, mappings, &addr);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                dir[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
+                dir[index].Valid = 1;
+                dir[index].Write = 1;
+
+                page_table = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
+            } else
+                page_table = (HARDWARE_PTE_PAE*)(dir[index].PageFrameNumber * EFI_PAGE_SIZE);
+
+            page_table[index2].PageFrameNumber = pfn;
+            page_table[index2].Valid = 1;
+            page_table[index2].Write = 1;
+
+            va += EFI_PAGE_SIZE;
+            pfn++;
+            pages--;
+        } while (pages > 0);
+    } else {
+        UNUSED(mappings);
+        UNUSED(large);
+
+        do {
+            unsigned int index = va >> 22;
+            unsigned int index2 = (va & 0x3ff000) >> 12;
+            HARDWARE_PTE* page_table;
+
+            if (!page_directory[index].Valid) { // allocate new page table
+                EFI_STATUS Status;
+                EFI_PHYSICAL_ADDRESS addr;
+
+                Status = allocate_page_table(bs, mappings, &addr);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                page_directory[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
+                page_directory[index].Valid = 1;
+                page_directory[index].Write = 1;
+
+                page_table = (HARDWARE_PTE*)(uintptr_t)addr;
+            } else
+                page_table = (HARDWARE_PTE*)(page_directory[index].PageFrameNumber * EFI_PAGE_SIZE);
+
+            page_table[index2].PageFrameNumber = pfn;
+            page_table[index2].Valid = 1;
+            page_table[index2].Write = 1;
+
+            va += EFI_PAGE_SIZE;
+            pfn++;
+            pages--;
+        } while (pages > 0);
+    }
+#elif defined(__x86_64__)
+    do {
+        HARDWARE_PTE_PAE* pdpt;
+        HARDWARE_PTE_PAE* pd;
+        HARDWARE_PTE_PAE* pt;
+        unsigned int index = (va & 0xff8000000000) >> 39;
+        unsigned int index2 = (va & 0x7fc0000000) >> 30;
+        unsigned int index3 = (va & 0x3fe00000) >> 21;
+        unsigned int index4 = (va & 0x1ff000) >> 12;
+
+        if (!pml4[index].Valid) {
+            EFI_STATUS Status;
+            EFI_PHYSICAL_ADDRESS addr;
+
+            Status = allocate_page_table(bs, mappings, &addr);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            pml4[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
+            pml4[index].Valid = 1;
+            pml4[index].Write = 1;
+
+            pdpt = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
+        } else {
+            uint64_t ptr;
+
+            /* Somewhat surprising behaviour from gcc here - combining the following two lines into one
+             * results in the value being sign-extended. Compiler bug? */
+
+            ptr = pml4[index].PageFrameNumber;
+            ptr <<= EFI_PAGE_SHIFT;
+
+            pdpt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
+        }
+
+        if (large && huge_pages && !pdpt[index2].Valid && index3 == 0 && index4 == 0 && (pfn & 0x3ffff) == 0 &&
+            pages >= 0x40000) { // 1 GB page
+            pdpt[index2].PageFrameNumber = pfn;
+            pdpt[index2].Valid = 1;
+            pdpt[index2].Write = 1;
+            pdpt[index2].LargePage = 1;
+
+            va += 0x40000 * EFI_PAGE_SIZE;
+            pfn += 0x40000;
+            pages -= 0x40000;
+            continue;
+        }
+
+        if (pdpt[index2].Valid && pdpt[index2].LargePage) {
+            EFI_STATUS Status = split_large_page(bs, mappings, &pdpt[index2], 0x200);
+            if (EFI_ERROR(Status)) {
+                print_error("split_large_page", Status);
+                return Status;
+            }
+        }
+
+        if (!pdpt[index2].Valid) {
+            EFI_STATUS Status;
+            EFI_PHYSICAL_ADDRESS addr;
+
+            Status = allocate_page_table(bs, mappings, &addr);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            pdpt[index2].PageFrameNumber = addr / EFI_PAGE_SIZE;
+            pdpt[index2].Valid = 1;
+            pdpt[index2].Write = 1;
+
+            pd = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
+        } else {
+            uint64_t ptr;
+
+            ptr = pdpt[index2].PageFrameNumber;
+            ptr <<= EFI_PAGE_SHIFT;
+
+            pd = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
+        }
+
+        if (large && !pd[index3].Valid && index4 == 0 && (pfn & 0x1ff) == 0 && pages >= 0x200) { // 2 MB page
+            pd[index3].PageFrameNumber = pfn;
+            pd[index3].Valid = 1;
+            pd[index3].Write = 1;
+            pd[index3].LargePage = 1;
+
+            va += 0x200 * EFI_PAGE_SIZE;
+            pfn += 0x200;
+            pages -= 0x200;
+            continue;
+        }
+
+        if (pd[index3].Valid && pd[index3].LargePage) {
+            EFI_STATUS Status = split_large_page(bs, mappings, &pd[index3], 1);
+            if (EFI_ERROR(Status)) {
+                print_error("split_large_page", Status);
+                return Status;
+            }
+        }
+
+        if (!pd[index3].Valid) {
+            EFI_STATUS Status;
+            EFI_PHYSICAL_ADDRESS addr;
+
+            Status = allocate_page_table(bs, mappings, &addr);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            pd[index3].PageFrameNumber = addr / EFI_PAGE_SIZE;
+            pd[index3].Valid = 1;
+            pd[index3].Write = 1;
+
+            pt = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
+        } else {
+            uint64_t ptr;
+
+            ptr = pd[index3].PageFrameNumber;
+            ptr <<= EFI_PAGE_SHIFT;
+
+            pt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
+        }
+
+        pt[index4].PageFrameNumber = pfn;
+        pt[index4].Valid = 1;
+        pt[index4].Write = 1;
+
+        va += EFI_PAGE_SIZE;
+        pfn++;
+        pages--;
+    } while (pages > 0);
+#endif
+
+    return EFI_SUCCESS;
+}
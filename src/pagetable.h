@@ -0,0 +1,37 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "x86.h"
+
+#ifdef _X86_
+extern HARDWARE_PTE* page_directory;
+extern HARDWARE_PTE_PAE* pdpt;
+#elif defined(__x86_64__)
+extern HARDWARE_PTE_PAE* pml4;
+extern bool huge_pages;
+#endif
+
+EFI_STATUS alloc_pt_pool(EFI_BOOT_SERVICES* bs, size_t pages);
+bool in_pt_pool(uint64_t pfn);
+EFI_STATUS finish_pt_pool(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings);
+EFI_STATUS allocate_page_table(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, EFI_PHYSICAL_ADDRESS* addr);
+EFI_STATUS split_large_page(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, HARDWARE_PTE_PAE* entry,
+                            unsigned int pages_per_entry);
+EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t va, uintptr_t pa, unsigned int pages,
+                      bool large);
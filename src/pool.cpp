@@ -0,0 +1,427 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "x86.h"
+
+/* Heap used by FreeType and HarfBuzz. We can't use AllocatePool for this, as we
+ * carry on drawing text after ExitBootServices, so it's made up of chunks which we
+ * get from AllocatePages. We only add chunks as we need them, and stop once the
+ * memory map has been processed, as everything has to be identity-mapped by then.
+ * Nothing here is zeroed - FreeType and HarfBuzz clear what they need to.
+ *
+ * Free blocks are kept in bins by the power of two of their size, so an
+ * allocation only has to look at one bin, and a bitmap tells us which of the
+ * bins have anything in them. Small requests are rounded up to 32, 64, 128 or
+ * 256 bytes, and as these are powers of two the first block in their bin always fits. Every block has a
+ * boundary tag giving the size of the block before it, so that free blocks can
+ * be merged with their neighbours straight away. */
+
+typedef struct {
+    uint32_t prev_size; // 0 if first block
+    uint32_t size : 31; // including header
+    uint32_t free : 1;
+} pool_block;
+
+typedef struct _free_block {
+    pool_block header;
+    struct _free_block* next;
+    struct _free_block* prev;
+} free_block;
+
+static_assert(sizeof(pool_block) == 8);
+
+#define POOL_ALIGN 8
+#define MIN_BLOCK ((sizeof(free_block) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+#define SMALL_MIN 32 // smallest power of two which will hold a free_block on either architecture
+#define SMALL_LIMIT 256
+
+static_assert(SMALL_MIN >= MIN_BLOCK);
+#define NUM_BINS 32
+
+// most we'll use, which is what we used to reserve up front
+#define POOL_MAX_PAGES (16777216 >> EFI_PAGE_SHIFT) // 16 MB
+#define POOL_CHUNK_PAGES (1048576 >> EFI_PAGE_SHIFT) // 1 MB
+#define MAX_POOL_CHUNKS 16
+
+typedef struct {
+    void* base;
+    size_t pages;
+} pool_chunk;
+
+static free_block* bins[NUM_BINS];
+static uint32_t bin_map = 0;
+static pool_chunk chunks[MAX_POOL_CHUNKS];
+static unsigned int num_chunks = 0;
+static size_t pool_pages = 0;
+static bool pool_frozen = false;
+static size_t pool_used = 0;
+static size_t pool_peak = 0;
+
+static unsigned int bin_index(uint32_t size) {
+    unsigned int i = 0;
+
+    while (size >>= 1) {
+        i++;
+    }
+
+    return i;
+}
+
+static pool_block* next_block(pool_block* b) {
+    return (pool_block*)((uint8_t*)b + b->size);
+}
+
+static pool_block* prev_block(pool_block* b) {
+    return (pool_block*)((uint8_t*)b - b->prev_size);
+}
+
+static void bin_insert(pool_block* b) {
+    auto fb = (free_block*)b;
+    auto idx = bin_index(b->size);
+
+    fb->prev = nullptr;
+    fb->next = bins[idx];
+
+    if (bins[idx])
+        bins[idx]->prev = fb;
+
+    bins[idx] = fb;
+    bin_map |= 1u << idx;
+
+    b->free = 1;
+}
+
+static void bin_remove(pool_block* b) {
+    auto fb = (free_block*)b;
+    auto idx = bin_index(b->size);
+
+    if (fb->prev)
+        fb->prev->next = fb->next;
+    else
+        bins[idx] = fb->next;
+
+    if (fb->next)
+        fb->next->prev = fb->prev;
+
+    if (!bins[idx])
+        bin_map &= ~(1u << idx);
+
+    b->free = 0;
+}
+
+static uint32_t block_size(size_t size) {
+    size += sizeof(pool_block);
+
+    if (size <= SMALL_LIMIT) {
+        uint32_t s = SMALL_MIN;
+
+        while (s < size) {
+            s <<= 1;
+        }
+
+        return s;
+    }
+
+    return (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+}
+
+static pool_block* find_free(uint32_t size) {
+    auto idx = bin_index(size);
+    uint32_t map;
+
+    // if not a power of two, not everything in its bin will be big enough
+    if (size & (size - 1)) {
+        for (auto fb = bins[idx]; fb; fb = fb->next) {
+            if (fb->header.size >= size)
+                return &fb->header;
+        }
+
+        idx++;
+
+        if (idx == NUM_BINS)
+            return nullptr;
+    }
+
+    // anything in a higher bin will do
+
+    map = bin_map & (~0u << idx);
+
+    if (map == 0)
+        return nullptr;
+
+    idx = 0;
+    while (!(map & 1)) {
+        map >>= 1;
+        idx++;
+    }
+
+    return &bins[idx]->header;
+}
+
+// merges b with any free neighbours, and puts the result in its bin
+static void release(pool_block* b) {
+    auto next = next_block(b);
+
+    if (next->free) {
+        bin_remove(next);
+        b->size += next->size;
+    }
+
+    if (b->prev_size != 0) {
+        auto prev = prev_block(b);
+
+        if (prev->free) {
+            bin_remove(prev);
+            prev->size += b->size;
+            b = prev;
+        }
+    }
+
+    next_block(b)->prev_size = b->size;
+
+    bin_insert(b);
+}
+
+// cuts b down to size, if there's enough left over to be worth it
+static void split(pool_block* b, uint32_t size) {
+    if (b->size - size < MIN_BLOCK)
+        return;
+
+    auto rest = (pool_block*)((uint8_t*)b + size);
+
+    rest->prev_size = size;
+    rest->size = b->size - size;
+    rest->free = 0;
+
+    b->size = size;
+
+    release(rest);
+}
+
+static void add_chunk(void* base, size_t size) {
+    auto b = (pool_block*)base;
+
+    b->prev_size = 0;
+    b->size = size - sizeof(pool_block);
+    b->free = 0;
+
+    // in-use dummy block at the end, so we never merge past it
+    auto end = next_block(b);
+
+    end->prev_size = b->size;
+    end->size = 0;
+    end->free = 0;
+
+    bin_insert(b);
+}
+
+static bool pool_grow(size_t size) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+    size_t pages;
+
+    if (pool_frozen || num_chunks == MAX_POOL_CHUNKS)
+        return false;
+
+    // leave room for the header and the dummy block at the end
+    pages = page_count(size + (2 * sizeof(pool_block)));
+
+    if (pages < POOL_CHUNK_PAGES)
+        pages = POOL_CHUNK_PAGES;
+
+    if (pool_pages + pages > POOL_MAX_PAGES)
+        return false;
+
+    Status = systable->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+    if (EFI_ERROR(Status))
+        return false;
+
+    chunks[num_chunks].base = (void*)(uintptr_t)addr;
+    chunks[num_chunks].pages = pages;
+    num_chunks++;
+
+    pool_pages += pages;
+
+    add_chunk((void*)(uintptr_t)addr, pages << EFI_PAGE_SHIFT);
+
+    return true;
+}
+
+static void account(size_t old_size, size_t new_size) {
+    pool_used += new_size - old_size;
+
+    if (pool_used > pool_peak)
+        pool_peak = pool_used;
+}
+
+bool pool_init() {
+    // we may have used the pool already, if the font cache put off starting FreeType
+    if (num_chunks != 0)
+        return true;
+
+    return pool_grow(0);
+}
+
+void* pool_alloc(size_t size) {
+    pool_block* b;
+
+    if (size == 0 || size > 0x7fffffff - SMALL_LIMIT)
+        return nullptr;
+
+    auto bs = block_size(size);
+
+    b = find_free(bs);
+
+    if (!b) {
+        if (!pool_grow(bs))
+            return nullptr;
+
+        b = find_free(bs);
+        if (!b)
+            return nullptr;
+    }
+
+    bin_remove(b);
+    split(b, bs);
+
+    account(0, b->size);
+
+    return (uint8_t*)b + sizeof(pool_block);
+}
+
+void pool_free(void* ptr) {
+    if (!ptr)
+        return;
+
+    auto b = (pool_block*)((uint8_t*)ptr - sizeof(pool_block));
+
+    account(b->size, 0);
+
+    release(b);
+}
+
+void* pool_realloc(void* ptr, size_t size) {
+    void* ret;
+
+    if (!ptr)
+        return pool_alloc(size);
+
+    if (size == 0 || size > 0x7fffffff - SMALL_LIMIT)
+        return nullptr;
+
+    auto b = (pool_block*)((uint8_t*)ptr - sizeof(pool_block));
+    auto bs = block_size(size);
+    uint32_t old_size = b->size;
+
+    // shrink in place
+    if (bs <= old_size) {
+        split(b, bs);
+        account(old_size, b->size);
+        return ptr;
+    }
+
+    // grow in place, if the next block is free and big enough
+    auto next = next_block(b);
+
+    if (next->free && old_size + next->size >= bs) {
+        bin_remove(next);
+        b->size += next->size;
+        next_block(b)->prev_size = b->size;
+
+        split(b, bs);
+        account(old_size, b->size);
+
+        return ptr;
+    }
+
+    ret = pool_alloc(size);
+    if (!ret)
+        return nullptr;
+
+    memcpy(ret, ptr, old_size - sizeof(pool_block));
+
+    pool_free(ptr);
+
+    return ret;
+}
+
+/* Called once we start working out the memory map, after which we can't add any
+ * more chunks. Make sure there's some room left for drawing text until we hand over. */
+void pool_freeze() {
+    size_t free_space = 0;
+
+    if (pool_frozen)
+        return;
+
+    // if nothing's used the pool yet, nothing will
+    if (num_chunks != 0) {
+        for (unsigned int i = 0; i < NUM_BINS; i++) {
+            for (auto fb = bins[i]; fb; fb = fb->next) {
+                free_space += fb->header.size;
+            }
+        }
+
+        if (free_space < (POOL_CHUNK_PAGES << EFI_PAGE_SHIFT) / 2)
+            pool_grow(0);
+    }
+
+    pool_frozen = true;
+}
+
+// for when we no longer need FreeType - nothing allocated from the pool can be used after this
+void pool_release() {
+    for (unsigned int i = 0; i < num_chunks; i++) {
+        systable->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)chunks[i].base, chunks[i].pages);
+    }
+
+    num_chunks = 0;
+    pool_pages = 0;
+    pool_frozen = true;
+
+    memset(bins, 0, sizeof(bins));
+    bin_map = 0;
+}
+
+bool pool_get_chunk(unsigned int i, void** base, size_t* pages) {
+    if (i >= num_chunks)
+        return false;
+
+    *base = chunks[i].base;
+    *pages = chunks[i].pages;
+
+    return true;
+}
+
+void print_pool_stats() {
+    char s[255], *p;
+
+    p = stpcpy(s, "Font pool: ");
+    p = dec_to_str(p, pool_peak / 1024);
+    p = stpcpy(p, " KB peak use, ");
+    p = dec_to_str(p, (pool_pages << EFI_PAGE_SHIFT) / 1024);
+    p = stpcpy(p, " KB in ");
+    p = dec_to_str(p, num_chunks);
+    p = stpcpy(p, " chunks (limit ");
+    p = dec_to_str(p, (POOL_MAX_PAGES << EFI_PAGE_SHIFT) / 1024);
+    p = stpcpy(p, " KB)\n");
+
+    print_string(s);
+}
@@ -5,10 +5,17 @@
 #include "quibbleproto.h"
 #include "print.h"
 #include "misc.h"
+#include "x86.h"
+#include "fontcache.h"
 #include <ft2build.h>
 #include <freetype/freetype.h>
 #include <hb.h>
 
+#if defined(__x86_64__) || defined(__SSE2__)
+#define BLEND_SSE2
+#include <emmintrin.h>
+#endif
+
 static EFI_HANDLE info_handle = NULL;
 static EFI_QUIBBLE_INFO_PROTOCOL info_proto;
 text_pos console_pos;
@@ -20,8 +27,13 @@ static hb_face_t* hb_face = nullptr;
 static hb_font_t* hb_font = nullptr;
 bool gop_console = false;
 unsigned int font_height = 0;
-uint8_t* ft_pool = nullptr;
 static FT_MemoryRec_ ftmem;
+static unsigned int font_size_px = 16;
+static uint32_t glyph_size = 0; // (x_ppem << 16) | y_ppem
+static bool freetype_ready = false; // set up for font_size_px
+static bool freetype_failed = false;
+static font_cache_header* font_cache = nullptr;
+static size_t font_cache_size = 0;
 
 extern void* framebuffer;
 extern EFI_GRAPHICS_OUTPUT_MODE_INFORMATION gop_info;
@@ -36,12 +48,85 @@ extern size_t font_size asm ("_font_size");
 
 void* font_data = &font_data_start;
 
-struct alloc_header {
-    uint32_t size : 31;
-    uint32_t free : 1;
-};
-
-static_assert(sizeof(alloc_header) == 4);
+/* Rendered glyphs, so that we only have to go through FreeType once for each
+ * glyph at each size. The coverage bitmaps live in the font pool, which means we can
+ * carry on using them after ExitBootServices. */
+typedef struct _cached_glyph {
+    struct _cached_glyph* next;
+    unsigned int index;
+    uint32_t size;
+    int left;
+    int top;
+    unsigned int width;
+    unsigned int rows;
+    unsigned int pixel_mode;
+    uint8_t data[];
+} cached_glyph;
+
+#define GLYPH_CACHE_BUCKETS 256
+
+static cached_glyph* glyph_cache[GLYPH_CACHE_BUCKETS];
+
+typedef struct {
+    unsigned int glyph;
+    unsigned int cluster;
+    int x_advance;
+    int y_advance;
+    int x_offset;
+    int y_offset;
+} shaped_glyph;
+
+// recently shaped lines, for anything which isn't plain ASCII
+typedef struct {
+    shaped_glyph* glyphs;
+    unsigned int count;
+    uint32_t hash;
+    size_t length;
+    uint32_t last_used;
+} shaped_run;
+
+#define SHAPED_RUN_CACHE_SIZE 32
+
+static shaped_run shaped_runs[SHAPED_RUN_CACHE_SIZE];
+static uint32_t shaped_run_clock = 0;
+static shaped_glyph* scratch_glyphs = nullptr;
+static unsigned int scratch_size = 0;
+
+typedef struct {
+    unsigned int glyph;
+    int advance;
+} ascii_glyph;
+
+#define ASCII_GLYPHS ('~' - ' ' + 1)
+
+static ascii_glyph ascii_glyphs[ASCII_GLYPHS];
+static bool ascii_glyphs_valid = false;
+
+// anything else the font cache gave us, which we can also lay out without HarfBuzz
+typedef struct {
+    uint32_t codepoint;
+    unsigned int glyph;
+    int advance;
+} extra_glyph;
+
+#define MAX_EXTRA_GLYPHS 16
+
+static extra_glyph extra_glyphs[MAX_EXTRA_GLYPHS];
+static unsigned int num_extra_glyphs = 0;
+
+/* The shadow buffer is the master copy of what's on the screen: everything is
+ * drawn there first, and only the bits which have changed get copied to the real
+ * framebuffer, which is slow to write to. The shadow is a ring of scanlines, so
+ * that scrolling just means moving the origin rather than copying everything. */
+typedef struct {
+    unsigned int left;
+    unsigned int right;
+} dirty_span;
+
+static dirty_span* dirty_spans = nullptr;
+static unsigned int dirty_top = 0, dirty_bottom = 0;
+static unsigned int shadow_origin = 0;
+static unsigned int update_depth = 0;
 
 class hb_buf_closer {
 public:
@@ -54,6 +139,10 @@ public:
 
 using hb_buf = std::unique_ptr<hb_buffer_t*, hb_buf_closer>;
 
+static void* ft_alloc(FT_Memory, long size);
+static void ft_free(FT_Memory, void* block);
+static bool start_freetype();
+
 static void print_string_c(const char* s) {
     print_string(s);
 }
@@ -66,31 +155,602 @@ EFI_STATUS info_register(EFI_BOOT_SERVICES* bs) {
     return bs->InstallProtocolInterface(&info_handle, &info_guid, EFI_NATIVE_INTERFACE, &info_proto);
 }
 
+static uint32_t* shadow_line(unsigned int y) {
+    y += shadow_origin;
+
+    if (y >= gop_info.VerticalResolution)
+        y -= gop_info.VerticalResolution;
+
+    return (uint32_t*)shadow_fb + (y * gop_info.PixelsPerScanLine);
+}
+
+static void mark_dirty(unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+    if (w == 0 || h == 0)
+        return;
+
+    if (y < dirty_top)
+        dirty_top = y;
+
+    if (y + h > dirty_bottom)
+        dirty_bottom = y + h;
+
+    if (!dirty_spans) // couldn't allocate, so we'll copy whole lines
+        return;
+
+    for (unsigned int i = y; i < y + h; i++) {
+        if (x < dirty_spans[i].left)
+            dirty_spans[i].left = x;
+
+        if (x + w > dirty_spans[i].right)
+            dirty_spans[i].right = x + w;
+    }
+}
+
+static void copy_span(uint32_t* dest, const uint32_t* src, unsigned int count) {
+#ifdef BLEND_SSE2
+    /* We never read the framebuffer back, and it's normally write-combining, so use
+     * non-temporal stores to keep it from evicting anything from the cache. */
+
+    while (count > 0 && ((uintptr_t)dest & 15)) {
+        *dest = *src;
+        dest++;
+        src++;
+        count--;
+    }
+
+    while (count >= 4) {
+        _mm_stream_si128((__m128i*)dest, _mm_loadu_si128((const __m128i*)src));
+        dest += 4;
+        src += 4;
+        count -= 4;
+    }
+
+    while (count > 0) {
+        *dest = *src;
+        dest++;
+        src++;
+        count--;
+    }
+#else
+    memcpy(dest, src, count * sizeof(uint32_t));
+#endif
+}
+
+void flush_framebuffer() {
+    for (unsigned int y = dirty_top; y < dirty_bottom; y++) {
+        unsigned int left, right;
+
+        if (dirty_spans) {
+            left = dirty_spans[y].left;
+            right = dirty_spans[y].right;
+
+            dirty_spans[y].left = gop_info.HorizontalResolution;
+            dirty_spans[y].right = 0;
+
+            if (right <= left)
+                continue;
+        } else {
+            left = 0;
+            right = gop_info.HorizontalResolution;
+        }
+
+        copy_span((uint32_t*)framebuffer + (y * gop_info.PixelsPerScanLine) + left, shadow_line(y) + left,
+                  right - left);
+    }
+
+#ifdef BLEND_SSE2
+    _mm_sfence();
+#endif
+
+    dirty_top = gop_info.VerticalResolution;
+    dirty_bottom = 0;
+}
+
+/* Between these, drawing only goes to the shadow buffer, so that anything made up of
+ * several pieces reaches the screen in one go. */
+void begin_update() {
+    update_depth++;
+}
+
+void end_update() {
+    if (update_depth > 0 && --update_depth == 0)
+        flush_framebuffer();
+}
+
+void fill_rect(unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint32_t colour) {
+    for (unsigned int i = y; i < y + h; i++) {
+        auto line = shadow_line(i) + x;
+
+        for (unsigned int j = 0; j < w; j++) {
+            line[j] = colour;
+        }
+    }
+
+    mark_dirty(x, y, w, h);
+}
+
+void clear_screen() {
+    shadow_origin = 0;
+
+    memset(shadow_fb, 0, gop_info.PixelsPerScanLine * gop_info.VerticalResolution * sizeof(uint32_t)); // black
+
+    mark_dirty(0, 0, gop_info.HorizontalResolution, gop_info.VerticalResolution);
+
+    if (update_depth == 0)
+        flush_framebuffer();
+}
+
+// exact for anything up to 255 * 255
+static uint32_t div255(uint32_t x) {
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+static uint32_t blend_pixel(uint32_t bg, uint32_t fg, uint8_t alpha) {
+    uint32_t ret = 0;
+
+    for (unsigned int i = 0; i < 32; i += 8) {
+        uint32_t b = (bg >> i) & 0xff;
+        uint32_t f = (fg >> i) & 0xff;
+
+        ret |= div255((b * (255 - alpha)) + (f * alpha)) << i;
+    }
+
+    return ret;
+}
+
+#ifdef BLEND_SSE2
+static __m128i div255_epi16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_add_epi16(_mm_set1_epi16(1), _mm_srli_epi16(x, 8)));
+
+    return _mm_srli_epi16(x, 8);
+}
+
+// two pixels at a time, with each channel widened to 16 bits
+static __m128i blend_epi16(__m128i bg, __m128i fg, __m128i alpha) {
+    auto inv = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+
+    return div255_epi16(_mm_add_epi16(_mm_mullo_epi16(bg, inv), _mm_mullo_epi16(fg, alpha)));
+}
+#endif
+
+static void blend_gray_span(uint32_t* dest, const uint8_t* coverage, unsigned int count, uint32_t fg) {
+    unsigned int i = 0;
+
+#ifdef BLEND_SSE2
+    auto zero = _mm_setzero_si128();
+    auto fg16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)fg), zero);
+
+    for (; i + 4 <= count; i += 4) {
+        uint32_t c;
+
+        memcpy(&c, coverage + i, sizeof(c));
+
+        if (c == 0) // gap between strokes
+            continue;
+
+        auto bg = _mm_loadu_si128((const __m128i*)(dest + i));
+        auto a = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)c), zero);
+
+        a = _mm_unpacklo_epi16(a, a);
+
+        auto lo = blend_epi16(_mm_unpacklo_epi8(bg, zero), fg16, _mm_unpacklo_epi32(a, a));
+        auto hi = blend_epi16(_mm_unpackhi_epi8(bg, zero), fg16, _mm_unpackhi_epi32(a, a));
+
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < count; i++) {
+        if (coverage[i] != 0)
+            dest[i] = blend_pixel(dest[i], fg, coverage[i]);
+    }
+}
+
+static void blend_bgra_span(uint32_t* dest, const uint32_t* src, unsigned int count) {
+    unsigned int i = 0;
+
+#ifdef BLEND_SSE2
+    auto zero = _mm_setzero_si128();
+    auto rgb_mask = _mm_set1_epi32(0xffffff);
+
+    for (; i + 4 <= count; i += 4) {
+        auto s = _mm_loadu_si128((const __m128i*)(src + i));
+        auto bg = _mm_loadu_si128((const __m128i*)(dest + i));
+        auto fg = _mm_and_si128(s, rgb_mask);
+
+        // copy each pixel's alpha across all four of its channels
+        auto a_lo = _mm_unpacklo_epi8(s, zero);
+        auto a_hi = _mm_unpackhi_epi8(s, zero);
+
+        a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a_lo, 0xff), 0xff);
+        a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a_hi, 0xff), 0xff);
+
+        auto lo = blend_epi16(_mm_unpacklo_epi8(bg, zero), _mm_unpacklo_epi8(fg, zero), a_lo);
+        auto hi = blend_epi16(_mm_unpackhi_epi8(bg, zero), _mm_unpackhi_epi8(fg, zero), a_hi);
+
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for (; i < count; i++) {
+        uint8_t alpha = src[i] >> 24;
+
+        if (alpha != 0)
+            dest[i] = blend_pixel(dest[i], src[i] & 0xffffff, alpha);
+    }
+}
+
 static void move_up_console(unsigned int delta) {
-    uint32_t* src;
-    uint32_t* dest;
+    // the top lines become the new bottom lines
+    for (unsigned int y = 0; y < delta; y++) {
+        memset(shadow_line(y), 0, gop_info.PixelsPerScanLine * sizeof(uint32_t)); // black
+    }
 
-    src = (uint32_t*)shadow_fb + (gop_info.PixelsPerScanLine * delta);
-    dest = (uint32_t*)shadow_fb;
+    shadow_origin += delta;
 
-    memcpy(dest, src, gop_info.PixelsPerScanLine * (gop_info.VerticalResolution - delta) * sizeof(uint32_t));
-    dest += gop_info.PixelsPerScanLine * (gop_info.VerticalResolution - delta);
+    if (shadow_origin >= gop_info.VerticalResolution)
+        shadow_origin -= gop_info.VerticalResolution;
 
-    memset(dest, 0, gop_info.PixelsPerScanLine * delta * sizeof(uint32_t)); // black
+    // everything on the screen has moved, but we leave it until the next flush
+    mark_dirty(0, 0, gop_info.HorizontalResolution, gop_info.VerticalResolution);
+}
+
+static void flush_glyph_cache() {
+    for (unsigned int i = 0; i < GLYPH_CACHE_BUCKETS; i++) {
+        while (glyph_cache[i]) {
+            auto g = glyph_cache[i];
 
-    memcpy(framebuffer, shadow_fb, framebuffer_size);
+            glyph_cache[i] = g->next;
+            ft_free(nullptr, g);
+        }
+    }
 }
 
-void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t fg_colour) {
+static cached_glyph* add_glyph(unsigned int index, uint32_t size) {
     FT_Error error;
-    FT_Bitmap* bitmap;
-    uint8_t fg_r, fg_g, fg_b;
+    unsigned int flags = FT_LOAD_RENDER | FT_RENDER_MODE_NORMAL;
+    unsigned int bpp, width, rows, pixel_mode;
+    cached_glyph* g;
+
+    if (!start_freetype())
+        return nullptr;
+
+    if (FT_HAS_COLOR(face))
+        flags |= FT_LOAD_COLOR;
+
+    error = FT_Load_Glyph(face, index, flags);
+
+    // also cache failures, so we don't keep on asking FreeType for them
+
+    if (error)
+        pixel_mode = FT_PIXEL_MODE_NONE;
+    else
+        pixel_mode = face->glyph->bitmap.pixel_mode;
+
+    switch (pixel_mode) {
+        case FT_PIXEL_MODE_GRAY:
+            bpp = sizeof(uint8_t);
+            break;
+
+        case FT_PIXEL_MODE_BGRA:
+            bpp = sizeof(uint32_t);
+            break;
+
+        default:
+            pixel_mode = FT_PIXEL_MODE_NONE;
+            bpp = 0;
+            break;
+    }
+
+    if (bpp != 0) {
+        width = face->glyph->bitmap.width;
+        rows = face->glyph->bitmap.rows;
+    } else {
+        width = 0;
+        rows = 0;
+    }
+
+    g = (cached_glyph*)ft_alloc(nullptr, offsetof(cached_glyph, data) + (width * rows * bpp));
+
+    if (!g) { // pool full - throw everything away and try again
+        flush_glyph_cache();
+
+        g = (cached_glyph*)ft_alloc(nullptr, offsetof(cached_glyph, data) + (width * rows * bpp));
+        if (!g)
+            return nullptr;
+    }
+
+    g->index = index;
+    g->size = size;
+    g->pixel_mode = pixel_mode;
+    g->width = width;
+    g->rows = rows;
+
+    if (bpp != 0) {
+        auto& bitmap = face->glyph->bitmap;
+
+        g->left = face->glyph->bitmap_left;
+        g->top = face->glyph->bitmap_top;
+
+        // pitch can be padded or negative, so copy row by row
+
+        for (unsigned int y = 0; y < rows; y++) {
+            memcpy(g->data + (y * width * bpp), bitmap.buffer + ((int)y * bitmap.pitch), width * bpp);
+        }
+    } else {
+        g->left = 0;
+        g->top = 0;
+    }
+
+    auto& bucket = glyph_cache[index % GLYPH_CACHE_BUCKETS];
+
+    g->next = bucket;
+    bucket = g;
+
+    return g;
+}
+
+static cached_glyph* get_glyph(unsigned int index) {
+    for (auto g = glyph_cache[index % GLYPH_CACHE_BUCKETS]; g; g = g->next) {
+        if (g->index == index && g->size == glyph_size)
+            return g;
+    }
+
+    return add_glyph(index, glyph_size);
+}
+
+static void init_ascii_glyphs() {
+    if (!start_freetype())
+        return;
+
+    for (unsigned int i = 0; i < ASCII_GLYPHS; i++) {
+        hb_codepoint_t glyph;
+
+        if (!hb_font_get_nominal_glyph(hb_font, i + ' ', &glyph))
+            glyph = 0; // .notdef, as HarfBuzz would give us
+
+        ascii_glyphs[i].glyph = glyph;
+        ascii_glyphs[i].advance = hb_font_get_glyph_h_advance(hb_font, glyph);
+    }
+
+    ascii_glyphs_valid = true;
+}
+
+/* Returns the number of bytes used by the character at the start of sv, if it's one we
+ * can lay out ourselves, or 0 if HarfBuzz needs to deal with it. */
+static unsigned int simple_glyph(std::string_view sv, unsigned int& glyph, int& advance) {
+    auto c = (uint8_t)sv[0];
+    unsigned int len;
+    uint32_t cp;
+
+    if (c >= ' ' && c <= '~') {
+        glyph = ascii_glyphs[c - ' '].glyph;
+        advance = ascii_glyphs[c - ' '].advance;
+        return 1;
+    }
+
+    if (num_extra_glyphs == 0)
+        return 0;
+
+    if ((c & 0xe0) == 0xc0) {
+        cp = c & 0x1f;
+        len = 2;
+    } else if ((c & 0xf0) == 0xe0) {
+        cp = c & 0xf;
+        len = 3;
+    } else if ((c & 0xf8) == 0xf0) {
+        cp = c & 0x7;
+        len = 4;
+    } else
+        return 0;
+
+    if (sv.size() < len)
+        return 0;
+
+    for (unsigned int i = 1; i < len; i++) {
+        if ((sv[i] & 0xc0) != 0x80)
+            return 0;
+
+        cp = (cp << 6) | (sv[i] & 0x3f);
+    }
+
+    for (unsigned int i = 0; i < num_extra_glyphs; i++) {
+        if (extra_glyphs[i].codepoint == cp) {
+            glyph = extra_glyphs[i].glyph;
+            advance = extra_glyphs[i].advance;
+            return len;
+        }
+    }
+
+    return 0;
+}
+
+// returns the number of glyphs, or 0 if the text needs to be shaped properly
+static unsigned int count_simple_glyphs(std::string_view sv) {
+    unsigned int count = 0;
+
+    while (!sv.empty()) {
+        unsigned int glyph;
+        int advance;
+
+        auto len = simple_glyph(sv, glyph, advance);
+
+        if (len == 0)
+            return 0;
+
+        sv = sv.substr(len);
+        count++;
+    }
+
+    return count;
+}
+
+static shaped_glyph* grow_scratch(unsigned int count) {
+    if (count <= scratch_size)
+        return scratch_glyphs;
+
+    if (scratch_glyphs)
+        ft_free(nullptr, scratch_glyphs);
+
+    scratch_glyphs = (shaped_glyph*)ft_alloc(nullptr, count * sizeof(shaped_glyph));
+
+    if (!scratch_glyphs) {
+        scratch_size = 0;
+        return nullptr;
+    }
+
+    scratch_size = count;
+
+    return scratch_glyphs;
+}
+
+static uint32_t hash_text(std::string_view sv) {
+    uint32_t hash = 0x811c9dc5; // FNV-1a
+
+    for (auto c : sv) {
+        hash ^= (uint8_t)c;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static void flush_shaped_runs() {
+    for (unsigned int i = 0; i < SHAPED_RUN_CACHE_SIZE; i++) {
+        if (shaped_runs[i].glyphs) {
+            ft_free(nullptr, shaped_runs[i].glyphs);
+            shaped_runs[i].glyphs = nullptr;
+        }
+    }
+
+    ascii_glyphs_valid = false;
+}
+
+/* Returns the glyphs for a single line of text, with clusters relative to the
+ * start of sv. The result is only valid until the next call. */
+static const shaped_glyph* shape_text(std::string_view sv, unsigned int& count) {
     unsigned int glyph_count;
-    size_t start = 0;
+    shaped_run* run = nullptr;
+    shaped_glyph* glyphs;
+
+    count = 0;
+
+    if (sv.empty())
+        return nullptr;
+
+    if (!ascii_glyphs_valid)
+        init_ascii_glyphs();
+
+    /* Most of what we print is plain ASCII, which in a Latin font is just one glyph
+     * after another - we lose kerning by not going through HarfBuzz, but that doesn't
+     * matter for a console. */
+    if (auto simple_count = count_simple_glyphs(sv); simple_count != 0) {
+        size_t pos = 0;
+
+        glyphs = grow_scratch(simple_count);
+        if (!glyphs)
+            return nullptr;
+
+        for (unsigned int i = 0; i < simple_count; i++) {
+            unsigned int glyph;
+            int advance;
+
+            auto len = simple_glyph(sv.substr(pos), glyph, advance);
+
+            glyphs[i].glyph = glyph;
+            glyphs[i].cluster = pos;
+            glyphs[i].x_advance = advance;
+            glyphs[i].y_advance = 0;
+            glyphs[i].x_offset = 0;
+            glyphs[i].y_offset = 0;
+
+            pos += len;
+        }
+
+        count = simple_count;
+
+        return glyphs;
+    }
+
+    auto hash = hash_text(sv);
 
-    fg_r = fg_colour >> 16;
-    fg_g = (fg_colour >> 8) & 0xff;
-    fg_b = fg_colour & 0xff;
+    for (unsigned int i = 0; i < SHAPED_RUN_CACHE_SIZE; i++) {
+        auto& r = shaped_runs[i];
+
+        if (r.glyphs && r.hash == hash && r.length == sv.size() &&
+            !memcmp(&r.glyphs[r.count], sv.data(), sv.size())) {
+            r.last_used = ++shaped_run_clock;
+            count = r.count;
+            return r.glyphs;
+        }
+    }
+
+    if (!start_freetype())
+        return nullptr;
+
+    hb_buf buf{hb_buffer_create()};
+    hb_buffer_add_utf8(buf.get(), sv.data(), sv.size(), 0, sv.size());
+
+    hb_buffer_set_direction(buf.get(), HB_DIRECTION_LTR);
+    hb_buffer_set_script(buf.get(), HB_SCRIPT_LATIN);
+    hb_buffer_set_language(buf.get(), hb_language_from_string("en", -1));
+
+    hb_shape(hb_font, buf.get(), nullptr, 0);
+
+    auto glyph_info = hb_buffer_get_glyph_infos(buf.get(), &glyph_count);
+    auto glyph_pos = hb_buffer_get_glyph_positions(buf.get(), &glyph_count);
+
+    // replace the least recently used entry
+
+    for (unsigned int i = 0; i < SHAPED_RUN_CACHE_SIZE; i++) {
+        if (!shaped_runs[i].glyphs) {
+            run = &shaped_runs[i];
+            break;
+        }
+
+        if (!run || shaped_runs[i].last_used < run->last_used)
+            run = &shaped_runs[i];
+    }
+
+    if (run->glyphs) {
+        ft_free(nullptr, run->glyphs);
+        run->glyphs = nullptr;
+    }
+
+    // we keep a copy of the text after the glyphs, to check hits against
+    glyphs = (shaped_glyph*)ft_alloc(nullptr, (glyph_count * sizeof(shaped_glyph)) + sv.size());
+
+    if (glyphs) {
+        run->glyphs = glyphs;
+        run->hash = hash;
+        run->length = sv.size();
+        run->count = glyph_count;
+        run->last_used = ++shaped_run_clock;
+
+        memcpy(&glyphs[glyph_count], sv.data(), sv.size());
+    } else { // pool full, so don't cache it
+        glyphs = grow_scratch(glyph_count);
+        if (!glyphs)
+            return nullptr;
+    }
+
+    for (unsigned int i = 0; i < glyph_count; i++) {
+        glyphs[i].glyph = glyph_info[i].codepoint;
+        glyphs[i].cluster = glyph_info[i].cluster;
+        glyphs[i].x_advance = glyph_pos[i].x_advance;
+        glyphs[i].y_advance = glyph_pos[i].y_advance;
+        glyphs[i].x_offset = glyph_pos[i].x_offset;
+        glyphs[i].y_offset = glyph_pos[i].y_offset;
+    }
+
+    count = glyph_count;
+
+    return glyphs;
+}
+
+void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t fg_colour) {
+    unsigned int glyph_count;
+    size_t start = 0;
 
     while (start < sv.size()) {
         size_t end;
@@ -102,74 +762,53 @@ void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t
         else
             end = sv.size();
 
-        hb_buf buf{hb_buffer_create()};
-        hb_buffer_add_utf8(buf.get(), (char*)sv.data(), sv.size(),
-                           start, end - start);
-
-        hb_buffer_set_direction(buf.get(), HB_DIRECTION_LTR);
-        hb_buffer_set_script(buf.get(), HB_SCRIPT_LATIN);
-        hb_buffer_set_language(buf.get(), hb_language_from_string("en", -1));
-
-        hb_shape(hb_font, buf.get(), nullptr, 0);
-
-        auto glyph_info = hb_buffer_get_glyph_infos(buf.get(), &glyph_count);
-        auto glyph_pos = hb_buffer_get_glyph_positions(buf.get(), &glyph_count);
+        auto glyphs = shape_text(sv.substr(start, end - start), glyph_count);
 
         width = 0;
         for (unsigned int i = 0; i < glyph_count; i++) {
-            width += glyph_pos[i].x_advance;
+            width += glyphs[i].x_advance;
         }
         width /= 64;
 
         // add synthetic newline if would overflow
         if (p.x + width > gop_info.HorizontalResolution) {
-            bool handled = false;
-            auto e = end;
+            unsigned int brk = 0, word_width;
 
+            /* Look for the last space we can break at. As the advances only ever add up,
+             * a single running total is enough to measure every candidate - we don't
+             * need to shape the line again. */
             auto find_break = [&]() {
-                while (true) {
-                    auto space = std::string_view(sv.data() + start, e - start).rfind(" ");
-
-                    if (space == std::string_view::npos)
-                        break;
+                int w = 0;
+                bool found = false, seen_space = false;
 
-                    buf.reset(hb_buffer_create());
+                word_width = width;
 
-                    hb_buffer_add_utf8(buf.get(), (char*)sv.data(), sv.size(),
-                                    start, space);
+                for (unsigned int i = 0; i < glyph_count; i++) {
+                    auto c = glyphs[i].cluster;
 
-                    hb_buffer_set_direction(buf.get(), HB_DIRECTION_LTR);
-                    hb_buffer_set_script(buf.get(), HB_SCRIPT_LATIN);
-                    hb_buffer_set_language(buf.get(), hb_language_from_string("en", -1));
-
-                    hb_shape(hb_font, buf.get(), nullptr, 0);
-
-                    glyph_info = hb_buffer_get_glyph_infos(buf.get(), &glyph_count);
-                    glyph_pos = hb_buffer_get_glyph_positions(buf.get(), &glyph_count);
+                    if (sv[start + c] == ' ' && (i == 0 || glyphs[i - 1].cluster != c)) {
+                        if (!seen_space) {
+                            word_width = w / 64;
+                            seen_space = true;
+                        }
 
-                    width = 0;
-                    for (unsigned int i = 0; i < glyph_count; i++) {
-                        width += glyph_pos[i].x_advance;
-                    }
-                    width /= 64;
+                        if (p.x + (w / 64) > gop_info.HorizontalResolution)
+                            break;
 
-                    if (p.x + width <= gop_info.HorizontalResolution) {
-                        end = start + space;
-                        handled = true;
-                        break;
+                        brk = i;
+                        found = true;
                     }
 
-                    e = start + space - 1;
+                    w += glyphs[i].x_advance;
                 }
-            };
 
-            find_break();
+                return found;
+            };
 
-            if (handled)
-                add_newline = true;
+            bool handled = find_break();
 
             // if not handled but could fit at least one word on new line, add new line straightaway
-            if (p.x != 0 && !handled && width <= gop_info.HorizontalResolution) {
+            if (p.x != 0 && !handled && word_width <= gop_info.HorizontalResolution) {
                 p.x = 0;
                 p.y += font_height;
 
@@ -178,8 +817,13 @@ void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t
                     p.y -= font_height;
                 }
 
-                e = end;
-                find_break();
+                handled = find_break();
+            }
+
+            if (handled) {
+                end = start + glyphs[brk].cluster;
+                glyph_count = brk;
+                add_newline = true;
             }
         }
 
@@ -188,17 +832,17 @@ void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t
         auto bg_x = (int)p.x;
         auto bg_y = (int)p.y;
         for (unsigned int i = 0; i < glyph_count; i++) {
-            error = FT_Load_Glyph(face, glyph_info[i].codepoint, FT_RENDER_MODE_NORMAL);
-            if (error) {
-                bg_x += glyph_pos[i].x_advance / 64;
-                bg_y += glyph_pos[i].y_advance / 64;
+            auto g = get_glyph(glyphs[i].glyph);
+            if (!g || g->pixel_mode == FT_PIXEL_MODE_NONE) {
+                bg_x += glyphs[i].x_advance / 64;
+                bg_y += glyphs[i].y_advance / 64;
                 continue;
             }
 
-            int rect_left = bg_x + face->glyph->bitmap_left + (glyph_pos[i].x_offset / 64);
-            int rect_top = bg_y - face->glyph->bitmap_top - (glyph_pos[i].y_offset / 64);
-            int rect_right = rect_left + face->glyph->bitmap.width;
-            int rect_bottom = rect_top + face->glyph->bitmap.rows;
+            int rect_left = bg_x + g->left + (glyphs[i].x_offset / 64);
+            int rect_top = bg_y - g->top - (glyphs[i].y_offset / 64);
+            int rect_right = rect_left + g->width;
+            int rect_bottom = rect_top + g->rows;
 
             if (rect_left < 0)
                 rect_left = 0;
@@ -212,65 +856,43 @@ void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t
             if (rect_bottom > (int)gop_info.VerticalResolution)
                 rect_bottom = gop_info.VerticalResolution;
 
-            auto base = (uint32_t*)framebuffer + (rect_top * gop_info.PixelsPerScanLine) + rect_left;
-            auto shadow_base = (uint32_t*)(((uint8_t*)base - (uint8_t*)framebuffer) + (uint8_t*)shadow_fb);
-
-            for (int i = 0; i < rect_bottom - rect_top; i++) {
-                for (int j = 0; j < rect_right - rect_left; j++) {
-                    base[j] = shadow_base[j] = bg_colour;
-                }
-
-                base += gop_info.PixelsPerScanLine;
-                shadow_base += gop_info.PixelsPerScanLine;
-            }
+            if (rect_right > rect_left && rect_bottom > rect_top)
+                fill_rect(rect_left, rect_top, rect_right - rect_left, rect_bottom - rect_top, bg_colour);
 
-            bg_x += glyph_pos[i].x_advance / 64;
-            bg_y += glyph_pos[i].y_advance / 64;
+            bg_x += glyphs[i].x_advance / 64;
+            bg_y += glyphs[i].y_advance / 64;
         }
 
         for (unsigned int i = 0; i < glyph_count; i++) {
             uint32_t skip_x, skip_y;
             int x_off, y_off;
-            unsigned int flags = FT_LOAD_RENDER | FT_RENDER_MODE_NORMAL;
 
-            if (FT_HAS_COLOR(face))
-                flags |= FT_LOAD_COLOR;
-
-            error = FT_Load_Glyph(face, glyph_info[i].codepoint, flags);
-            if (error) {
-                p.x += glyph_pos[i].x_advance / 64;
-                p.y += glyph_pos[i].y_advance / 64;
+            // already in the cache from clearing the background
+            auto g = get_glyph(glyphs[i].glyph);
+            if (!g || g->pixel_mode == FT_PIXEL_MODE_NONE) {
+                p.x += glyphs[i].x_advance / 64;
+                p.y += glyphs[i].y_advance / 64;
                 continue;
             }
 
-            bitmap = &face->glyph->bitmap;
-
-            x_off = face->glyph->bitmap_left + (glyph_pos[i].x_offset / 64);
-            y_off = face->glyph->bitmap_top - (glyph_pos[i].y_offset / 64);
-
-            auto base = (uint32_t*)framebuffer;
+            x_off = g->left + (glyphs[i].x_offset / 64);
+            y_off = g->top - (glyphs[i].y_offset / 64);
 
-            if ((int)p.y > y_off)
-                base += gop_info.PixelsPerScanLine * (p.y - y_off);
-
-            base += (int)p.x + x_off;
-            auto shadow_base = (uint32_t*)(((uint8_t*)base - (uint8_t*)framebuffer) + (uint8_t*)shadow_fb);
-
-            auto width = bitmap->width;
+            auto width = g->width;
             if (p.x + x_off + width > gop_info.HorizontalResolution) {
                 if (p.x + x_off > gop_info.HorizontalResolution) {
-                    p.x += glyph_pos[i].x_advance / 64;
-                    p.y += glyph_pos[i].y_advance / 64;
+                    p.x += glyphs[i].x_advance / 64;
+                    p.y += glyphs[i].y_advance / 64;
                     continue;
                 }
 
                 width = gop_info.HorizontalResolution - p.x - x_off;
             }
 
-            auto render = [&]<typename T>(T* buf) {
+            auto render = [&]<typename T>(const T* buf) {
                 if ((int)p.y < y_off) {
                     skip_y = y_off - p.y;
-                    buf += bitmap->width * skip_y;
+                    buf += g->width * skip_y;
                 } else
                     skip_y = 0;
 
@@ -279,75 +901,46 @@ void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t
                         return;
 
                     skip_x = -(int)p.x - x_off;
-                    base += skip_x;
-                    shadow_base += skip_x;
                 } else
                     skip_x = 0;
 
-                for (unsigned int y = skip_y; y < bitmap->rows; y++) {
+                unsigned int y;
+
+                for (y = skip_y; y < g->rows; y++) {
                     if (p.y - y_off + y >= gop_info.VerticalResolution)
                         break;
 
-                    buf += skip_x;
-
-                    for (unsigned int x = skip_x; x < width; x++) {
-                        if constexpr (std::is_same_v<T, uint32_t>) {
-                            uint8_t alpha = *buf >> 24;
-
-                            if (alpha == 255)
-                                base[x] = shadow_base[x] = *buf & 0xffffff;
-                            else if (alpha != 0) {
-                                uint8_t bg_r = (shadow_base[x] & 0xff0000) >> 16;
-                                uint8_t bg_g = (shadow_base[x] & 0xff00) >> 8;
-                                uint8_t bg_b = shadow_base[x] & 0xff;
-
-                                uint16_t r = (bg_r * (255 - alpha)) + (((*buf & 0xff0000) >> 16) * alpha);
-                                uint16_t g = (bg_g * (255 - alpha)) + (((*buf & 0xff00) >> 8) * alpha);
-                                uint16_t b = (bg_b * (255 - alpha)) + ((*buf & 0xff) * alpha);
-
-                                base[x] = shadow_base[x] = ((r / 255) << 16) | ((g / 255) << 8) | (b / 255);
-                            }
-                        } else {
-                            if (*buf == 255)
-                                base[x] = shadow_base[x] = fg_colour;
-                            else if (*buf != 0) {
-                                uint8_t bg_r = (shadow_base[x] & 0xff0000) >> 16;
-                                uint8_t bg_g = (shadow_base[x] & 0xff00) >> 8;
-                                uint8_t bg_b = shadow_base[x] & 0xff;
-
-                                uint16_t r = (bg_r * (255 - *buf)) + (fg_r * *buf);
-                                uint16_t g = (bg_g * (255 - *buf)) + (fg_g * *buf);
-                                uint16_t b = (bg_b * (255 - *buf)) + (fg_b * *buf);
-
-                                base[x] = shadow_base[x] = ((r / 255) << 16) | ((g / 255) << 8) | (b / 255);
-                            }
-                        }
+                    auto line = shadow_line(p.y - y_off + y) + (int)p.x + x_off;
 
-                        buf++;
+                    if (width > skip_x) {
+                        if constexpr (std::is_same_v<T, uint32_t>)
+                            blend_bgra_span(line + skip_x, buf + skip_x, width - skip_x);
+                        else
+                            blend_gray_span(line + skip_x, buf + skip_x, width - skip_x, fg_colour);
                     }
 
-                    buf += bitmap->width - width;
-
-                    base += gop_info.PixelsPerScanLine;
-                    shadow_base += gop_info.PixelsPerScanLine;
+                    buf += g->width;
                 }
+
+                if (width > skip_x)
+                    mark_dirty((int)p.x + x_off + skip_x, p.y - y_off + skip_y, width - skip_x, y - skip_y);
             };
 
-            switch (bitmap->pixel_mode) {
+            switch (g->pixel_mode) {
                 case FT_PIXEL_MODE_GRAY:
-                    render((uint8_t*)bitmap->buffer);
+                    render((const uint8_t*)g->data);
                     break;
 
                 case FT_PIXEL_MODE_BGRA:
-                    render((uint32_t*)bitmap->buffer);
+                    render((const uint32_t*)g->data);
                     break;
 
                 default:
                     break;
             }
 
-            p.x += glyph_pos[i].x_advance / 64;
-            p.y += glyph_pos[i].y_advance / 64;
+            p.x += glyphs[i].x_advance / 64;
+            p.y += glyphs[i].y_advance / 64;
         }
 
         start = end;
@@ -365,9 +958,12 @@ void draw_text_ft(std::string_view sv, text_pos& p, uint32_t bg_colour, uint32_t
             start++;
         }
     }
+
+    if (update_depth == 0)
+        flush_framebuffer();
 }
 
-EFI_STATUS load_font() {
+static EFI_STATUS init_freetype() {
     FT_Error error;
 
     error = FT_Init_FreeType(&ft);
@@ -418,9 +1014,177 @@ EFI_STATUS load_font() {
     return EFI_SUCCESS;
 }
 
-void init_gop_console() {
+static void free_font_cache() {
+    systable->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)font_cache, page_count(font_cache_size));
+
+    font_cache = nullptr;
+    font_cache_size = 0;
+}
+
+static EFI_STATUS load_font_cache() {
+    EFI_STATUS Status;
+    void* data;
+    size_t size;
+
+    Status = read_esp_file(systable->BootServices, L"quibble-font.bin", &data, &size);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    font_cache = (font_cache_header*)data;
+    font_cache_size = size;
+
+    // make sure it was made from the font we've got, as they can easily get out of step
+
+    if (size < sizeof(font_cache_header) || font_cache->signature != FONT_CACHE_SIGNATURE ||
+        font_cache->version != FONT_CACHE_VERSION || font_cache->font_size != font_size ||
+        font_cache->point_size != font_size_pt ||
+        font_cache->num_strikes > (size - sizeof(font_cache_header)) / sizeof(font_cache_strike) ||
+        font_cache->font_hash != hash_text(std::string_view((const char*)font_data, font_size))) {
+        print_string("Font cache does not match font, ignoring.\n");
+        free_font_cache();
+        return EFI_INVALID_PARAMETER;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// copies the glyphs for this size into the glyph cache, so that we don't need FreeType for them
+static bool use_font_cache(unsigned int ppem) {
+    const font_cache_strike* strike = nullptr;
+    unsigned int ascii_count = 0;
+
+    auto strikes = (const font_cache_strike*)((uint8_t*)font_cache + sizeof(font_cache_header));
+
+    for (unsigned int i = 0; i < font_cache->num_strikes; i++) {
+        if (strikes[i].x_ppem == ppem && strikes[i].y_ppem == ppem) {
+            strike = &strikes[i];
+            break;
+        }
+    }
+
+    if (!strike) {
+#ifdef DEBUG
+        char s[255], *p;
+
+        p = stpcpy(s, "Font cache has nothing at ");
+        p = dec_to_str(p, ppem);
+        p = stpcpy(p, " pixels.\n");
+
+        print_string(s);
+#endif
+
+        return false;
+    }
+
+    if (strike->offset > font_cache_size ||
+        strike->num_glyphs > (font_cache_size - strike->offset) / sizeof(font_cache_glyph)) {
+        return false;
+    }
+
+    glyph_size = ((uint32_t)strike->x_ppem << 16) | strike->y_ppem;
+    num_extra_glyphs = 0;
+
+    auto cg = (const font_cache_glyph*)((uint8_t*)font_cache + strike->offset);
+
+    for (unsigned int i = 0; i < strike->num_glyphs; i++) {
+        size_t bitmap_size = (size_t)cg[i].width * cg[i].rows;
+
+        if (cg[i].offset > font_cache_size || bitmap_size > font_cache_size - cg[i].offset)
+            return false;
+
+        if (cg[i].codepoint >= ' ' && cg[i].codepoint <= '~') {
+            ascii_glyphs[cg[i].codepoint - ' '].glyph = cg[i].glyph;
+            ascii_glyphs[cg[i].codepoint - ' '].advance = cg[i].advance;
+            ascii_count++;
+        } else if (num_extra_glyphs < MAX_EXTRA_GLYPHS) {
+            extra_glyphs[num_extra_glyphs].codepoint = cg[i].codepoint;
+            extra_glyphs[num_extra_glyphs].glyph = cg[i].glyph;
+            extra_glyphs[num_extra_glyphs].advance = cg[i].advance;
+            num_extra_glyphs++;
+        }
+
+        auto g = (cached_glyph*)ft_alloc(nullptr, offsetof(cached_glyph, data) + bitmap_size);
+        if (!g)
+            return false;
+
+        g->index = cg[i].glyph;
+        g->size = glyph_size;
+        g->pixel_mode = FT_PIXEL_MODE_GRAY;
+        g->left = cg[i].left;
+        g->top = cg[i].top;
+        g->width = cg[i].width;
+        g->rows = cg[i].rows;
+
+        memcpy(g->data, (uint8_t*)font_cache + cg[i].offset, bitmap_size);
+
+        auto& bucket = glyph_cache[g->index % GLYPH_CACHE_BUCKETS];
+
+        g->next = bucket;
+        bucket = g;
+    }
+
+    // we don't want to fall back to HarfBuzz for plain ASCII
+    if (ascii_count != ASCII_GLYPHS) {
+        num_extra_glyphs = 0;
+        return false;
+    }
+
+    font_height = strike->height;
+    ascii_glyphs_valid = true;
+
+    return true;
+}
+
+/* Called when we need something that the font cache doesn't have. If we didn't load
+ * the cache, FreeType has already been started by load_font, and we just need to set
+ * the size. */
+static bool start_freetype() {
     FT_Error error;
+
+    if (freetype_ready)
+        return true;
+
+    if (freetype_failed)
+        return false;
+
+    if (!hb_font && EFI_ERROR(init_freetype())) {
+        freetype_failed = true;
+        return false;
+    }
+
+    error = FT_Set_Pixel_Sizes(face, font_size_px, font_size_px);
+    if (error) {
+        char s[255], *p;
+
+        p = stpcpy(s, "FT_Set_Pixel_Sizes failed (");
+        p = dec_to_str(p, error);
+        p = stpcpy(p, ").\n");
+
+        print_string(s);
+
+        freetype_failed = true;
+
+        return false;
+    }
+
+    hb_font_set_scale(hb_font, font_size_px * 64, font_size_px * 64);
+
+    freetype_ready = true;
+
+    return true;
+}
+
+EFI_STATUS load_font() {
+    // if we've got the glyphs already rendered, we can put off starting FreeType until we need it
+    if (!EFI_ERROR(load_font_cache()))
+        return EFI_SUCCESS;
+
+    return init_freetype();
+}
+
+void init_gop_console() {
     unsigned int dpi = 96;
+    bool found = false;
 
     console_width = gop_info.HorizontalResolution / 8;
     console_height = gop_info.VerticalResolution / 8;
@@ -438,41 +1202,100 @@ void init_gop_console() {
         }
     }
 
-    error = FT_Set_Char_Size(face, font_size_pt * 64, 0, dpi, 0);
-    if (error) {
-        char s[255], *p;
+    font_size_px = font_ppem(font_size_pt, dpi);
+    freetype_ready = false;
 
-        p = stpcpy(s, "FT_Set_Char_Size failed (");
-        p = dec_to_str(p, error);
-        p = stpcpy(p, ").\n");
+    // anything we've shaped so far was at the old scale
+    flush_shaped_runs();
 
-        print_string(s);
+    if (font_cache) {
+        found = use_font_cache(font_size_px);
 
-        return;
+        free_font_cache();
+    }
+
+    if (!found) {
+        if (!start_freetype())
+            return;
+
+        font_height = face->size->metrics.height / 64;
+        glyph_size = ((uint32_t)face->size->metrics.x_ppem << 16) | face->size->metrics.y_ppem;
+    }
+
+    dirty_spans = (dirty_span*)ft_alloc(nullptr, gop_info.VerticalResolution * sizeof(dirty_span));
+
+    if (dirty_spans) {
+        for (unsigned int i = 0; i < gop_info.VerticalResolution; i++) {
+            dirty_spans[i].left = gop_info.HorizontalResolution;
+            dirty_spans[i].right = 0;
+        }
     }
 
-    font_height = face->size->metrics.height / 64;
+    dirty_top = gop_info.VerticalResolution;
+    dirty_bottom = 0;
 
     console_pos.x = 0;
     console_pos.y = font_height;
 
     gop_console = true;
+}
 
-    hb_font_set_scale(hb_font, (font_size_pt * dpi * 64) / 72,
-                      (font_size_pt * dpi * 64) / 72);
+/* For when we've drawn the last thing we're going to draw. Everything FreeType and
+ * HarfBuzz allocated goes with the pool, so we don't have to map it for the kernel -
+ * anything printed after this only ends up in the log. */
+void release_font() {
+    flush_console();
+    set_console_mode(CONSOLE_NONE);
+
+    gop_console = false;
+
+    freetype_ready = false;
+    freetype_failed = true;
+
+    ft = NULL;
+    face = NULL;
+    hb_blob = nullptr;
+    hb_face = nullptr;
+    hb_font = nullptr;
+
+    memset(glyph_cache, 0, sizeof(glyph_cache));
+    memset(shaped_runs, 0, sizeof(shaped_runs));
+    scratch_glyphs = nullptr;
+    scratch_size = 0;
+    ascii_glyphs_valid = false;
+    num_extra_glyphs = 0;
+    dirty_spans = nullptr;
+
+    pool_release();
+
+    if (shadow_fb) {
+        systable->BootServices->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)shadow_fb, page_count(framebuffer_size));
+        shadow_fb = nullptr;
+    }
 }
 
 void print_string(std::string_view s) {
-    if (face)
+    log_write(s);
+}
+
+// draws straight to the screen, bypassing the log
+void console_write(std::string_view s) {
+    if (gop_console)
         draw_text_ft(s, console_pos, 0x000000, 0xffffff);
     else {
         wchar_t w[255], *t;
 
-        // FIXME - make sure no overflow
-
         t = w;
 
+        // we can be given a whole log's worth at once, so output it in pieces
+
         for (auto c : s) {
+            if (t >= &w[(sizeof(w) / sizeof(wchar_t)) - 3]) {
+                *t = 0;
+                systable->ConOut->OutputString(systable->ConOut, (CHAR16*)w);
+                t = w;
+            }
+
             if (c == '\n') {
                 *t = '\r';
                 t++;
@@ -497,108 +1320,38 @@ void print_error(const char* func, EFI_STATUS Status) {
     p = stpcpy(p, "\n");
 
     print_string(s);
+
+    // even in quiet mode, show what led up to an error
+    flush_console();
 }
 
 static void* ft_alloc(FT_Memory, long size) {
-    if (size < 0)
+    if (size <= 0)
         return nullptr;
 
-    // round to multiple of 4
-    if (size & 3)
-        size = ((size >> 2) + 1) << 2;
-
-    if (size == 0)
-        return nullptr;
-
-    auto h = (alloc_header*)ft_pool;
-    alloc_header* last = nullptr;
-
-    do {
-        if (h->free) {
-            if (last && last->free) { // merge adjacent free entries
-                last->size += h->size + sizeof(alloc_header);
-                h = last;
-            }
-
-            auto ptr = (uint8_t*)h + sizeof(alloc_header);
-
-            if (h->size == size) {
-                h->free = 0;
-                return ptr;
-            }
-
-            if (h->size > size) {
-                auto& nh = *(alloc_header*)((uint8_t*)h + sizeof(alloc_header) + size);
-
-                if (&nh < (void*)((uintptr_t)ft_pool + (FT_POOL_PAGES << EFI_PAGE_SHIFT))) {
-                    nh.free = 1;
-                    nh.size = h->size - size - sizeof(alloc_header);
-                }
-
-                h->free = 0;
-                h->size = size;
-
-                return ptr;
-            }
-        }
-
-        last = h;
-        h = (alloc_header*)((uint8_t*)h + sizeof(alloc_header) + h->size);
-    } while (h < (void*)((uintptr_t)ft_pool + (FT_POOL_PAGES << EFI_PAGE_SHIFT)));
-
-    return nullptr;
+    return pool_alloc(size);
 }
 
 static void ft_free(FT_Memory, void* block) {
-    if (!block)
-        return;
-
-    auto& ah = *(alloc_header*)((uint8_t*)block - sizeof(alloc_header));
-
-    ah.free = 1;
+    pool_free(block);
 }
 
-static void* ft_realloc(FT_Memory memory, long cur_size, long new_size, void* block) {
-    void* ret;
-
-    // FIXME - do actual realloc if possible
-
-    if (new_size < cur_size)
-        return block;
-
-    ret = ft_alloc(memory, new_size);
-    if (!ret)
+static void* ft_realloc(FT_Memory, long, long new_size, void* block) {
+    if (new_size <= 0)
         return nullptr;
 
-    memcpy(ret, block, new_size < cur_size ? new_size : cur_size);
-
-    ft_free(memory, block);
-
-    return ret;
+    return pool_realloc(block, new_size);
 }
 
 extern "C"
 FT_Memory FT_New_Memory() {
-    EFI_STATUS Status;
-    EFI_PHYSICAL_ADDRESS addr;
-
     /* We use our own allocation functions here, rather than relying on
      * AllocatePool, so that we can carry on using FreeType after exiting
      * boot services. */
 
-    Status = systable->BootServices->AllocatePages(AllocateAnyPages, EfiLoaderData, FT_POOL_PAGES, &addr);
-    if (EFI_ERROR(Status))
+    if (!pool_init())
         return nullptr;
 
-    ft_pool = (uint8_t*)addr;
-
-    memset(ft_pool, 0, FT_POOL_PAGES << EFI_PAGE_SHIFT);
-
-    auto& h = *(alloc_header*)ft_pool;
-
-    h.size = (FT_POOL_PAGES << EFI_PAGE_SHIFT) - sizeof(alloc_header);
-    h.free = 1;
-
     ftmem.user = nullptr;
     ftmem.alloc = ft_alloc;
     ftmem.realloc = ft_realloc;
@@ -689,25 +1442,7 @@ void* hb_calloc_impl2(size_t nmemb, size_t size) {
 
 extern "C"
 void* hb_realloc_impl2(void* ptr, size_t new_size) {
-    if (!ptr)
-        return hb_malloc_impl2(new_size);
-
-    auto& ah = *(alloc_header*)((uint8_t*)ptr - sizeof(alloc_header));
-
-    // FIXME - do actual realloc if possible
-
-    if (new_size < ah.size)
-        return ptr;
-
-    auto ret = ft_alloc(0, new_size);
-    if (!ret)
-        return nullptr;
-
-    memcpy(ret, ptr, new_size < ah.size ? new_size : ah.size);
-
-    ft_free(0, ptr);
-
-    return ret;
+    return pool_realloc(ptr, new_size);
 }
 
 extern "C"
@@ -7,12 +7,35 @@ typedef struct {
     unsigned int y;
 } text_pos;
 
+enum {
+    CONSOLE_IMMEDIATE,
+    CONSOLE_DEFERRED,
+    CONSOLE_QUIET,
+    CONSOLE_NONE
+};
+
 EFI_STATUS info_register(EFI_BOOT_SERVICES* bs);
 
 void print_error(const char* func, EFI_STATUS Status);
 void print_string(std::string_view s);
+void console_write(std::string_view s);
 void draw_text_ft(std::string_view s, text_pos& p, uint32_t bg_colour, uint32_t fg_colour);
 void init_gop_console();
+void fill_rect(unsigned int x, unsigned int y, unsigned int w, unsigned int h, uint32_t colour);
+void clear_screen();
+void flush_framebuffer();
+void begin_update();
+void end_update();
 EFI_STATUS load_font();
+void release_font();
+
+// log.cpp
+void log_write(std::string_view s);
+void flush_console();
+void console_checkpoint();
+void set_console_mode(unsigned int mode);
+EFI_STATUS save_boot_log(EFI_BOOT_SERVICES* bs);
+EFI_STATUS allocate_log_block(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** pa);
+void export_boot_log();
 
 extern bool gop_console;
@@ -93,6 +93,16 @@ typedef struct {
 
 typedef struct _command_line command_line;
 
+#define MAX_BOOT_PHASES 128
+#define MAX_IMAGE_PHASES 512
+
+typedef struct {
+    char name[40];
+    uint64_t start;
+    uint64_t end;
+    unsigned int depth;
+} boot_phase;
+
 // boot.c
 extern void* stack;
 extern EFI_HANDLE image_handle;
@@ -104,41 +114,102 @@ EFI_STATUS add_image(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, const wchar_t* n
                      bool no_reloc);
 EFI_STATUS load_image(image* img, const wchar_t* name, EFI_PE_LOADER_PROTOCOL* pe, void* va, EFI_FILE_HANDLE dir,
                       command_line* cmdline, uint16_t build);
+EFI_STATUS commit_image_va(EFI_BOOT_SERVICES* bs, image* img, unsigned int region);
 EFI_STATUS open_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* h, const wchar_t* name);
 EFI_STATUS read_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const wchar_t* name, void** data, size_t* size);
 EFI_STATUS open_parent_dir(EFI_FILE_IO_INTERFACE* fs, EFI_DEVICE_PATH* dp, EFI_FILE_HANDLE* dir);
+EFI_STATUS write_esp_file(EFI_BOOT_SERVICES* bs, const wchar_t* name, const void* data, size_t size);
+EFI_STATUS read_esp_file(EFI_BOOT_SERVICES* bs, const wchar_t* name, void** data, size_t* size);
+EFI_STATUS rotate_esp_files(EFI_BOOT_SERVICES* bs, const wchar_t* const* names, unsigned int count);
 
 // mem.c
-#ifdef _X86_
-extern bool pae;
-#endif
+extern bool large_pages;
+extern bool dump_mdl;
 extern EFI_MEMORY_DESCRIPTOR* efi_runtime_map;
 extern UINTN efi_runtime_map_size, map_desc_size;
 
+EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings,
+                         LIST_ENTRY& mdl_head, uintptr_t* loader_pages_spanned);
+EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings);
+EFI_STATUS map_efi_runtime(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uint16_t version);
+void print_memory_stats(LIST_ENTRY* mappings);
+
+// mapping.cpp
 void* find_virtual_address(void* pa, LIST_ENTRY* mappings);
 void* fix_address_mapping(void* addr, void* pa, void* va);
 EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, void* pa, unsigned int pages,
                        TYPE_OF_MEMORY type);
-EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings,
-                         LIST_ENTRY& mdl_head, void* va, uintptr_t* loader_pages_spanned);
-EFI_STATUS process_memory_map(EFI_BOOT_SERVICES* bs, void** va, LIST_ENTRY* mappings);
-EFI_STATUS map_efi_runtime(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void*& va, uint16_t version);
 void merge_mappings(LIST_ENTRY* mappings);
+bool verify_mappings(LIST_ENTRY* mappings);
+void index_reset(LIST_ENTRY* mappings);
+
+// pagetable.cpp
+#ifdef _X86_
+extern bool pae;
+#endif
 
 // hw.c
 extern LIST_ENTRY block_devices;
-EFI_STATUS find_hardware(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA*& loader_block, void** va,
+EFI_STATUS find_hardware(EFI_BOOT_SERVICES* bs, CONFIGURATION_COMPONENT_DATA*& loader_block,
                          LIST_ENTRY* mappings, EFI_HANDLE image_handle, uint16_t version);
-EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, void** va, LIST_ENTRY* mappings,
+EFI_STATUS find_disks(EFI_BOOT_SERVICES* bs, LIST_ENTRY* disk_sig_list, LIST_ENTRY* mappings,
                       CONFIGURATION_COMPONENT_DATA* system_key, bool new_disk_format);
 EFI_STATUS look_for_block_devices(EFI_BOOT_SERVICES* bs);
 EFI_STATUS kdnet_init(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* file, DEBUG_DEVICE_DESCRIPTOR* ddd);
 
+// arena.cpp
+EFI_STATUS arena_alloc(EFI_BOOT_SERVICES* bs, size_t size, void** ptr);
+EFI_STATUS arena_strdup(EFI_BOOT_SERVICES* bs, const wchar_t* s, wchar_t** ret);
+
+// slab.cpp
+EFI_STATUS slab_alloc(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, size_t size, void** ptr);
+
+// pool.cpp
+bool pool_init();
+void* pool_alloc(size_t size);
+void pool_free(void* ptr);
+void* pool_realloc(void* ptr, size_t size);
+void pool_freeze();
+void pool_release();
+bool pool_get_chunk(unsigned int i, void** base, size_t* pages);
+void print_pool_stats();
+
+// timing.cpp
+extern uint64_t boot_start_tsc;
+void timing_init();
+unsigned int phase_begin(const char* name);
+void phase_end(unsigned int id);
+unsigned int image_phase_begin(const char* name);
+void image_phase_end(unsigned int id);
+void print_phase_timings();
+EFI_STATUS save_phase_timings(EFI_BOOT_SERVICES* bs);
+EFI_STATUS allocate_timing_block(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** pa);
+void export_phase_timings();
+
+// vaspace.cpp
+enum {
+    VA_REGION_LOADER,
+    VA_REGION_SYSTEM,
+    VA_REGION_MAX
+};
+
+EFI_STATUS va_reserve_identity(EFI_BOOT_SERVICES* bs, void* pa, size_t pages);
+EFI_STATUS va_alloc(EFI_BOOT_SERVICES* bs, unsigned int region, const char* name, void* pa, size_t pages,
+                    size_t alignment, void** va);
+EFI_STATUS va_map(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, unsigned int region, const char* name, void* pa,
+                  size_t pages, TYPE_OF_MEMORY type, void** va);
+EFI_STATUS va_commit(EFI_BOOT_SERVICES* bs, unsigned int region, const char* name, void* va, size_t pages);
+void va_align(unsigned int region, size_t alignment);
+void* va_place(void* va, size_t pages);
+void* va_next(unsigned int region);
+void* va_translate(void* pa);
+void print_va_plan();
+
 // apiset.c
 extern void* apisetva;
 extern unsigned int apisetsize;
 EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER_PROTOCOL* pe, EFI_FILE_HANDLE dir,
-                        void** va, uint16_t version, LIST_ENTRY* mappings, command_line* cmdline);
+                        uint16_t version, LIST_ENTRY* mappings, command_line* cmdline);
 bool search_api_set(wchar_t* dll, wchar_t* newname, uint16_t version);
 
 // menu.c
@@ -150,11 +221,6 @@ EFI_STATUS find_kd_export(EFI_PE_IMAGE* kdstub, uint16_t build);
 EFI_STATUS kdstub_init(DEBUG_DEVICE_DESCRIPTOR* ddd, uint16_t build);
 EFI_STATUS allocate_kdnet_hw_context(EFI_PE_IMAGE* kdstub, DEBUG_DEVICE_DESCRIPTOR* ddd, uint16_t build);
 
-// print.cpp
-extern uint8_t* ft_pool;
-
-static constexpr size_t FT_POOL_PAGES = 16777216 >> EFI_PAGE_SHIFT; // 16 MB
-
 // CSM (not in gnu-efi)
 
 #define EFI_LEGACY_BIOS_PROTOCOL_GUID { 0xdb9a1e3d, 0x45cb, 0x4abb, {0x85, 0x3b, 0xe5, 0x38, 0x7f, 0xdb, 0x2e, 0x2d } }
@@ -35,6 +35,7 @@ static EFI_REGISTRY_PROTOCOL proto;
 static EFI_BOOT_SERVICES* bs;
 
 static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive);
+static EFI_STATUS EFIAPI OpenHiveFromBuffer(void* Data, UINTN Size, EFI_REGISTRY_HIVE** Hive);
 
 using namespace std;
 
@@ -42,6 +43,7 @@ EFI_STATUS reg_register(EFI_BOOT_SERVICES* BootServices) {
     EFI_GUID reg_guid = WINDOWS_REGISTRY_PROTOCOL;
 
     proto.OpenHive = OpenHive;
+    proto.OpenHiveFromBuffer = OpenHiveFromBuffer;
 
     bs = BootServices;
 
@@ -804,6 +806,34 @@ static bool validate_bins(span<const uint8_t> data) {
     return true;
 }
 
+static EFI_STATUS init_hive(hive* h, EFI_REGISTRY_HIVE** Hive) {
+    if (!check_header(h)) {
+        print_string("Header check failed.\n");
+        return EFI_INVALID_PARAMETER;
+    }
+
+    const auto& base_block = *(HBASE_BLOCK*)h->data;
+
+    // do sanity-checking of hive, to avoid a bug check 74 later on
+    if (!validate_bins(span((uint8_t*)h->data, 0x1000 + base_block.Length)))
+        return EFI_INVALID_PARAMETER;
+
+    clear_volatile(h, 0x1000 + base_block.RootCell);
+
+    h->pub.Close = close_hive;
+    h->pub.FindRoot = find_root;
+    h->pub.EnumKeys = enum_keys;
+    h->pub.FindKey = find_key;
+    h->pub.EnumValues = enum_values;
+    h->pub.QueryValue = query_value;
+    h->pub.StealData = steal_data;
+    h->pub.QueryValueNoCopy = query_value_no_copy;
+
+    *Hive = &h->pub;
+
+    return EFI_SUCCESS;
+}
+
 static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive) {
     EFI_STATUS Status;
     EFI_FILE_INFO file_info;
@@ -876,34 +906,42 @@ static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive
         }
     }
 
-    if (!check_header(h)) {
-        print_string("Header check failed.\n");
+    Status = init_hive(h, Hive);
+    if (EFI_ERROR(Status)) {
         bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)h->data, h->pages);
         bs->FreePool(h);
-        return EFI_INVALID_PARAMETER;
+        return Status;
     }
 
-    const auto& base_block = *(HBASE_BLOCK*)h->data;
+    return EFI_SUCCESS;
+}
 
-    // do sanity-checking of hive, to avoid a bug check 74 later on
-    if (!validate_bins(span((uint8_t*)h->data, 0x1000 + base_block.Length))) {
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)h->data, h->pages);
-        bs->FreePool(h);
+static EFI_STATUS EFIAPI OpenHiveFromBuffer(void* Data, UINTN Size, EFI_REGISTRY_HIVE** Hive) {
+    EFI_STATUS Status;
+    hive* h;
+
+    if (Size == 0)
         return EFI_INVALID_PARAMETER;
+
+    Status = bs->AllocatePool(EfiLoaderData, sizeof(hive), (void**)&h);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
     }
 
-    clear_volatile(h, 0x1000 + base_block.RootCell);
+    h->size = Size;
+    h->pages = Size / EFI_PAGE_SIZE;
+    if (h->size % EFI_PAGE_SIZE != 0)
+        h->pages++;
 
-    h->pub.Close = close_hive;
-    h->pub.FindRoot = find_root;
-    h->pub.EnumKeys = enum_keys;
-    h->pub.FindKey = find_key;
-    h->pub.EnumValues = enum_values;
-    h->pub.QueryValue = query_value;
-    h->pub.StealData = steal_data;
-    h->pub.QueryValueNoCopy = query_value_no_copy;
+    h->data = Data;
 
-    *Hive = &h->pub;
+    // on failure the buffer still belongs to the caller
+    Status = init_hive(h, Hive);
+    if (EFI_ERROR(Status)) {
+        bs->FreePool(h);
+        return Status;
+    }
 
     return EFI_SUCCESS;
 }
@@ -50,8 +50,17 @@ typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_OPEN_HIVE) (
     OUT EFI_REGISTRY_HIVE** Hive
 );
 
+// Data must have been allocated with AllocatePages. If this succeeds, it is freed when the hive is
+// closed; if it fails, the caller still owns it.
+typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_OPEN_HIVE_FROM_BUFFER) (
+    IN void* Data,
+    IN UINTN Size,
+    OUT EFI_REGISTRY_HIVE** Hive
+);
+
 typedef struct {
     EFI_REGISTRY_OPEN_HIVE OpenHive;
+    EFI_REGISTRY_OPEN_HIVE_FROM_BUFFER OpenHiveFromBuffer;
 } EFI_REGISTRY_PROTOCOL;
 
 typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_HIVE_CLOSE) (
@@ -0,0 +1,127 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "x86.h"
+
+/* Slab for small pieces of loader-block data, such as configuration components and
+ * the disk signature list. Rather than each getting its own pages and its own mapping,
+ * we pack them into a few shared LoaderSystemBlock slabs, each of which is mapped in
+ * one go. Nothing in here needs fixing up beyond the usual find_virtual_address, as
+ * each slab is contiguous in both physical and virtual memory. */
+
+static const unsigned int SLAB_PAGES = 4;
+static const size_t SLAB_ALIGNMENT = 16;
+static const unsigned int MAX_OPEN_SLABS = 4;
+
+typedef struct {
+    uint8_t* ptr;
+    size_t left;
+} slab;
+
+static slab slabs[MAX_OPEN_SLABS];
+static unsigned int num_slabs = 0;
+
+static EFI_STATUS slab_map(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, size_t pages, uint8_t** ptr) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+    void* va;
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return Status;
+    }
+
+    memset((void*)(uintptr_t)addr, 0, pages * EFI_PAGE_SIZE);
+
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "loader block slab", (void*)(uintptr_t)addr, pages,
+                    LoaderSystemBlock, &va);
+    if (EFI_ERROR(Status)) {
+        print_error("va_map", Status);
+        bs->FreePages(addr, pages);
+        return Status;
+    }
+
+    *ptr = (uint8_t*)(uintptr_t)addr;
+
+    return EFI_SUCCESS;
+}
+
+// returns the physical address of a zeroed block of size bytes, which will be visible to the kernel
+EFI_STATUS slab_alloc(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, size_t size, void** ptr) {
+    EFI_STATUS Status;
+    unsigned int victim;
+    uint8_t* p;
+
+    if (size == 0)
+        size = 1;
+
+    size = (size + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+
+    // first fit among the slabs which still have room
+
+    for (unsigned int i = 0; i < num_slabs; i++) {
+        if (slabs[i].left >= size) {
+            *ptr = slabs[i].ptr;
+
+            slabs[i].ptr += size;
+            slabs[i].left -= size;
+
+            return EFI_SUCCESS;
+        }
+    }
+
+    // anything too big to share gets its own pages
+    if (size > (SLAB_PAGES * EFI_PAGE_SIZE) / 2) {
+        Status = slab_map(bs, mappings, page_count(size), &p);
+        if (EFI_ERROR(Status))
+            return Status;
+
+        *ptr = p;
+
+        return EFI_SUCCESS;
+    }
+
+    Status = slab_map(bs, mappings, SLAB_PAGES, &p);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    // if we've run out of slots, retire whichever slab is fullest
+
+    if (num_slabs < MAX_OPEN_SLABS) {
+        victim = num_slabs;
+        num_slabs++;
+    } else {
+        victim = 0;
+
+        for (unsigned int i = 1; i < num_slabs; i++) {
+            if (slabs[i].left < slabs[victim].left)
+                victim = i;
+        }
+    }
+
+    slabs[victim].ptr = p + size;
+    slabs[victim].left = (SLAB_PAGES * EFI_PAGE_SIZE) - size;
+
+    *ptr = p;
+
+    return EFI_SUCCESS;
+}
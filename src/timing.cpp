@@ -0,0 +1,291 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include <intrin.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "x86.h"
+
+#define TIMING_BLOCK_SIGNATURE 0x4d495451 // "QTIM"
+
+/* Layout of the region we hand to the OS if EXPORTTIMINGS is given. Its physical
+ * address is appended to the load options as QUIBBLETIMINGS=, which Windows
+ * puts in the SystemStartOptions registry value. */
+typedef struct {
+    uint32_t signature;
+    uint32_t version;
+    uint64_t frequency;
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    uint32_t num_phases;
+    uint32_t phase_size;
+    boot_phase phases[MAX_BOOT_PHASES + MAX_IMAGE_PHASES];
+} timing_block;
+
+/* Loading each image gets its own ring, as there can easily be a couple of hundred
+ * boot drivers, which would otherwise push out the top-level phases. */
+static boot_phase phases[MAX_BOOT_PHASES];
+static boot_phase image_phases[MAX_IMAGE_PHASES];
+static unsigned int next_phase = 0;
+static unsigned int next_image_phase = 0;
+static unsigned int phase_depth = 0;
+static void* timing_block_va = nullptr;
+uint64_t boot_start_tsc = 0;
+
+void timing_init() {
+    boot_start_tsc = __rdtsc();
+}
+
+static void start_phase(boot_phase& ph, const char* name) {
+    size_t len;
+
+    len = strlen(name);
+
+    if (len >= sizeof(ph.name))
+        len = sizeof(ph.name) - 1;
+
+    memcpy(ph.name, name, len);
+    ph.name[len] = 0;
+
+    ph.depth = phase_depth;
+    ph.end = 0;
+    ph.start = __rdtsc();
+}
+
+unsigned int phase_begin(const char* name) {
+    unsigned int id = next_phase;
+
+    /* The start and end of top-level phases are where deferred output gets drawn,
+     * outside of the timings - anything more often and we might as well draw it
+     * straight away. */
+    if (phase_depth == 0)
+        console_checkpoint();
+
+    next_phase++;
+
+    start_phase(phases[id % MAX_BOOT_PHASES], name);
+
+    phase_depth++;
+
+    return id;
+}
+
+void phase_end(unsigned int id) {
+    uint64_t tsc = __rdtsc();
+
+    if (phase_depth > 0)
+        phase_depth--;
+
+    // unless overwritten by a later phase
+    if (id < next_phase && next_phase - id <= MAX_BOOT_PHASES)
+        phases[id % MAX_BOOT_PHASES].end = tsc;
+
+    if (phase_depth == 0)
+        console_checkpoint();
+}
+
+// for loading a single image, which can't have anything nested inside it
+unsigned int image_phase_begin(const char* name) {
+    unsigned int id = next_image_phase;
+
+    next_image_phase++;
+
+    start_phase(image_phases[id % MAX_IMAGE_PHASES], name);
+
+    return id;
+}
+
+void image_phase_end(unsigned int id) {
+    uint64_t tsc = __rdtsc();
+
+    if (id < next_image_phase && next_image_phase - id <= MAX_IMAGE_PHASES)
+        image_phases[id % MAX_IMAGE_PHASES].end = tsc;
+}
+
+static char* ticks_to_str(char* p, uint64_t ticks) {
+    uint64_t us;
+
+    if (cpu_frequency == 0) { // not calibrated yet
+        p = dec_to_str(p, ticks);
+        return stpcpy(p, " ticks");
+    }
+
+    us = (ticks * 1000) / (cpu_frequency / 1000);
+
+    p = dec_to_str(p, us / 1000);
+    *p = '.';
+    p++;
+
+    us %= 1000;
+
+    if (us < 100) {
+        *p = '0';
+        p++;
+    }
+
+    if (us < 10) {
+        *p = '0';
+        p++;
+    }
+
+    p = dec_to_str(p, us);
+
+    return stpcpy(p, " ms");
+}
+
+static char* format_phase(char* p, const boot_phase& ph) {
+    for (unsigned int i = 0; i < ph.depth; i++) {
+        p = stpcpy(p, "  ");
+    }
+
+    p = stpcpy(p, ph.name);
+    p = stpcpy(p, ": start ");
+    p = ticks_to_str(p, ph.start - boot_start_tsc);
+    p = stpcpy(p, ", ");
+
+    if (ph.end == 0)
+        p = stpcpy(p, "unfinished");
+    else {
+        p = stpcpy(p, "took ");
+        p = ticks_to_str(p, ph.end - ph.start);
+    }
+
+    return stpcpy(p, "\n");
+}
+
+static unsigned int first_phase() {
+    return next_phase > MAX_BOOT_PHASES ? next_phase - MAX_BOOT_PHASES : 0;
+}
+
+static unsigned int first_image_phase() {
+    return next_image_phase > MAX_IMAGE_PHASES ? next_image_phase - MAX_IMAGE_PHASES : 0;
+}
+
+static unsigned int count_phases() {
+    return (next_phase - first_phase()) + (next_image_phase - first_image_phase());
+}
+
+// both rings are in the order the phases started, so merge them to get everything in order
+template<typename F>
+static void for_each_phase(F func) {
+    unsigned int i = first_phase(), j = first_image_phase();
+
+    while (i < next_phase || j < next_image_phase) {
+        if (j == next_image_phase ||
+            (i < next_phase && phases[i % MAX_BOOT_PHASES].start <= image_phases[j % MAX_IMAGE_PHASES].start)) {
+            func(phases[i % MAX_BOOT_PHASES]);
+            i++;
+        } else {
+            func(image_phases[j % MAX_IMAGE_PHASES]);
+            j++;
+        }
+    }
+}
+
+void print_phase_timings() {
+    print_string("Boot phase timings:\n");
+
+    for_each_phase([](const boot_phase& ph) {
+        char s[255];
+
+        format_phase(s, ph);
+
+        print_string(s);
+    });
+}
+
+EFI_STATUS save_phase_timings(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+    char* buf;
+    char* p;
+
+    static const size_t line_length = 255;
+
+    Status = bs->AllocatePool(EfiLoaderData, count_phases() * line_length + 1, (void**)&buf);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    p = buf;
+
+    for_each_phase([&](const boot_phase& ph) {
+        p = format_phase(p, ph);
+    });
+
+    Status = write_esp_file(bs, L"quibble-timings.txt", buf, p - buf);
+    if (EFI_ERROR(Status))
+        print_error("write_esp_file", Status);
+
+    bs->FreePool(buf);
+
+    return Status;
+}
+
+EFI_STATUS allocate_timing_block(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void** pa) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    static constexpr size_t pages = page_count(sizeof(timing_block));
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return Status;
+    }
+
+    memset((void*)(uintptr_t)addr, 0, pages * EFI_PAGE_SIZE);
+
+    Status = va_map(bs, mappings, VA_REGION_SYSTEM, "timing block", (void*)(uintptr_t)addr, pages,
+                    LoaderSystemBlock, &timing_block_va);
+    if (EFI_ERROR(Status)) {
+        print_error("va_map", Status);
+        timing_block_va = NULL;
+        bs->FreePages(addr, pages);
+        return Status;
+    }
+
+    *pa = (void*)(uintptr_t)addr;
+
+    return EFI_SUCCESS;
+}
+
+// called once paging has been enabled, just before we hand over to the kernel
+void export_phase_timings() {
+    unsigned int num = 0;
+
+    if (!timing_block_va)
+        return;
+
+    auto& tb = *(timing_block*)timing_block_va;
+
+    tb.signature = TIMING_BLOCK_SIGNATURE;
+    tb.version = 1;
+    tb.frequency = cpu_frequency;
+    tb.start_tsc = boot_start_tsc;
+    tb.num_phases = count_phases();
+    tb.phase_size = sizeof(boot_phase);
+
+    for_each_phase([&](const boot_phase& ph) {
+        tb.phases[num] = ph;
+        num++;
+    });
+
+    tb.end_tsc = __rdtsc();
+}
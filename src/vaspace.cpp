@@ -0,0 +1,357 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+#include "x86.h"
+
+/* Planner for the kernel's virtual address space. Everything we map for the kernel
+ * comes out of one of a small number of named regions, each with fixed limits, so
+ * running out of room is an error rather than something which silently overlaps the
+ * kernel. We also keep out of the way of anything we're going to identity-map, which
+ * on x86 can easily be in the upper half of the address space. */
+
+typedef struct {
+    const char* name;
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t next;
+} va_region;
+
+typedef struct {
+    LIST_ENTRY list_entry;
+    char name[32];
+    unsigned int region;
+    uintptr_t va;
+    uintptr_t pa;
+    size_t pages;
+} va_allocation;
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+} va_hole;
+
+static va_region regions[VA_REGION_MAX] = {
+#ifdef _X86_
+    { "loader", 0x80000000, 0x81800000, 0x80000000 },
+    { "system", 0x81800000, SELFMAP, 0x81800000 },
+#elif defined(__x86_64__)
+    { "loader", 0xfffff80000000000, 0xfffff80800000000, 0xfffff80000000000 },
+    { "system", 0xfffff80800000000, 0xfffff88000000000, 0xfffff80800000000 },
+#endif
+};
+
+// grown from the arena as needed - firmware maps can easily have hundreds of boot services ranges
+static va_hole* holes = NULL;
+static unsigned int num_holes = 0, max_holes = 0;
+static LIST_ENTRY allocations = { &allocations, &allocations };
+
+EFI_STATUS va_reserve_identity(EFI_BOOT_SERVICES* bs, void* pa, size_t pages) {
+    EFI_STATUS Status;
+    uintptr_t start = (uintptr_t)pa;
+    uintptr_t end = start + (pages * EFI_PAGE_SIZE);
+    bool overlaps = false;
+
+    // we only care if it's somewhere we might hand out
+
+    for (unsigned int i = 0; i < VA_REGION_MAX; i++) {
+        if (start < regions[i].end && end > regions[i].start) {
+            overlaps = true;
+            break;
+        }
+    }
+
+    if (!overlaps)
+        return EFI_SUCCESS;
+
+    // anything we've already handed out here would be clobbered
+    for (LIST_ENTRY* le = allocations.Flink; le != &allocations; le = le->Flink) {
+        va_allocation* a = _CR(le, va_allocation, list_entry);
+
+        if (start < a->va + (a->pages * EFI_PAGE_SIZE) && end > a->va) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Identity map at ");
+            p = hex_to_str(p, start);
+            p = stpcpy(p, " overlaps ");
+            p = stpcpy(p, a->name);
+            p = stpcpy(p, ".\n");
+
+            print_string(s);
+
+            return EFI_INVALID_PARAMETER;
+        }
+    }
+
+    // the memory map is sorted, so neighbouring ranges can usually be combined
+    for (unsigned int i = 0; i < num_holes; i++) {
+        if (start <= holes[i].end && end >= holes[i].start) {
+            if (start < holes[i].start)
+                holes[i].start = start;
+
+            if (end > holes[i].end)
+                holes[i].end = end;
+
+            return EFI_SUCCESS;
+        }
+    }
+
+    if (num_holes == max_holes) {
+        unsigned int new_max = max_holes == 0 ? 64 : max_holes * 2;
+        va_hole* new_holes;
+
+        Status = arena_alloc(bs, new_max * sizeof(va_hole), (void**)&new_holes);
+        if (EFI_ERROR(Status)) {
+            print_error("arena_alloc", Status);
+            return Status;
+        }
+
+        if (num_holes > 0)
+            memcpy(new_holes, holes, num_holes * sizeof(va_hole));
+
+        holes = new_holes;
+        max_holes = new_max;
+    }
+
+    holes[num_holes].start = start;
+    holes[num_holes].end = end;
+    num_holes++;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS add_allocation(EFI_BOOT_SERVICES* bs, unsigned int region, const char* name, uintptr_t va,
+                                 void* pa, size_t pages) {
+    EFI_STATUS Status;
+    va_allocation* a;
+    size_t len;
+
+    Status = arena_alloc(bs, sizeof(va_allocation), (void**)&a);
+    if (EFI_ERROR(Status)) {
+        print_error("arena_alloc", Status);
+        return Status;
+    }
+
+    len = strlen(name);
+
+    if (len >= sizeof(a->name))
+        len = sizeof(a->name) - 1;
+
+    memcpy(a->name, name, len);
+    a->name[len] = 0;
+
+    a->region = region;
+    a->va = va;
+    a->pa = (uintptr_t)pa;
+    a->pages = pages;
+
+    InsertTailList(&allocations, &a->list_entry);
+
+    regions[region].next = va + (pages * EFI_PAGE_SIZE);
+
+    return EFI_SUCCESS;
+}
+
+static void out_of_space(unsigned int region, const char* name) {
+    char s[255], *p;
+
+    p = stpcpy(s, "Out of virtual address space in ");
+    p = stpcpy(p, regions[region].name);
+    p = stpcpy(p, " region, allocating ");
+    p = stpcpy(p, name);
+    p = stpcpy(p, ".\n");
+
+    print_string(s);
+}
+
+// returns the first hole which [va, va + pages) runs into, if any
+static va_hole* find_hole(uintptr_t va, size_t pages) {
+    for (unsigned int i = 0; i < num_holes; i++) {
+        if (va < holes[i].end && va + (pages * EFI_PAGE_SIZE) > holes[i].start)
+            return &holes[i];
+    }
+
+    return NULL;
+}
+
+EFI_STATUS va_alloc(EFI_BOOT_SERVICES* bs, unsigned int region, const char* name, void* pa, size_t pages,
+                    size_t alignment, void** va) {
+    auto& r = regions[region];
+    uintptr_t addr = r.next;
+    va_hole* h;
+
+    if (alignment < EFI_PAGE_SIZE)
+        alignment = EFI_PAGE_SIZE;
+
+    do {
+        addr = (addr + alignment - 1) & ~(alignment - 1);
+
+        h = find_hole(addr, pages);
+
+        if (h)
+            addr = h->end;
+    } while (h);
+
+    if (addr < r.next || addr + (pages * EFI_PAGE_SIZE) > r.end) {
+        out_of_space(region, name);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    *va = (void*)addr;
+
+    return add_allocation(bs, region, name, addr, pa, pages);
+}
+
+EFI_STATUS va_map(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, unsigned int region, const char* name, void* pa,
+                  size_t pages, TYPE_OF_MEMORY type, void** va) {
+    EFI_STATUS Status;
+
+    Status = va_alloc(bs, region, name, pa, pages, 0, va);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = add_mapping(bs, mappings, *va, pa, pages, type);
+    if (EFI_ERROR(Status)) {
+        print_error("add_mapping", Status);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// for images, which have to be loaded at an address before we know how big they are
+EFI_STATUS va_commit(EFI_BOOT_SERVICES* bs, unsigned int region, const char* name, void* va, size_t pages) {
+    auto& r = regions[region];
+
+    if ((uintptr_t)va < r.next || (uintptr_t)va + (pages * EFI_PAGE_SIZE) > r.end) {
+        out_of_space(region, name);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if (find_hole((uintptr_t)va, pages)) {
+        char s[255], *p;
+
+        p = stpcpy(s, "Image ");
+        p = stpcpy(p, name);
+        p = stpcpy(p, " overlaps identity-mapped memory.\n");
+
+        print_string(s);
+
+        return EFI_INVALID_PARAMETER;
+    }
+
+    return add_allocation(bs, region, name, (uintptr_t)va, NULL, pages);
+}
+
+void va_align(unsigned int region, size_t alignment) {
+    auto& r = regions[region];
+
+    r.next = (r.next + alignment - 1) & ~(alignment - 1);
+}
+
+// returns the first address at or after va where an image of this size is clear of anything identity-mapped
+void* va_place(void* va, size_t pages) {
+    uintptr_t addr = (uintptr_t)va;
+    va_hole* h;
+
+    while ((h = find_hole(addr, pages))) {
+        addr = h->end;
+    }
+
+    return (void*)addr;
+}
+
+void* va_next(unsigned int region) {
+    uintptr_t addr = regions[region].next;
+    va_hole* h;
+
+    // skip over anything identity-mapped
+    while ((h = find_hole(addr, 1))) {
+        addr = h->end;
+    }
+
+    return (void*)addr;
+}
+
+// later allocations take precedence, in the same way as they do in add_mapping
+void* va_translate(void* pa) {
+    LIST_ENTRY* le = allocations.Blink;
+
+    while (le != &allocations) {
+        va_allocation* a = _CR(le, va_allocation, list_entry);
+
+        if (a->pa != 0 && (uintptr_t)pa >= a->pa && (uintptr_t)pa < a->pa + (a->pages * EFI_PAGE_SIZE))
+            return (uint8_t*)pa - a->pa + a->va;
+
+        le = le->Blink;
+    }
+
+    {
+        char s[255], *p;
+
+        p = stpcpy(s, "Could not find planned virtual address for physical address ");
+        p = hex_to_str(p, (uintptr_t)pa);
+        p = stpcpy(p, ".\n");
+
+        print_string(s);
+    }
+
+    return NULL;
+}
+
+void print_va_plan() {
+    LIST_ENTRY* le;
+
+    print_string("Virtual address space:\n");
+
+    for (unsigned int i = 0; i < VA_REGION_MAX; i++) {
+        char s[255], *p;
+
+        p = stpcpy(s, "  ");
+        p = stpcpy(p, regions[i].name);
+        p = stpcpy(p, ": ");
+        p = hex_to_str(p, regions[i].start);
+        p = stpcpy(p, " to ");
+        p = hex_to_str(p, regions[i].next);
+        p = stpcpy(p, " (limit ");
+        p = hex_to_str(p, regions[i].end);
+        p = stpcpy(p, ")\n");
+
+        print_string(s);
+    }
+
+    le = allocations.Flink;
+    while (le != &allocations) {
+        va_allocation* a = _CR(le, va_allocation, list_entry);
+        char s[255], *p;
+
+        p = stpcpy(s, "    ");
+        p = hex_to_str(p, a->va);
+        p = stpcpy(p, ", ");
+        p = dec_to_str(p, a->pages);
+        p = stpcpy(p, " pages: ");
+        p = stpcpy(p, a->name);
+        p = stpcpy(p, "\n");
+
+        print_string(s);
+
+        le = le->Flink;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "efidef.h"
+#include "efilink.h"
+
+// only the allocator - nothing else is called by the code we build on the host
+
+typedef EFI_STATUS (EFIAPI* EFI_ALLOCATE_PAGES) (
+    IN EFI_ALLOCATE_TYPE Type,
+    IN EFI_MEMORY_TYPE MemoryType,
+    IN UINTN NoPages,
+    OUT EFI_PHYSICAL_ADDRESS* Memory
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_FREE_PAGES) (
+    IN EFI_PHYSICAL_ADDRESS Memory,
+    IN UINTN NoPages
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_ALLOCATE_POOL) (
+    IN EFI_MEMORY_TYPE PoolType,
+    IN UINTN Size,
+    OUT VOID** Buffer
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_FREE_POOL) (
+    IN VOID* Buffer
+);
+
+typedef struct {
+    EFI_ALLOCATE_PAGES AllocatePages;
+    EFI_FREE_PAGES FreePages;
+    EFI_ALLOCATE_POOL AllocatePool;
+    EFI_FREE_POOL FreePool;
+} EFI_BOOT_SERVICES;
+
+typedef struct {
+    EFI_BOOT_SERVICES* BootServices;
+} EFI_SYSTEM_TABLE;
@@ -0,0 +1,35 @@
+/* Just enough of gnu-efi's headers for the host build of the mapping and page table
+ * code - see ../shim.cpp. Only the things that quibble.h, misc.h and the code under
+ * test actually use are here, so expect to add to them if that changes. */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint64_t UINT64;
+typedef int64_t INT64;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint16_t UINT16;
+typedef int16_t INT16;
+typedef uint8_t UINT8;
+typedef int8_t INT8;
+typedef uint64_t UINTN;
+typedef int64_t INTN;
+typedef char CHAR8;
+typedef uint16_t CHAR16;
+typedef uint8_t BOOLEAN;
+#define VOID void
+
+#define IN
+#define OUT
+#define OPTIONAL
+
+#define EFIAPI
+
+#define TRUE ((BOOLEAN)1)
+#define FALSE ((BOOLEAN)0)
+
+// provided by the mingw headers in the real build, and meaningless on amd64 anyway
+#define __stdcall
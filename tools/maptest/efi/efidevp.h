@@ -0,0 +1,6 @@
+#pragma once
+
+#include "efidef.h"
+
+typedef struct _EFI_DEVICE_PATH_PROTOCOL EFI_DEVICE_PATH_PROTOCOL;
+typedef EFI_DEVICE_PATH_PROTOCOL EFI_DEVICE_PATH;
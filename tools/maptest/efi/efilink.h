@@ -0,0 +1,49 @@
+#pragma once
+
+#include "efibind.h"
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY;
+
+#define InitializeListHead(ListHead) \
+    (ListHead)->Flink = ListHead; \
+    (ListHead)->Blink = ListHead;
+
+#define IsListEmpty(ListHead) \
+    ((ListHead)->Flink == (ListHead))
+
+#define _RemoveEntryList(Entry) { \
+    LIST_ENTRY* _Blink, * _Flink; \
+    _Flink = (Entry)->Flink; \
+    _Blink = (Entry)->Blink; \
+    _Blink->Flink = _Flink; \
+    _Flink->Blink = _Blink; \
+}
+
+#define RemoveEntryList(Entry) \
+    _RemoveEntryList(Entry);
+
+#define InsertTailList(ListHead, Entry) { \
+    LIST_ENTRY* _ListHead, * _Blink; \
+    _ListHead = (ListHead); \
+    _Blink = _ListHead->Blink; \
+    (Entry)->Flink = _ListHead; \
+    (Entry)->Blink = _Blink; \
+    _Blink->Flink = (Entry); \
+    _ListHead->Blink = (Entry); \
+}
+
+#define InsertHeadList(ListHead, Entry) { \
+    LIST_ENTRY* _ListHead, * _Flink; \
+    _ListHead = (ListHead); \
+    _Flink = _ListHead->Flink; \
+    (Entry)->Flink = _Flink; \
+    (Entry)->Blink = _ListHead; \
+    _Flink->Blink = (Entry); \
+    _ListHead->Flink = (Entry); \
+}
+
+#define _CR(Record, TYPE, Field) \
+    ((TYPE*)((CHAR8*)(Record) - (CHAR8*)&(((TYPE*)0)->Field)))
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "efidef.h"
+
+typedef struct _EFI_FILE_HANDLE* EFI_FILE_HANDLE;
+typedef struct _EFI_FILE_IO_INTERFACE EFI_FILE_IO_INTERFACE;
@@ -0,0 +1,540 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <algorithm>
+#include "harness.h"
+#include "pagetable.h"
+
+// the same regions as vaspace.cpp, so that the page tables look like the real thing
+static const uintptr_t LOADER_VA_BASE = 0xfffff80000000000;
+static const uintptr_t SYSTEM_VA_BASE = 0xfffff80800000000;
+
+// keeps synthetic maps well clear of SHIM_PAGES_BASE
+static const uint64_t SYNTHETIC_MAP_LIMIT = 0x1000000000; // 64 GB
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} range;
+
+// as in mem.cpp
+static TYPE_OF_MEMORY map_memory_type(UINTN memory_type) {
+    switch (memory_type) {
+        case EfiACPIReclaimMemory:
+        case EfiACPIMemoryNVS:
+        case EfiPalCode:
+            return LoaderSpecialMemory;
+
+        case EfiUnusableMemory:
+            return LoaderBad;
+
+        default:
+            return LoaderFree;
+    }
+}
+
+std::vector<EFI_MEMORY_DESCRIPTOR> synthetic_map(unsigned int count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<EFI_MEMORY_DESCRIPTOR> map;
+    uint64_t addr = 0;
+
+    // roughly the mix of types a fragmented firmware map has
+    static const uint32_t types[] = {
+        EfiConventionalMemory, EfiConventionalMemory, EfiConventionalMemory, EfiConventionalMemory,
+        EfiConventionalMemory, EfiConventionalMemory, EfiBootServicesData, EfiBootServicesData,
+        EfiBootServicesData, EfiBootServicesCode, EfiBootServicesCode, EfiLoaderData, EfiLoaderCode,
+        EfiRuntimeServicesCode, EfiRuntimeServicesData, EfiACPIReclaimMemory, EfiACPIMemoryNVS,
+        EfiReservedMemoryType, EfiUnusableMemory, EfiMemoryMappedIO
+    };
+
+    map.reserve(count);
+
+    for (unsigned int i = 0; i < count; i++) {
+        EFI_MEMORY_DESCRIPTOR desc;
+
+        memset(&desc, 0, sizeof(desc));
+
+        if (rng() % 8 == 0) // leave a hole
+            addr += (1 + (rng() % 256)) * EFI_PAGE_SIZE;
+
+        desc.Type = types[rng() % (sizeof(types) / sizeof(types[0]))];
+        desc.PhysicalStart = addr;
+        desc.NumberOfPages = 1 + (rng() % (1u << (rng() % 9)));
+        desc.Attribute = EFI_MEMORY_WB;
+
+        if (desc.Type == EfiRuntimeServicesCode || desc.Type == EfiRuntimeServicesData)
+            desc.Attribute |= EFI_MEMORY_RUNTIME;
+
+        addr += desc.NumberOfPages * EFI_PAGE_SIZE;
+
+        if (addr > SYNTHETIC_MAP_LIMIT)
+            break;
+
+        map.push_back(desc);
+    }
+
+    return map;
+}
+
+/* Reads a memory map as printed by the memmap command in the UEFI shell, i.e. lines like
+ *
+ *     BS_Data    0000000000001000-0000000000001FFF 0000000000000001 000000000000000F
+ *
+ * Anything that doesn't look like that, such as the header and totals, is skipped. */
+bool read_memmap(const char* fn, std::vector<EFI_MEMORY_DESCRIPTOR>& map) {
+    FILE* f;
+    char line[256];
+
+    static const struct {
+        const char* name;
+        uint32_t type;
+    } names[] = {
+        { "Reserved", EfiReservedMemoryType },
+        { "LoaderCode", EfiLoaderCode },
+        { "LoaderData", EfiLoaderData },
+        { "BS_Code", EfiBootServicesCode },
+        { "BS_Data", EfiBootServicesData },
+        { "RT_Code", EfiRuntimeServicesCode },
+        { "RT_Data", EfiRuntimeServicesData },
+        { "Available", EfiConventionalMemory },
+        { "Unusable", EfiUnusableMemory },
+        { "ACPI_Recl", EfiACPIReclaimMemory },
+        { "ACPI_NVS", EfiACPIMemoryNVS },
+        { "MMIO", EfiMemoryMappedIO },
+        { "MMIO_Port", EfiMemoryMappedIOPortSpace },
+        { "PalCode", EfiPalCode },
+        { "Persistent", EfiPersistentMemory }
+    };
+
+    f = fopen(fn, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s.\n", fn);
+        return false;
+    }
+
+    map.clear();
+
+    while (fgets(line, sizeof(line), f)) {
+        char type[32];
+        unsigned long long start, end, pages, attributes;
+        EFI_MEMORY_DESCRIPTOR desc;
+        bool found = false;
+
+        if (sscanf(line, "%31s %llx-%llx %llx %llx", type, &start, &end, &pages, &attributes) != 5)
+            continue;
+
+        memset(&desc, 0, sizeof(desc));
+
+        for (const auto& n : names) {
+            if (!strcmp(type, n.name)) {
+                desc.Type = n.type;
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) {
+            fprintf(stderr, "%s: unrecognized memory type %s.\n", fn, type);
+            fclose(f);
+            return false;
+        }
+
+        if (start % EFI_PAGE_SIZE || end + 1 != start + (pages * EFI_PAGE_SIZE)) {
+            fprintf(stderr, "%s: inconsistent line: %s", fn, line);
+            fclose(f);
+            return false;
+        }
+
+        desc.PhysicalStart = start;
+        desc.NumberOfPages = pages;
+        desc.Attribute = attributes;
+
+        map.push_back(desc);
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+// what process_memory_map does, with the VA planner replaced by a simple counter
+EFI_STATUS load_map(LIST_ENTRY* mappings, const std::vector<EFI_MEMORY_DESCRIPTOR>& map) {
+    EFI_STATUS Status;
+    uintptr_t va = LOADER_VA_BASE;
+
+    for (const auto& desc : map) {
+        TYPE_OF_MEMORY memory_type = map_memory_type(desc.Type);
+
+        if (desc.Type == EfiReservedMemoryType)
+            continue;
+
+        if (memory_type != LoaderFree) {
+            Status = add_mapping(shim_bs, mappings, (void*)va, (void*)(uintptr_t)desc.PhysicalStart,
+                                 desc.NumberOfPages, memory_type);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            va += desc.NumberOfPages * EFI_PAGE_SIZE;
+        } else {
+            Status = add_mapping(shim_bs, mappings, NULL, (void*)(uintptr_t)desc.PhysicalStart,
+                                 desc.NumberOfPages, LoaderFree);
+            if (EFI_ERROR(Status))
+                return Status;
+        }
+
+        if (desc.Type == EfiLoaderCode) {
+            Status = add_mapping(shim_bs, mappings, (void*)(uintptr_t)desc.PhysicalStart,
+                                 (void*)(uintptr_t)desc.PhysicalStart, desc.NumberOfPages, LoaderFirmwareTemporary);
+            if (EFI_ERROR(Status))
+                return Status;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
+/* Picks ranges out of free memory, as our own AllocatePages calls would. Each one is
+ * in a different descriptor, so they can never overlap. Some come in pairs with
+ * consecutive addresses, which merge_mappings ought to combine. */
+std::vector<allocation> plan_allocations(const std::vector<EFI_MEMORY_DESCRIPTOR>& map, unsigned int count,
+                                        uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<const EFI_MEMORY_DESCRIPTOR*> candidates;
+    std::vector<allocation> allocs;
+    uintptr_t va = SYSTEM_VA_BASE;
+
+    static const TYPE_OF_MEMORY types[] = {
+        LoaderSystemCode, LoaderBootDriver, LoaderRegistryData, LoaderNlsData, LoaderMemoryData, LoaderSystemBlock
+    };
+
+    for (const auto& desc : map) {
+        if (desc.Type == EfiReservedMemoryType || desc.Type == EfiLoaderCode || desc.NumberOfPages < 2)
+            continue;
+
+        if (map_memory_type(desc.Type) == LoaderFree)
+            candidates.push_back(&desc);
+    }
+
+    std::shuffle(candidates.begin(), candidates.end(), rng);
+
+    if (candidates.size() > count)
+        candidates.resize(count);
+
+    for (auto desc : candidates) {
+        allocation a;
+        unsigned int offset = rng() % (desc->NumberOfPages - 1);
+        unsigned int pages = 1 + (rng() % (desc->NumberOfPages - offset));
+
+        a.pa = (void*)(uintptr_t)(desc->PhysicalStart + (offset * EFI_PAGE_SIZE));
+        a.type = types[rng() % (sizeof(types) / sizeof(types[0]))];
+
+        if (rng() % 8 == 0) { // like the page table pool, which has no VA
+            a.va = NULL;
+            a.pages = pages;
+            a.type = LoaderMemoryData;
+            allocs.push_back(a);
+            continue;
+        }
+
+        a.va = (void*)va;
+
+        if (pages >= 2 && rng() % 3 == 0) {
+            a.pages = pages / 2;
+            allocs.push_back(a);
+
+            a.pa = (uint8_t*)a.pa + (a.pages * EFI_PAGE_SIZE);
+            a.va = (uint8_t*)a.va + (a.pages * EFI_PAGE_SIZE);
+            a.pages = pages - a.pages;
+        } else
+            a.pages = pages;
+
+        allocs.push_back(a);
+
+        va += pages * EFI_PAGE_SIZE;
+    }
+
+    return allocs;
+}
+
+EFI_STATUS add_allocations(LIST_ENTRY* mappings, const std::vector<allocation>& allocs) {
+    for (const auto& a : allocs) {
+        EFI_STATUS Status = add_mapping(shim_bs, mappings, a.va, a.pa, a.pages, a.type);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+/* The parts of enable_paging that build the tables. If large is set, identity maps get
+ * large pages, as the font pool and the runtime regions do there. */
+EFI_STATUS build_page_tables(LIST_ENTRY* mappings, size_t pool_pages, bool large) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    Status = shim_bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    pml4 = (HARDWARE_PTE_PAE*)(uintptr_t)addr;
+    memset(pml4, 0, EFI_PAGE_SIZE);
+
+    Status = add_mapping(shim_bs, mappings, NULL, pml4, 1, LoaderMemoryData);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = alloc_pt_pool(shim_bs, pool_pages);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    for (LIST_ENTRY* le = mappings->Flink; le != mappings; le = le->Flink) {
+        mapping* m = _CR(le, mapping, list_entry);
+
+        if (!m->va)
+            continue;
+
+        Status = map_memory(shim_bs, mappings, (uintptr_t)m->va, (uintptr_t)m->pa, m->pages, large && m->va == m->pa);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    return finish_pt_pool(shim_bs, mappings);
+}
+
+static void add_range(std::vector<range>& ranges, uint64_t start, uint64_t end) {
+    if (!ranges.empty() && ranges.back().end == start)
+        ranges.back().end = end;
+    else
+        ranges.push_back({ start, end });
+}
+
+/* The invariants the rest of Quibble relies on: the list is sorted by physical address,
+ * nothing overlaps, and it describes exactly the memory the firmware told us about -
+ * plus anything the shim handed out, i.e. page tables. */
+bool check_mappings(LIST_ENTRY* mappings, const std::vector<EFI_MEMORY_DESCRIPTOR>& map) {
+    std::vector<range> expected, actual;
+    uint64_t prev_end = 0;
+    bool first = true;
+
+    if (!verify_mappings(mappings))
+        return false;
+
+    for (LIST_ENTRY* le = mappings->Flink; le != mappings; le = le->Flink) {
+        mapping* m = _CR(le, mapping, list_entry);
+        uint64_t start = (uintptr_t)m->pa;
+        uint64_t end = start + ((uint64_t)m->pages * EFI_PAGE_SIZE);
+
+        if (m->pages == 0 || start % EFI_PAGE_SIZE != 0) {
+            fprintf(stderr, "Bad mapping at %llx, %u pages.\n", (unsigned long long)start, m->pages);
+            return false;
+        }
+
+        if (!first && start < prev_end) {
+            fprintf(stderr, "Mapping at %llx overlaps previous one, which ends at %llx.\n",
+                    (unsigned long long)start, (unsigned long long)prev_end);
+            return false;
+        }
+
+        first = false;
+        prev_end = end;
+
+        if (start < SHIM_PAGES_BASE)
+            add_range(actual, start, end);
+    }
+
+    {
+        std::vector<range> descs;
+
+        for (const auto& desc : map) {
+            if (desc.Type != EfiReservedMemoryType)
+                descs.push_back({ desc.PhysicalStart, desc.PhysicalStart + (desc.NumberOfPages * EFI_PAGE_SIZE) });
+        }
+
+        std::sort(descs.begin(), descs.end(), [](const range& a, const range& b) {
+            return a.start < b.start;
+        });
+
+        for (const auto& r : descs) {
+            add_range(expected, r.start, r.end);
+        }
+    }
+
+    if (actual.size() != expected.size()) {
+        fprintf(stderr, "Mappings cover %zu ranges, memory map has %zu.\n", actual.size(), expected.size());
+        return false;
+    }
+
+    for (size_t i = 0; i < actual.size(); i++) {
+        if (actual[i].start != expected[i].start || actual[i].end != expected[i].end) {
+            fprintf(stderr, "Mappings cover %llx-%llx, memory map has %llx-%llx.\n",
+                    (unsigned long long)actual[i].start, (unsigned long long)actual[i].end,
+                    (unsigned long long)expected[i].start, (unsigned long long)expected[i].end);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// find_virtual_address against the allocations we asked for, at both ends of each
+bool check_translations(LIST_ENTRY* mappings, const std::vector<allocation>& allocs) {
+    for (const auto& a : allocs) {
+        if (!a.va)
+            continue;
+
+        uint8_t* pas[] = { (uint8_t*)a.pa, (uint8_t*)a.pa + (a.pages * EFI_PAGE_SIZE) - 1 };
+
+        for (auto pa : pas) {
+            void* expected = (uint8_t*)a.va + (pa - (uint8_t*)a.pa);
+            void* va = find_virtual_address(pa, mappings);
+
+            if (va != expected) {
+                fprintf(stderr, "find_virtual_address(%p) returned %p, expected %p.\n", pa, va, expected);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static uintptr_t canonical(uint64_t va) {
+    if (va & 0x800000000000)
+        va |= 0xffff000000000000;
+
+    return (uintptr_t)va;
+}
+
+static HARDWARE_PTE_PAE* table_at(const HARDWARE_PTE_PAE& entry) {
+    uint64_t ptr = entry.PageFrameNumber;
+
+    ptr <<= EFI_PAGE_SHIFT;
+
+    return (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
+}
+
+/* Walks every valid entry in the tables and checks it against the mappings, then
+ * checks that the number of pages mapped is the number we asked for - so everything
+ * in the tables is right, and nothing we asked for is missing. */
+bool check_page_tables(LIST_ENTRY* mappings, size_t* large_entries) {
+    std::vector<mapping*> by_va;
+    uint64_t expected_pages = 0, mapped_pages = 0;
+    size_t large = 0;
+
+    for (LIST_ENTRY* le = mappings->Flink; le != mappings; le = le->Flink) {
+        mapping* m = _CR(le, mapping, list_entry);
+
+        if (m->va) {
+            by_va.push_back(m);
+            expected_pages += m->pages;
+        }
+    }
+
+    std::sort(by_va.begin(), by_va.end(), [](mapping* a, mapping* b) {
+        return (uintptr_t)a->va < (uintptr_t)b->va;
+    });
+
+    auto check_leaf = [&](uintptr_t va, uint64_t pa, uint64_t pages) {
+        auto it = std::upper_bound(by_va.begin(), by_va.end(), va, [](uintptr_t va, mapping* m) {
+            return va < (uintptr_t)m->va;
+        });
+
+        if (it != by_va.begin()) {
+            mapping* m = *(it - 1);
+            uintptr_t offset = va - (uintptr_t)m->va;
+
+            if (offset + (pages * EFI_PAGE_SIZE) <= (uint64_t)m->pages * EFI_PAGE_SIZE) {
+                if (pa == (uintptr_t)m->pa + offset) {
+                    mapped_pages += pages;
+                    return true;
+                }
+
+                fprintf(stderr, "%lx maps to %llx, expected %lx.\n", va, (unsigned long long)pa,
+                        (uintptr_t)m->pa + offset);
+                return false;
+            }
+        }
+
+        fprintf(stderr, "%lx is mapped, but not in any mapping.\n", va);
+        return false;
+    };
+
+    for (unsigned int i = 0; i < 512; i++) {
+        if (!pml4[i].Valid)
+            continue;
+
+        auto pdpt = table_at(pml4[i]);
+
+        for (unsigned int j = 0; j < 512; j++) {
+            if (!pdpt[j].Valid)
+                continue;
+
+            uint64_t va = ((uint64_t)i << 39) | ((uint64_t)j << 30);
+
+            if (pdpt[j].LargePage) {
+                if (!check_leaf(canonical(va), (uintptr_t)table_at(pdpt[j]), 0x40000))
+                    return false;
+
+                large++;
+
+                continue;
+            }
+
+            auto pd = table_at(pdpt[j]);
+
+            for (unsigned int k = 0; k < 512; k++) {
+                if (!pd[k].Valid)
+                    continue;
+
+                uint64_t va2 = va | ((uint64_t)k << 21);
+
+                if (pd[k].LargePage) {
+                    if (!check_leaf(canonical(va2), (uintptr_t)table_at(pd[k]), 0x200))
+                        return false;
+
+                    large++;
+
+                    continue;
+                }
+
+                auto pt = table_at(pd[k]);
+
+                for (unsigned int l = 0; l < 512; l++) {
+                    if (!pt[l].Valid)
+                        continue;
+
+                    if (!check_leaf(canonical(va2 | ((uint64_t)l << 12)), (uintptr_t)table_at(pt[l]), 1))
+                        return false;
+                }
+            }
+        }
+    }
+
+    if (mapped_pages != expected_pages) {
+        fprintf(stderr, "Page tables map %llu pages, mappings have %llu.\n", (unsigned long long)mapped_pages,
+                (unsigned long long)expected_pages);
+        return false;
+    }
+
+    if (large_entries)
+        *large_entries = large;
+
+    return true;
+}
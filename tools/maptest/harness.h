@@ -0,0 +1,46 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include "shim.h"
+
+/* Shared between maptest and mapbench: making memory maps, feeding them through the
+ * mapping code the way process_memory_map and enable_paging do, and checking the
+ * results. */
+
+typedef struct {
+    void* va;
+    void* pa;
+    unsigned int pages;
+    TYPE_OF_MEMORY type;
+} allocation;
+
+std::vector<EFI_MEMORY_DESCRIPTOR> synthetic_map(unsigned int count, uint32_t seed);
+bool read_memmap(const char* fn, std::vector<EFI_MEMORY_DESCRIPTOR>& map);
+
+EFI_STATUS load_map(LIST_ENTRY* mappings, const std::vector<EFI_MEMORY_DESCRIPTOR>& map);
+std::vector<allocation> plan_allocations(const std::vector<EFI_MEMORY_DESCRIPTOR>& map, unsigned int count,
+                                        uint32_t seed);
+EFI_STATUS add_allocations(LIST_ENTRY* mappings, const std::vector<allocation>& allocs);
+EFI_STATUS build_page_tables(LIST_ENTRY* mappings, size_t pool_pages, bool large);
+
+bool check_mappings(LIST_ENTRY* mappings, const std::vector<EFI_MEMORY_DESCRIPTOR>& map);
+bool check_translations(LIST_ENTRY* mappings, const std::vector<allocation>& allocs);
+bool check_page_tables(LIST_ENTRY* mappings, size_t* large_entries = nullptr);
@@ -0,0 +1,133 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Times the mapping code against large synthetic memory maps, so that anything which
+ * makes it scale worse than it should shows up before it gets anywhere near a real
+ * machine. Run as:
+ *
+ *     mapbench [descriptors...]
+ *
+ * The default sizes go well beyond anything we've seen a firmware produce. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "harness.h"
+
+static const unsigned int default_counts[] = { 10000, 20000, 50000 };
+static const unsigned int iterations = 5;
+
+typedef struct {
+    double load;
+    double allocate;
+    double lookup;
+    double merge;
+    double page_tables;
+} timings;
+
+static double elapsed(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool run(const std::vector<EFI_MEMORY_DESCRIPTOR>& map, const std::vector<allocation>& allocs, timings& t) {
+    LIST_ENTRY* mappings;
+    std::chrono::steady_clock::time_point start;
+    uintptr_t sum = 0;
+
+    // a new list head each time, so that nothing from the last run is reused
+    if (EFI_ERROR(arena_alloc(shim_bs, sizeof(LIST_ENTRY), (void**)&mappings)))
+        return false;
+
+    InitializeListHead(mappings);
+
+    start = std::chrono::steady_clock::now();
+    if (EFI_ERROR(load_map(mappings, map)))
+        return false;
+    t.load = elapsed(start);
+
+    start = std::chrono::steady_clock::now();
+    if (EFI_ERROR(add_allocations(mappings, allocs)))
+        return false;
+    t.allocate = elapsed(start);
+
+    start = std::chrono::steady_clock::now();
+    for (const auto& a : allocs) {
+        if (a.va)
+            sum += (uintptr_t)find_virtual_address(a.pa, mappings);
+    }
+    t.lookup = elapsed(start);
+
+    start = std::chrono::steady_clock::now();
+    merge_mappings(mappings);
+    t.merge = elapsed(start);
+
+    start = std::chrono::steady_clock::now();
+    if (EFI_ERROR(build_page_tables(mappings, 1024, false)))
+        return false;
+    t.page_tables = elapsed(start);
+
+    // make sure we've been timing something that works
+    return sum != 0 && check_mappings(mappings, map) && check_page_tables(mappings);
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<unsigned int> counts;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            counts.push_back(strtoul(argv[i], NULL, 10));
+        }
+    } else
+        counts.assign(default_counts, default_counts + (sizeof(default_counts) / sizeof(default_counts[0])));
+
+    if (!shim_init())
+        return 1;
+
+    printf("%-12s %-12s %10s %10s %10s %10s %12s  (best of %u, ms)\n", "descriptors", "allocations", "load",
+           "allocate", "lookup", "merge", "page tables", iterations);
+
+    for (auto count : counts) {
+        auto map = synthetic_map(count, count);
+        auto allocs = plan_allocations(map, count / 4, count);
+        timings best = {};
+
+        for (unsigned int i = 0; i < iterations; i++) {
+            timings t;
+
+            if (!run(map, allocs, t)) {
+                fprintf(stderr, "Run with %u descriptors failed.\n", count);
+                return 1;
+            }
+
+            if (i == 0) {
+                best = t;
+                continue;
+            }
+
+            if (t.load < best.load) best.load = t.load;
+            if (t.allocate < best.allocate) best.allocate = t.allocate;
+            if (t.lookup < best.lookup) best.lookup = t.lookup;
+            if (t.merge < best.merge) best.merge = t.merge;
+            if (t.page_tables < best.page_tables) best.page_tables = t.page_tables;
+        }
+
+        printf("%-12zu %-12zu %10.3f %10.3f %10.3f %10.3f %12.3f\n", map.size(), allocs.size(), best.load,
+               best.allocate, best.lookup, best.merge, best.page_tables);
+    }
+
+    return 0;
+}
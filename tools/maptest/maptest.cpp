@@ -0,0 +1,222 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Runs add_mapping, merge_mappings, find_virtual_address and map_memory against
+ * synthetic memory maps and any recorded ones given on the command line, checking
+ * the invariants after each step. Run as:
+ *
+ *     maptest [memmap.txt...]
+ *
+ * where each file is the output of the memmap command in the UEFI shell. */
+
+#include <stdio.h>
+#include <string.h>
+#include <random>
+#include <algorithm>
+#include "harness.h"
+#include "pagetable.h"
+
+#define CHECK(x) if (!(x)) { fprintf(stderr, "%s:%u: check failed: %s\n", __FILE__, __LINE__, #x); return false; }
+
+static LIST_ENTRY* mappings;
+
+// the mappings come out of the arena and are never freed, so each run gets a new list head from there too
+static bool reset_mappings() {
+    if (EFI_ERROR(arena_alloc(shim_bs, sizeof(LIST_ENTRY), (void**)&mappings)))
+        return false;
+
+    InitializeListHead(mappings);
+
+    return true;
+}
+
+/* Loads the map, carves allocations out of its free memory, merges, then builds page
+ * tables, checking everything at each stage. */
+static bool run_map(const std::vector<EFI_MEMORY_DESCRIPTOR>& map, uint32_t seed, size_t pool_pages) {
+    std::vector<allocation> allocs = plan_allocations(map, map.size() / 4, seed);
+
+    CHECK(reset_mappings());
+
+    CHECK(!EFI_ERROR(load_map(mappings, map)));
+    CHECK(check_mappings(mappings, map));
+
+    CHECK(!EFI_ERROR(add_allocations(mappings, allocs)));
+    CHECK(check_mappings(mappings, map));
+    CHECK(check_translations(mappings, allocs));
+
+    merge_mappings(mappings);
+    CHECK(check_mappings(mappings, map));
+    CHECK(check_translations(mappings, allocs));
+
+    CHECK(!EFI_ERROR(build_page_tables(mappings, pool_pages, false)));
+    CHECK(check_mappings(mappings, map));
+    CHECK(check_page_tables(mappings));
+
+    return true;
+}
+
+static bool test_synthetic() {
+    static const unsigned int counts[] = { 1, 2, 10, 100, 1000 };
+
+    for (auto count : counts) {
+        for (uint32_t seed = 1; seed <= 20; seed++) {
+            auto map = synthetic_map(count, seed);
+
+            // generous enough for the pool never to run out, then too small to last
+            CHECK(run_map(map, seed, 1024));
+            CHECK(run_map(map, seed, 1));
+        }
+    }
+
+    return true;
+}
+
+// the firmware doesn't have to give us a sorted map, and the insertion order shouldn't matter
+static bool test_unsorted() {
+    for (uint32_t seed = 1; seed <= 20; seed++) {
+        auto map = synthetic_map(500, seed);
+        std::mt19937 rng(seed);
+
+        std::shuffle(map.begin(), map.end(), rng);
+
+        CHECK(run_map(map, seed, 64));
+    }
+
+    return true;
+}
+
+// boot() can be re-entered with the list at the same address, which mustn't reuse the old index
+static bool test_reinit() {
+    static LIST_ENTRY list;
+    auto map = synthetic_map(300, 1);
+    auto map2 = synthetic_map(200, 2);
+
+    for (auto m : { &map, &map2, &map }) {
+        std::vector<allocation> allocs = plan_allocations(*m, m->size() / 4, 1);
+
+        // as boot does before process_memory_map
+        InitializeListHead(&list);
+        index_reset(&list);
+
+        CHECK(!EFI_ERROR(load_map(&list, *m)));
+        CHECK(!EFI_ERROR(add_allocations(&list, allocs)));
+        CHECK(check_mappings(&list, *m));
+        CHECK(check_translations(&list, allocs));
+
+        merge_mappings(&list);
+        CHECK(check_mappings(&list, *m));
+        CHECK(check_translations(&list, allocs));
+    }
+
+    return true;
+}
+
+// 2 MB and 1 GB pages for identity maps, and splitting them when something smaller lands inside
+static bool test_large_pages() {
+    std::vector<EFI_MEMORY_DESCRIPTOR> map;
+    EFI_MEMORY_DESCRIPTOR desc;
+    size_t large;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.Type = EfiConventionalMemory;
+    desc.PhysicalStart = 0;
+    desc.NumberOfPages = 0x100000; // 4 GB
+    desc.Attribute = EFI_MEMORY_WB;
+    map.push_back(desc);
+
+    huge_pages = true;
+
+    CHECK(reset_mappings());
+    CHECK(!EFI_ERROR(load_map(mappings, map)));
+
+    // 1 GB, then 4 MB
+    CHECK(!EFI_ERROR(add_mapping(shim_bs, mappings, (void*)0x40000000, (void*)0x40000000, 0x40400,
+                                 LoaderFirmwareTemporary)));
+
+    // starts and ends off a 2 MB boundary, so only the 2 MB in the middle can be a large page
+    CHECK(!EFI_ERROR(add_mapping(shim_bs, mappings, (void*)0x90001000, (void*)0x90001000, 0x400,
+                                 LoaderFirmwareTemporary)));
+
+    CHECK(!EFI_ERROR(build_page_tables(mappings, 64, true)));
+    CHECK(check_mappings(mappings, map));
+    CHECK(check_page_tables(mappings, &large));
+    CHECK(large == 4);
+
+    // splits the 1 GB page, and the 2 MB page it then finds
+    CHECK(!EFI_ERROR(map_memory(shim_bs, mappings, 0x40201000, 0x40201000, 1, false)));
+    CHECK(check_page_tables(mappings, &large));
+    CHECK(large == 511 + 3);
+
+    // and a 2 MB page on its own
+    CHECK(!EFI_ERROR(map_memory(shim_bs, mappings, 0x80200000, 0x80200000, 1, false)));
+    CHECK(check_page_tables(mappings, &large));
+    CHECK(large == 511 + 2);
+
+    huge_pages = false;
+
+    return true;
+}
+
+static bool test_recorded(const char* fn) {
+    std::vector<EFI_MEMORY_DESCRIPTOR> map;
+
+    CHECK(read_memmap(fn, map));
+    CHECK(!map.empty());
+
+    for (uint32_t seed = 1; seed <= 20; seed++) {
+        CHECK(run_map(map, seed, 64));
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned int failed = 0;
+
+    static const struct {
+        const char* name;
+        bool (*func)();
+    } tests[] = {
+        { "synthetic", test_synthetic },
+        { "unsorted", test_unsorted },
+        { "reinit", test_reinit },
+        { "large_pages", test_large_pages },
+    };
+
+    if (!shim_init())
+        return 1;
+
+    for (const auto& t : tests) {
+        bool ret = t.func();
+
+        printf("%s: %s\n", t.name, ret ? "passed" : "FAILED");
+
+        if (!ret)
+            failed++;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        bool ret = test_recorded(argv[i]);
+
+        printf("%s: %s\n", argv[i], ret ? "passed" : "FAILED");
+
+        if (!ret)
+            failed++;
+    }
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "shim.h"
+#include "print.h"
+
+static const size_t SHIM_PAGES_SIZE = 0x400000000; // 16 GB, most of which is never touched
+
+static uint8_t* pages_next;
+static uint8_t* pages_end;
+
+/* A bump allocator is enough here - nothing we run frees pages it still needs, and the
+ * pages we hand out are never reused, so use-after-free shows up as a wrong answer
+ * rather than going unnoticed. */
+static EFI_STATUS EFIAPI allocate_pages(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, UINTN NoPages,
+                                        EFI_PHYSICAL_ADDRESS* Memory) {
+    UNUSED(MemoryType);
+
+    if (Type != AllocateAnyPages || NoPages == 0)
+        return EFI_INVALID_PARAMETER;
+
+    if (NoPages > (size_t)(pages_end - pages_next) / EFI_PAGE_SIZE)
+        return EFI_OUT_OF_RESOURCES;
+
+    *Memory = (uintptr_t)pages_next;
+    pages_next += NoPages * EFI_PAGE_SIZE;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI free_pages(EFI_PHYSICAL_ADDRESS Memory, UINTN NoPages) {
+    if (Memory % EFI_PAGE_SIZE || Memory < SHIM_PAGES_BASE || Memory + (NoPages * EFI_PAGE_SIZE) > (uintptr_t)pages_next)
+        return EFI_NOT_FOUND;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI allocate_pool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID** Buffer) {
+    UNUSED(PoolType);
+
+    *Buffer = malloc(Size);
+
+    return *Buffer ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI free_pool(VOID* Buffer) {
+    free(Buffer);
+
+    return EFI_SUCCESS;
+}
+
+static EFI_BOOT_SERVICES boot_services = {
+    allocate_pages,
+    free_pages,
+    allocate_pool,
+    free_pool
+};
+
+EFI_BOOT_SERVICES* shim_bs = &boot_services;
+
+bool shim_init() {
+    void* p = mmap((void*)SHIM_PAGES_BASE, SHIM_PAGES_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (p == MAP_FAILED || p != (void*)SHIM_PAGES_BASE) {
+        perror("mmap");
+        return false;
+    }
+
+    pages_next = (uint8_t*)p;
+    pages_end = pages_next + SHIM_PAGES_SIZE;
+
+    return true;
+}
+
+size_t shim_pages_used() {
+    return (pages_next - (uint8_t*)SHIM_PAGES_BASE) / EFI_PAGE_SIZE;
+}
+
+// print.cpp
+
+void print_string(std::string_view s) {
+    fwrite(s.data(), 1, s.size(), stderr);
+}
+
+void print_error(const char* func, EFI_STATUS Status) {
+    fprintf(stderr, "%s returned %llx.\n", func, (unsigned long long)Status);
+}
+
+// misc.cpp - stpcpy comes from libc
+
+extern "C" char* hex_to_str(char* s, uint64_t v, unsigned int min_length) {
+    return s + sprintf(s, "%0*llx", (int)min_length, (unsigned long long)v);
+}
+
+extern "C" char* dec_to_str(char* s, uint64_t v) {
+    return s + sprintf(s, "%llu", (unsigned long long)v);
+}
@@ -0,0 +1,33 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "quibble.h"
+#include "misc.h"
+
+/* Stand-ins for the firmware, so that the mapping and page table code can be built and
+ * run on the host. Pages come from a fixed reservation below 1 TB, so that their
+ * addresses fit in a page table entry - the tables are written through these addresses,
+ * just as they are through physical addresses before we switch cr3. */
+
+#define SHIM_PAGES_BASE 0x8000000000 // 512 GB, above anything the tests put in a memory map
+
+extern EFI_BOOT_SERVICES* shim_bs;
+
+bool shim_init();
+size_t shim_pages_used();
@@ -0,0 +1,242 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Pre-renders the glyphs Quibble uses most at the sizes common DPIs give, so that it
+ * can draw its console without having to start FreeType. Run as:
+ *
+ *     mkfontcache font.ttf quibble-font.bin [dpi...]
+ *
+ * and copy the result to the ESP, next to quibble.efi. Quibble checks the font
+ * size and hash, so a cache left over from a different font.ttf is ignored. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <ft2build.h>
+#include <freetype/freetype.h>
+#include <hb.h>
+#include "fontcache.h"
+
+// needs to match font_size_pt in print.cpp
+static const unsigned int font_size_pt = 12;
+
+// every size from 72 to 192 DPI, which covers anything but the most unusual screens
+static const unsigned int default_min_dpi = 72;
+static const unsigned int default_max_dpi = 192;
+
+// the only thing outside ASCII we print is ELLIPSIS
+static const uint32_t extra_codepoints[] = { 0x2026 };
+
+static uint32_t hash_font(const std::vector<char>& data) {
+    uint32_t hash = 0x811c9dc5; // FNV-1a, as hash_text in print.cpp
+
+    for (auto c : data) {
+        hash ^= (uint8_t)c;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static bool add_glyph(FT_Face face, hb_font_t* font, uint32_t cp, std::vector<font_cache_glyph>& glyphs,
+                      std::vector<uint8_t>& bitmaps) {
+    hb_codepoint_t glyph;
+    font_cache_glyph cg;
+
+    if (!hb_font_get_nominal_glyph(font, cp, &glyph))
+        glyph = 0; // .notdef, as HarfBuzz would give us
+
+    if (FT_Load_Glyph(face, glyph, FT_LOAD_RENDER | FT_RENDER_MODE_NORMAL)) {
+        fprintf(stderr, "FT_Load_Glyph failed for U+%04X\n", cp);
+        return false;
+    }
+
+    auto& bitmap = face->glyph->bitmap;
+
+    if (bitmap.pixel_mode != FT_PIXEL_MODE_GRAY && bitmap.width != 0) {
+        fprintf(stderr, "Unsupported pixel mode %u for U+%04X\n", bitmap.pixel_mode, cp);
+        return false;
+    }
+
+    memset(&cg, 0, sizeof(cg));
+
+    cg.codepoint = cp;
+    cg.glyph = glyph;
+    cg.advance = hb_font_get_glyph_h_advance(font, glyph);
+    cg.left = face->glyph->bitmap_left;
+    cg.top = face->glyph->bitmap_top;
+    cg.width = bitmap.width;
+    cg.rows = bitmap.rows;
+    cg.offset = bitmaps.size(); // fixed up later
+
+    // pitch can be padded or negative, so copy row by row
+
+    for (unsigned int y = 0; y < bitmap.rows; y++) {
+        auto row = bitmap.buffer + ((int)y * bitmap.pitch);
+
+        bitmaps.insert(bitmaps.end(), row, row + bitmap.width);
+    }
+
+    glyphs.push_back(cg);
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<unsigned int> dpis;
+    std::vector<font_cache_strike> strikes;
+    std::vector<std::vector<font_cache_glyph>> strike_glyphs;
+    std::vector<uint8_t> bitmaps;
+    FT_Library ft;
+    FT_Face face;
+    font_cache_header h;
+    uint32_t offset;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: mkfontcache font.ttf quibble-font.bin [dpi...]\n");
+        return 1;
+    }
+
+    for (int i = 3; i < argc; i++) {
+        dpis.push_back(strtoul(argv[i], nullptr, 10));
+    }
+
+    if (dpis.empty()) {
+        for (unsigned int dpi = default_min_dpi; dpi <= default_max_dpi; dpi++) {
+            dpis.push_back(dpi);
+        }
+    }
+
+    std::ifstream f(argv[1], std::ios::binary);
+
+    if (!f.good()) {
+        fprintf(stderr, "Could not open %s.\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<char> data{std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+
+    if (FT_Init_FreeType(&ft)) {
+        fprintf(stderr, "FT_Init_FreeType failed.\n");
+        return 1;
+    }
+
+    if (FT_New_Memory_Face(ft, (const FT_Byte*)data.data(), data.size(), 0, &face)) {
+        fprintf(stderr, "FT_New_Memory_Face failed.\n");
+        return 1;
+    }
+
+    auto blob = hb_blob_create(data.data(), data.size(), HB_MEMORY_MODE_READONLY, nullptr, nullptr);
+    auto hb_face = hb_face_create(blob, 0);
+    auto font = hb_font_create(hb_face);
+
+    for (auto dpi : dpis) {
+        font_cache_strike s;
+        std::vector<font_cache_glyph> glyphs;
+        unsigned int ppem = font_ppem(font_size_pt, dpi);
+        bool have_size = false;
+
+        // Quibble looks strikes up by size, so neighbouring DPIs often share one
+        for (const auto& s2 : strikes) {
+            if (s2.x_ppem == ppem) {
+                have_size = true;
+                break;
+            }
+        }
+
+        if (have_size)
+            continue;
+
+        if (FT_Set_Pixel_Sizes(face, ppem, ppem)) {
+            fprintf(stderr, "FT_Set_Pixel_Sizes failed for %u pixels.\n", ppem);
+            return 1;
+        }
+
+        // same as start_freetype
+        hb_font_set_scale(font, ppem * 64, ppem * 64);
+
+        for (uint32_t cp = ' '; cp <= '~'; cp++) {
+            if (!add_glyph(face, font, cp, glyphs, bitmaps))
+                return 1;
+        }
+
+        for (auto cp : extra_codepoints) {
+            if (!add_glyph(face, font, cp, glyphs, bitmaps))
+                return 1;
+        }
+
+        s.dpi = dpi;
+        s.x_ppem = face->size->metrics.x_ppem;
+        s.y_ppem = face->size->metrics.y_ppem;
+        s.height = face->size->metrics.height / 64;
+        s.num_glyphs = glyphs.size();
+        s.offset = 0;
+
+        strikes.push_back(s);
+        strike_glyphs.push_back(glyphs);
+    }
+
+    // header, then strikes, then glyphs, then bitmaps
+
+    offset = sizeof(font_cache_header) + (strikes.size() * sizeof(font_cache_strike));
+
+    for (size_t i = 0; i < strikes.size(); i++) {
+        strikes[i].offset = offset;
+        offset += strike_glyphs[i].size() * sizeof(font_cache_glyph);
+    }
+
+    for (auto& glyphs : strike_glyphs) {
+        for (auto& cg : glyphs) {
+            cg.offset += offset;
+        }
+    }
+
+    h.signature = FONT_CACHE_SIGNATURE;
+    h.version = FONT_CACHE_VERSION;
+    h.font_size = data.size();
+    h.font_hash = hash_font(data);
+    h.point_size = font_size_pt;
+    h.num_strikes = strikes.size();
+
+    std::ofstream out(argv[2], std::ios::binary);
+
+    if (!out.good()) {
+        fprintf(stderr, "Could not open %s for writing.\n", argv[2]);
+        return 1;
+    }
+
+    out.write((const char*)&h, sizeof(h));
+    out.write((const char*)strikes.data(), strikes.size() * sizeof(font_cache_strike));
+
+    for (const auto& glyphs : strike_glyphs) {
+        out.write((const char*)glyphs.data(), glyphs.size() * sizeof(font_cache_glyph));
+    }
+
+    out.write((const char*)bitmaps.data(), bitmaps.size());
+
+    hb_font_destroy(font);
+    hb_face_destroy(hb_face);
+    hb_blob_destroy(blob);
+    FT_Done_Face(face);
+    FT_Done_FreeType(ft);
+
+    return 0;
+}